@@ -254,7 +254,8 @@ AC_DEFUN([PAM_MYSQL_CHECK_LIBMYSQLCLIENT], [
 
   ac_save_CPPFLAGS="$CPPFLAGS"
   CPPFLAGS="$CPPFLAGS $INCLUDES"
-  AC_CHECK_FUNCS([mysql_real_query mysql_real_escape_string make_scrambled_password_323], [], [])
+  AC_CHECK_FUNCS([mysql_real_query mysql_real_escape_string make_scrambled_password_323 mysql_real_query_start mysql_get_ssl_session_data], [], [])
+  AC_CHECK_TYPES([my_bool], [], [], [[#include <mysql.h>]])
   CPPFLAGS="$ac_save_CPPFLAGS"
 ])
 
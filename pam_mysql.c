@@ -78,6 +78,22 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include <time.h>
 
 #ifdef HAVE_ERRNO_H
@@ -134,13 +150,29 @@
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <assert.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
 #endif
 
 #ifdef HAVE_MYSQL_H
 #include <mysql.h>
 #endif
 
+#ifndef HAVE_MY_BOOL
+#include <stdbool.h>
+typedef bool my_bool;
+#endif
+
 /*
  * Definitions for the externally accessible functions in this file (these
  * definitions are required for static modules but strongly encouraged
@@ -229,7 +261,8 @@ enum _pam_mysql_err_t {
     PAM_MYSQL_ERR_IO = 7,
     PAM_MYSQL_ERR_SYNTAX = 8,
     PAM_MYSQL_ERR_EOF = 9,
-    PAM_MYSQL_ERR_NOTIMPL = 10
+    PAM_MYSQL_ERR_NOTIMPL = 10,
+    PAM_MYSQL_ERR_TIMEOUT = 11
 };
 
 enum _pam_mysql_config_token_t {
@@ -248,8 +281,126 @@ enum _pam_mysql_config_token_t {
 #define PAM_MYSQL_CAP_CHAUTHTOK_SELF    0x0001
 #define PAM_MYSQL_CAP_CHAUTHTOK_OTHERS    0x0002
 
+/* how long to wait for a connection when the pool is full (seconds) */
+#define PAM_MYSQL_POOL_WAIT 5
+
+/* entries of the sqllog queue (see logasync) */
+#define PAM_MYSQL_LOG_MSG_MAX   64
+#define PAM_MYSQL_LOG_FIELD_MAX 256
+
+#define PAM_MYSQL_LOG_DROP_OLDEST 0
+#define PAM_MYSQL_LOG_BLOCK       1
+#define PAM_MYSQL_LOG_SPILL       2
+
+/* how long "block" waits for room without a deadline (seconds) */
+#define PAM_MYSQL_LOG_BLOCK_WAIT  5
+
+/* entries held back per context (see logcoalesce) */
+#define PAM_MYSQL_LOG_PENDING_MAX 16
+
+/* records of the sqllog spool file (see logspool) */
+#define PAM_MYSQL_SPOOL_MAGIC   0x504d534c /* "PMSL" */
+#define PAM_MYSQL_SPOOL_DONE    0x504d5344 /* "PMSD", once replayed */
+#define PAM_MYSQL_SPOOL_SUFFIX  ".replay"
+#define PAM_MYSQL_SPOOL_SETTLE  2 /* seconds */
+
+/* protocol spoken with pam_mysqld (seconds for the timeout) */
+#define PAM_MYSQL_DAEMON_VERSION    1
+#define PAM_MYSQL_DAEMON_MSG_MAX    65535
+#define PAM_MYSQL_DAEMON_FIELDS_MAX 128
+#define PAM_MYSQL_DAEMON_NULL       0xffff
+#define PAM_MYSQL_DAEMON_TIMEOUT    30
+#define PAM_MYSQL_DAEMON_SOCKET     "/var/run/pam_mysqld.sock"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define PAM_MYSQL_OP_HELLO  1
+#define PAM_MYSQL_OP_CHECK  2
+#define PAM_MYSQL_OP_STAT   3
+#define PAM_MYSQL_OP_UPDATE 4
+#define PAM_MYSQL_OP_LOG    5
+
+/* prepared statements kept per connection */
+#define PAM_MYSQL_STMT_PASSWD   0
+#define PAM_MYSQL_STMT_STAT     1
+#define PAM_MYSQL_STMT_UPDATE   2
+#define PAM_MYSQL_STMT_MAX      3
+
+#define PAM_MYSQL_STMT_MAX_PARAMS   2
+#define PAM_MYSQL_STMT_MAX_COLS     2
+#define PAM_MYSQL_STMT_BUFLEN       256
+
+typedef struct _pam_mysql_stmt_cache_t {
+    MYSQL_STMT *stmt[PAM_MYSQL_STMT_MAX];
+    char *sql[PAM_MYSQL_STMT_MAX];
+    int unpreparable[PAM_MYSQL_STMT_MAX];
+    char buf[PAM_MYSQL_STMT_MAX_COLS][PAM_MYSQL_STMT_BUFLEN];
+    char *big[PAM_MYSQL_STMT_MAX_COLS];
+    char *row[PAM_MYSQL_STMT_MAX_COLS];
+} pam_mysql_stmt_cache_t;
+
+typedef struct _pam_mysql_pool_conn_t {
+    MYSQL *mysql_hdl;
+    pam_mysql_stmt_cache_t stmts;
+    unsigned long long fp;
+    unsigned long long host;
+    time_t last_used;
+    pid_t pid;
+    int in_use;
+    int broken;
+    struct _pam_mysql_pool_conn_t *next;
+} pam_mysql_pool_conn_t;
+
+/* segments of a compiled query template */
+#define PAM_MYSQL_SEG_LITERAL   0
+#define PAM_MYSQL_SEG_ESCAPE    1 /* %s */
+#define PAM_MYSQL_SEG_RAW       2 /* %S */
+#define PAM_MYSQL_SEG_UINT      3 /* %u */
+#define PAM_MYSQL_SEG_OPTION    4 /* %{option} */
+
+struct _pam_mysql_option_t;
+
+typedef struct _pam_mysql_segment_t {
+    int type;
+    size_t off;
+    size_t len;
+    struct _pam_mysql_option_t *opt;
+} pam_mysql_segment_t;
+
+typedef struct _pam_mysql_template_t {
+    const char *src;
+    unsigned int gen;
+    pam_mysql_segment_t *segs;
+    size_t nsegs;
+    size_t literal_len;
+    char *text;
+    struct _pam_mysql_template_t *next;
+} pam_mysql_template_t;
+
+typedef struct _pam_mysql_str_t {
+    char *p;
+    size_t len;
+    size_t alloc_size;
+    int mangle;
+} pam_mysql_str_t;
+
+/* connection state of the role a context is not using at the moment */
+typedef struct _pam_mysql_conn_t {
+    MYSQL *mysql_hdl;
+    struct _pam_mysql_pool_conn_t *pool_conn;
+    pam_mysql_stmt_cache_t stmts;
+    unsigned long long conn_fp;
+    unsigned long long conn_host;
+    time_t conn_checked;
+    int db_down;
+} pam_mysql_conn_t;
+
 typedef struct _pam_mysql_ctx_t {
     MYSQL *mysql_hdl;
+    pam_mysql_pool_conn_t *pool_conn;
+    pam_mysql_stmt_cache_t stmts;
     char *host;
     char *where;
     char *db;
@@ -272,6 +423,58 @@ typedef struct _pam_mysql_ctx_t {
     int use_first_pass;
     int try_first_pass;
     int disconnect_every_op;
+    int ping_interval;
+    int pool;
+    int pool_min;
+    int pool_max;
+    int pool_idle_timeout;
+    int prepared;
+    int stat_cache_ttl;
+    int verify_cache;
+    int verify_cache_ttl;
+    int verify_cache_negative_ttl;
+    char *daemon_socket;
+    int daemon_fd;
+    pid_t daemon_pid;
+    int daemon_down;
+    pam_mysql_str_t daemon_hello;
+    pid_t peer_pid;
+    char *shm_cache;
+    int shm_cache_ttl;
+    int shm_cache_entries;
+    char *snapshot;
+    int stale_max_age;
+    int outage_retry;
+    int outage_threshold;
+    int connect_timeout;
+    int read_timeout;
+    int write_timeout;
+    int deadline;
+    struct timeval deadline_at;
+    int db_down;
+    char *write_host;
+    char *write_user;
+    char *write_passwd;
+    int read_your_writes;
+    int writing;
+    pam_mysql_conn_t other_conn;
+    char *primary_user;
+    int prefetch;
+    int prefetch_running;
+#ifdef HAVE_PTHREAD_H
+    pthread_t prefetch_thread;
+#endif
+    char *prefetch_user;
+    int prefetch_err;
+    struct _pam_mysql_user_rec_t *prefetched;
+    char *stat_user;
+    int stat_value;
+    time_t stat_time;
+    unsigned int options_gen;
+    pam_mysql_template_t *templates;
+    unsigned long long conn_fp;
+    unsigned long long conn_host;
+    time_t conn_checked;
     char *logtable;
     char *logmsgcolumn;
     char *logpidcolumn;
@@ -279,6 +482,30 @@ typedef struct _pam_mysql_ctx_t {
     char *loghostcolumn;
     char *logrhostcolumn;
     char *logtimecolumn;
+    int logasync;
+    int logqueuesize;
+    int logbatchsize;
+    int logflushinterval;
+    char *logoverflow;
+    char *logspool;
+    int logcoalesce;
+    char *logimmediate;
+    int logpiggyback;
+    struct _pam_mysql_log_event_t *log_pending;
+    int log_npending;
+    pid_t log_pending_pid;
+    char *loghost;
+    char *logdb;
+    char *loguser;
+    char *logpasswd;
+    char *logssl_mode;
+    char *logssl_cert;
+    char *logssl_key;
+    char *logssl_ca;
+    char *logssl_capath;
+    char *logssl_cipher;
+    struct _pam_mysql_ctx_t *log_conn;
+    unsigned int log_conn_gen;
     char *config_file;
     char *my_host_info;
     char *select;
@@ -288,6 +515,7 @@ typedef struct _pam_mysql_ctx_t {
     char *ssl_ca;
     char *ssl_capath;
     char *ssl_cipher;
+    int ssl_session_reuse;
 } pam_mysql_ctx_t; /*Max length for most MySQL fields is 16 */
 
 typedef enum _pam_mysql_err_t pam_mysql_err_t;
@@ -310,13 +538,6 @@ typedef struct _pam_mysql_option_t {
     pam_mysql_option_accessor_t *accessor;
 } pam_mysql_option_t;
 
-typedef struct _pam_mysql_str_t {
-    char *p;
-    size_t len;
-    size_t alloc_size;
-    int mangle;
-} pam_mysql_str_t;
-
 struct _pam_mysql_entry_handler_t;
 
 typedef pam_mysql_err_t (*pam_mysql_handle_entry_fn_t)(
@@ -329,6 +550,43 @@ typedef struct _pam_mysql_entry_handler_t {
     pam_mysql_option_t *options;
 } pam_mysql_entry_handler_t;
 
+typedef struct _pam_mysql_config_entry_t {
+    pam_mysql_option_t *opt;
+    char *value;
+} pam_mysql_config_entry_t;
+
+/* sub-second part of the file times, where struct stat has it */
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+#define PAM_MYSQL_ST_MTIME_NSEC(st) ((long)(st)->st_mtim.tv_nsec)
+#define PAM_MYSQL_ST_CTIME_NSEC(st) ((long)(st)->st_ctim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+#define PAM_MYSQL_ST_MTIME_NSEC(st) ((long)(st)->st_mtimespec.tv_nsec)
+#define PAM_MYSQL_ST_CTIME_NSEC(st) ((long)(st)->st_ctimespec.tv_nsec)
+#else
+#define PAM_MYSQL_ST_MTIME_NSEC(st) 0L
+#define PAM_MYSQL_ST_CTIME_NSEC(st) 0L
+#endif
+
+typedef struct _pam_mysql_config_cache_t {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_nsec;
+    time_t ctime;
+    long ctime_nsec;
+    off_t size;
+    pam_mysql_config_entry_t *entries;
+    size_t nentries;
+    size_t alloc_entries;
+    struct _pam_mysql_config_cache_t *next;
+} pam_mysql_config_cache_t;
+
+typedef struct _pam_mysql_config_recorder_t {
+    pam_mysql_entry_handler_t hdlr;
+    pam_mysql_config_cache_t *cfg;
+} pam_mysql_config_recorder_t;
+
 typedef struct _pam_mysql_config_parser_t {
     pam_mysql_ctx_t *ctx;
     pam_mysql_entry_handler_t *hdlr;
@@ -380,6 +638,20 @@ static void pam_mysql_saltify(pam_mysql_ctx_t *, char *salt, const char *salter
 static pam_mysql_err_t pam_mysql_parse_args(pam_mysql_ctx_t *, int argc, const char **argv);
 static pam_mysql_err_t pam_mysql_open_db(pam_mysql_ctx_t *);
 static void pam_mysql_close_db(pam_mysql_ctx_t *);
+static void pam_mysql_release_db(pam_mysql_ctx_t *);
+static unsigned long long pam_mysql_conn_fingerprint(pam_mysql_ctx_t *);
+static void pam_mysql_use_writer(pam_mysql_ctx_t *, int writing);
+static void pam_mysql_for_each_role(pam_mysql_ctx_t *,
+        void (*fn)(pam_mysql_ctx_t *));
+static int pam_mysql_reads_primary(pam_mysql_ctx_t *, const char *user);
+static void pam_mysql_prefetch_join(pam_mysql_ctx_t *);
+static void pam_mysql_prefetch_clear(pam_mysql_ctx_t *);
+static void pam_mysql_stmt_cache_clear(pam_mysql_stmt_cache_t *);
+static pam_mysql_err_t pam_mysql_msg_begin(pam_mysql_str_t *msg, int code);
+static pam_mysql_err_t pam_mysql_msg_add(pam_mysql_str_t *msg,
+        const char *val, size_t len);
+static pam_mysql_err_t pam_mysql_msg_add_int(pam_mysql_str_t *msg, int val);
+static void pam_mysql_daemon_close(pam_mysql_ctx_t *);
 static pam_mysql_err_t pam_mysql_check_passwd(pam_mysql_ctx_t *ctx,
         const char *user, const char *passwd, int null_inhibited);
 static pam_mysql_err_t pam_mysql_update_passwd(pam_mysql_ctx_t *,
@@ -392,12 +664,23 @@ static pam_mysql_err_t pam_mysql_sql_log(pam_mysql_ctx_t *, const char *msg,
         const char *user, const char *host);
 static pam_mysql_err_t pam_mysql_get_host_info(pam_mysql_ctx_t *,
         const char **pretval);
+static void pam_mysql_log_writer_stop(void);
+static void pam_mysql_log_pending_clear(pam_mysql_ctx_t *);
+static void pam_mysql_log_pending_flush(pam_mysql_ctx_t *);
+static void pam_mysql_log_conn_clear(pam_mysql_ctx_t *);
+static int pam_mysql_log_piggyback(pam_mysql_ctx_t *);
+static pam_mysql_err_t pam_mysql_log_piggyback_query(pam_mysql_ctx_t *,
+        const pam_mysql_str_t *query);
+static int pam_mysql_deadline_left(pam_mysql_ctx_t *);
 
 static size_t strnncpy(char *dest, size_t dest_size, const char *src, size_t src_len);
 static void *xcalloc(size_t nmemb, size_t size);
 static char *xstrdup(const char *ptr);
 static void xfree(void *ptr);
 static void xfree_overwrite(char *ptr);
+static unsigned long long pam_mysql_hash_str(unsigned long long h, const char *s);
+static unsigned long long pam_mysql_hash_mem(unsigned long long h, const char *p, size_t len);
+static void pam_mysql_template_free(pam_mysql_template_t *tpl);
 
 /**
  * Local strnncpy.
@@ -538,6 +821,63 @@ static void xfree_overwrite(char *ptr)
     }
 }
 
+#define PAM_MYSQL_HASH_INIT 14695981039346656037ULL
+
+/**
+ * Feed a string into a 64-bit FNV-1a hash.
+ *
+ * A NULL string and an empty string hash differently, and every string is
+ * terminated by a separator so that ("ab", "c") and ("a", "bc") differ.
+ *
+ * @param unsigned long long h
+ *   The hash state so far (PAM_MYSQL_HASH_INIT to start a new hash).
+ * @param const char *s
+ *   The string to be hashed (may be NULL).
+ *
+ * @return unsigned long long
+ *   The updated hash state.
+ */
+static unsigned long long pam_mysql_hash_str(unsigned long long h, const char *s)
+{
+    if (s == NULL) {
+        h ^= 0xff;
+        h *= 1099511628211ULL;
+    } else {
+        for (; *s != '\0'; s++) {
+            h ^= (unsigned char)*s;
+            h *= 1099511628211ULL;
+        }
+    }
+
+    /* the terminating '\0' */
+    h *= 1099511628211ULL;
+
+    return h;
+}
+
+/**
+ * Feed a counted string into a 64-bit FNV-1a hash.
+ *
+ * @param unsigned long long h
+ *   The hash state so far (PAM_MYSQL_HASH_INIT to start a new hash).
+ * @param const char *p
+ *   The bytes to be hashed.
+ * @param size_t len
+ *   The number of bytes.
+ *
+ * @return unsigned long long
+ *   The updated hash state.
+ */
+static unsigned long long pam_mysql_hash_mem(unsigned long long h, const char *p, size_t len)
+{
+    for (; len > 0; p++, len--) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
 /**
  * Skip instances of a list of delimiters in an input buffer.
  *
@@ -1093,113 +1433,147 @@ static char * _password_base64_encode(unsigned char *input, int count,
     return output;
 }
 
-/**
- * Calculate the Drupal 7 hash for a password.
- *
- * Strings may be binary and contain \0, so we can't use strlen.
- *
- * @param int use_md5
- *   Whether to use MD5 (non zero) or SHA512.
- * @param char *string1
- *   The first string (setting string)
- * @param int len1
- *   The length of the first string.
- * @param char *string2
- *   The second string (password)
- * @param int len2
- *   The length of the second string.
- *
- * @return mixed
- *   The D7 hash or NULL if memory could not be allocated.
- */
-static char *d7_hash(int use_md5, char *string1, int len1, char *string2, int len2)
-{
-    int len = len1 + len2;
-    char *combined = xcalloc(len, sizeof(char)), *output = xcalloc(129, sizeof(char));
-
-    if (!combined) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "hash: Failed to allocate memory for combined value.");
-        return NULL;
-    }
-
-    memcpy(combined, string1, len1);
-    memcpy(combined + len1, string2, len2);
-
-    if (use_md5)
-        MD5(combined, (unsigned long)len, output);
-    else
-        SHA512(combined, (unsigned long)len, output);
-
-    xfree(combined);
-    return output;
-}
-
 /**
  * Encrypt a Drupal 7 password.
  *
- * The first 12 characters of an existing hash are its setting string.
+ * The first 12 characters of an existing hash are its setting string. The
+ * stretching loop runs 2^count_log2 times, so it works on fixed buffers and
+ * one digest context that is reset between rounds, and does not allocate.
  *
  * @param int use_md5
  *   Whether to use MD5 or SHA512.
- * @param char *password
+ * @param const char *password
  *   The unencryped password.
- * @param char *setting
+ * @param const char *setting
  *   The setting string.
+ * @param char *output
+ *   The buffer for the encrypted password (at least DRUPAL_HASH_LENGTH + 1
+ *   bytes).
  *
- * @return mixed
- *   NULL if memory allocation failed or inputs were invalid, else a ponter to
- *   the encrypted password.
+ * @return int
+ *   0 on success, -1 if the inputs were invalid or hashing failed.
  */
-static char * d7_password_crypt(int use_md5, char *password, char *setting) {
-    char salt[9], *old, *new, *final;
-    int expected, count, count_log2 = d7_password_get_count_log2(setting);
-    int len;
+static int d7_password_crypt(int use_md5, const char *password,
+        const char *setting, char *output)
+{
+    unsigned char hash[64];
+    char encoded[12 + 86 + 1];
+    char salt[9];
+    size_t pw_len = strlen(password);
+    unsigned int len = use_md5 ? 16 : 64;
+    int expected, count, count_log2 = d7_password_get_count_log2((char *)setting);
+    int retval = -1;
+#ifdef HAVE_OPENSSL
+    EVP_MD_CTX *mdctx = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD *md = NULL;
+#else
+    const EVP_MD *md;
+#endif
+#else
+    unsigned char *combined;
+#endif
 
     // Hashes may be imported from elsewhere, so we allow != DRUPAL_HASH_COUNT
     if (count_log2 < DRUPAL_MIN_HASH_COUNT || count_log2 > DRUPAL_MAX_HASH_COUNT) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "_password_crypt: count_log2 outside of range.");
-        return NULL;
+        return -1;
     }
 
     strncpy(salt, &setting[4], 8);
     salt[8] = '\0';
     if (strlen(salt) != 8) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "_password_crypt: Salt length is not 8.");
-        return NULL;
+        return -1;
     }
 
     // Convert the base 2 logarithm into an integer.
     count = 1 << count_log2;
 
-    old = d7_hash(use_md5, salt , 8, password, strlen(password));
+#ifdef HAVE_OPENSSL
+    /* the digest is looked up once; each round only resets the context */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    md = EVP_MD_fetch(NULL, use_md5 ? "MD5": "SHA512", NULL);
+#else
+    md = use_md5 ? EVP_md5(): EVP_sha512();
+#endif
+
+    if (md == NULL || NULL == (mdctx = EVP_MD_CTX_new()) ||
+            !EVP_DigestInit_ex(mdctx, md, NULL) ||
+            !EVP_DigestUpdate(mdctx, salt, 8) ||
+            !EVP_DigestUpdate(mdctx, password, pw_len) ||
+            !EVP_DigestFinal_ex(mdctx, hash, NULL)) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "_password_crypt: digest failed.");
+        goto out;
+    }
 
     do {
-        new = d7_hash(use_md5, old , use_md5 ? 16 : 64, password, strlen(password));
-        xfree(old);
-        if (!new)
-            return NULL;
-        old = new;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        if (!EVP_DigestInit_ex2(mdctx, NULL, NULL) ||
+#else
+        if (!EVP_DigestInit_ex(mdctx, md, NULL) ||
+#endif
+                !EVP_DigestUpdate(mdctx, hash, len) ||
+                !EVP_DigestUpdate(mdctx, password, pw_len) ||
+                !EVP_DigestFinal_ex(mdctx, hash, NULL)) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "_password_crypt: digest failed.");
+            goto out;
+        }
     } while (--count);
+#else
+    /* hash || password, with the hash part overwritten on each round */
+    if (NULL == (combined = xcalloc(len + pw_len, sizeof(unsigned char)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return -1;
+    }
 
-    len = use_md5 ? 16 : 64;
+    memcpy(combined, salt, 8);
+    memcpy(combined + 8, password, pw_len);
+    if (use_md5)
+        MD5(combined, (unsigned long)(8 + pw_len), hash);
+    else
+        SHA512(combined, (unsigned long)(8 + pw_len), hash);
+
+    memcpy(combined + len, password, pw_len);
+
+    do {
+        memcpy(combined, hash, len);
+        if (use_md5)
+            MD5(combined, (unsigned long)(len + pw_len), hash);
+        else
+            SHA512(combined, (unsigned long)(len + pw_len), hash);
+    } while (--count);
+#endif
 
-    new = xcalloc(129, sizeof(char));
-    memcpy(new, setting, 12);
-    _password_base64_encode(old, len, &new[12]);
-    xfree(old);
+    memcpy(encoded, setting, 12);
+    _password_base64_encode(hash, len, &encoded[12]);
     // _password_base64_encode() of a 16 byte MD5 will always be 22 characters.
     // _password_base64_encode() of a 64 byte sha512 will always be 86 characters.
     expected = 12 + ((8 * len + 5) / 6);
-    if (strlen(new) != expected) {
+    if (strlen(encoded) != expected) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "_password_crypt: Hash length not as expected.");
-        xfree(new);
-        return NULL;
+        goto out;
+    }
+
+    strncpy(output, encoded, DRUPAL_HASH_LENGTH);
+    output[DRUPAL_HASH_LENGTH] = '\0';
+    retval = 0;
+
+out:
+#ifdef HAVE_OPENSSL
+    if (mdctx != NULL) {
+        EVP_MD_CTX_free(mdctx);
     }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_free(md);
+#endif
+#else
+    memset(combined, 0, len + pw_len);
+    xfree(combined);
+#endif
+    memset(hash, 0, sizeof(hash));
 
-    final = xcalloc(DRUPAL_HASH_LENGTH + 1, sizeof(char));
-    strncpy(final, new, DRUPAL_HASH_LENGTH);
-    xfree(new);
-    return final;
+    return retval;
 }
 
 /**
@@ -1220,40 +1594,40 @@ static char * d7_password_crypt(int use_md5, char *password, char *setting) {
  */
 static char *pam_mysql_drupal7_data(const unsigned char *pwd, unsigned int sz, char *md, char *db_pwd)
 {
-    char *stored_hash = db_pwd, *pwd_ptr = (char *) pwd, *hashed;
-    int match = 0, offset = 0;
+    char *stored_hash = db_pwd, *pwd_ptr = (char *) pwd;
+    char pwd_md5[33];
+    int failed = 1;
 
     // Algorithm taken from user_check_password in includes/password.c in D7.0.
     if (db_pwd[0] == 'U' && db_pwd[1] == '$') {
         // This may be an updated password from user_update_7000(). Such hashes
         // have 'U' added as the first character and need an extra md5().
         stored_hash = &db_pwd[1];
-        offset++;
-        pwd_ptr = pam_mysql_md5_data(pwd, (unsigned long)sz, md);
+        pwd_ptr = pam_mysql_md5_data(pwd, (unsigned long)sz, pwd_md5);
     } else
         stored_hash = &db_pwd[0];
 
     if (stored_hash[0] == '$' && stored_hash[2] == '$') {
         switch (stored_hash[1]) {
             case 'S':
-                match = 1;
-                hashed = d7_password_crypt(0, pwd_ptr, stored_hash);
+                failed = d7_password_crypt(0, pwd_ptr, stored_hash, md);
                 break;
             case 'H':
                 // phpBB3 uses "$H$" for the same thing as "$P$".
             case 'P':
-                match = 1;
-                hashed = d7_password_crypt(1, pwd_ptr, stored_hash);
+                failed = d7_password_crypt(1, pwd_ptr, stored_hash, md);
                 break;
         }
     }
 
-    if (!match || !hashed) {
+    if (pwd_ptr == pwd_md5) {
+        memset(pwd_md5, 0, sizeof(pwd_md5));
+    }
+
+    if (failed) {
         md[0] = db_pwd[0] + 1;
         return NULL;
     }
-    memcpy(md, hashed, strlen(hashed));
-    xfree(hashed);
 
     return md;
 }
@@ -1355,8 +1729,11 @@ static pam_mysql_err_t pam_mysql_numeric_opt_getter(void *val, const char **pret
 {
     char buf[20];
     snprintf(buf, sizeof(buf), "%d", *(int *)val);
-  *pretval = buf;
-  *to_release = 0;
+  if (NULL == (*pretval = xstrdup(buf))) {
+      syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+      return PAM_MYSQL_ERR_ALLOC;
+  }
+  *to_release = 1;
 
   return PAM_MYSQL_ERR_SUCCESS;
 }
@@ -1365,7 +1742,7 @@ static pam_mysql_err_t pam_mysql_numeric_opt_getter(void *val, const char **pret
 /* {{{ pam_mysql_numeric_opt_setter */
 static pam_mysql_err_t pam_mysql_numeric_opt_setter(void *val, const char *newval_str)
 {
-  *(long int *)val = strtol(newval_str, NULL, 10);
+  *(int *)val = (int)strtol(newval_str, NULL, 10);
 
   return PAM_MYSQL_ERR_SUCCESS;
 }
@@ -1558,11 +1935,57 @@ static pam_mysql_option_t options[] = {
     PAM_MYSQL_DEF_OPTION(loghostcolumn, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(logrhostcolumn, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(logtimecolumn, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logasync, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logqueuesize, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logbatchsize, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logflushinterval, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logoverflow, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logspool, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logcoalesce, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logimmediate, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logpiggyback, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(loghost, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logdb, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(loguser, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logpasswd, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logssl_mode, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logssl_cert, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logssl_key, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logssl_ca, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logssl_capath, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(logssl_cipher, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(config_file, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(use_323_passwd, &pam_mysql_boolean_opt_accr),
     PAM_MYSQL_DEF_OPTION(use_first_pass, &pam_mysql_boolean_opt_accr),
     PAM_MYSQL_DEF_OPTION(try_first_pass, &pam_mysql_boolean_opt_accr),
     PAM_MYSQL_DEF_OPTION(disconnect_every_op, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(ping_interval, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(pool, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(pool_min, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(pool_max, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(pool_idle_timeout, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(prepared, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(stat_cache_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(verify_cache, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(verify_cache_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(verify_cache_negative_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(daemon_socket, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(shm_cache, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(shm_cache_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(shm_cache_entries, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(snapshot, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(stale_max_age, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(outage_retry, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(outage_threshold, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(write_host, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(write_user, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(write_passwd, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(read_your_writes, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(prefetch, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION(deadline, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(connect_timeout, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(read_timeout, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION(write_timeout, &pam_mysql_numeric_opt_accr),
     PAM_MYSQL_DEF_OPTION2(debug, verbose, &pam_mysql_boolean_opt_accr),
     PAM_MYSQL_DEF_OPTION(select, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(ssl_mode, &pam_mysql_string_opt_accr),
@@ -1571,6 +1994,7 @@ static pam_mysql_option_t options[] = {
     PAM_MYSQL_DEF_OPTION(ssl_ca, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(ssl_capath, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION(ssl_cipher, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION(ssl_session_reuse, &pam_mysql_boolean_opt_accr),
     { NULL, 0, 0, NULL }
 };
 
@@ -2576,6 +3000,60 @@ out:
     return err;
 }
 
+/* hash indexes of the option tables, built once per process */
+
+#define PAM_MYSQL_OPTION_INDEX_SIZE 256 /* a power of two */
+
+typedef struct _pam_mysql_option_index_t {
+    pam_mysql_option_t *options;
+    short slots[PAM_MYSQL_OPTION_INDEX_SIZE];
+} pam_mysql_option_index_t;
+
+static pam_mysql_option_index_t pam_mysql_option_indexes[2];
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t pam_mysql_option_indexes_once = PTHREAD_ONCE_INIT;
+#else
+static int pam_mysql_option_indexes_ready = 0;
+#endif
+
+static void pam_mysql_build_option_indexes(void);
+
+/**
+ * Index an option table by name.
+ *
+ * The table is left unindexed (and searched linearly) if it does not fit.
+ *
+ * @param pam_mysql_option_index_t *idx
+ *   The index to be filled.
+ * @param pam_mysql_option_t *options
+ *   The list of defined options.
+ */
+static void pam_mysql_build_option_index(pam_mysql_option_index_t *idx,
+        pam_mysql_option_t *options)
+{
+    pam_mysql_option_t *opt;
+    size_t i;
+
+    for (i = 0; i < PAM_MYSQL_OPTION_INDEX_SIZE; i++) {
+        idx->slots[i] = -1;
+    }
+
+    for (opt = options; opt->name != NULL; opt++) {
+        if (opt - options >= PAM_MYSQL_OPTION_INDEX_SIZE / 2) {
+            return;
+        }
+
+        i = pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT, opt->name, opt->name_len) &
+            (PAM_MYSQL_OPTION_INDEX_SIZE - 1);
+        while (idx->slots[i] >= 0) {
+            i = (i + 1) & (PAM_MYSQL_OPTION_INDEX_SIZE - 1);
+        }
+        idx->slots[i] = (short)(opt - options);
+    }
+
+    idx->options = options;
+}
+
 /**
  * Find an option with the specified name.
  *
@@ -2594,8 +3072,41 @@ pam_mysql_option_t *pam_mysql_find_option(pam_mysql_option_t *options,
 {
     /* set the various ctx */
     pam_mysql_option_t *retval;
+    pam_mysql_option_index_t *idx = NULL;
+    size_t i;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_once(&pam_mysql_option_indexes_once, pam_mysql_build_option_indexes);
+#else
+    if (!pam_mysql_option_indexes_ready) {
+        pam_mysql_build_option_indexes();
+        pam_mysql_option_indexes_ready = 1;
+    }
+#endif
+
+    for (i = 0; i < sizeof(pam_mysql_option_indexes) / sizeof(pam_mysql_option_indexes[0]); i++) {
+        if (pam_mysql_option_indexes[i].options == options) {
+            idx = &pam_mysql_option_indexes[i];
+            break;
+        }
+    }
 
-    for (retval = options; retval->name != NULL; retval++) {
+    if (idx == NULL) {
+        for (retval = options; retval->name != NULL; retval++) {
+            if (retval->name_len == name_len &&
+                    memcmp(retval->name, name, name_len) == 0) {
+                return retval;
+            }
+        }
+
+        return NULL;
+    }
+
+    for (i = pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT, name, name_len) &
+            (PAM_MYSQL_OPTION_INDEX_SIZE - 1);
+            idx->slots[i] >= 0;
+            i = (i + 1) & (PAM_MYSQL_OPTION_INDEX_SIZE - 1)) {
+        retval = &options[idx->slots[i]];
         if (retval->name_len == name_len &&
                 memcmp(retval->name, name, name_len) == 0) {
             return retval;
@@ -2605,6 +3116,52 @@ pam_mysql_option_t *pam_mysql_find_option(pam_mysql_option_t *options,
     return NULL;
 }
 
+/**
+ * Set an option of the context.
+ *
+ * Setting an option to the value it already has is a no-op; any actual
+ * change bumps ctx->options_gen so that compiled query templates are
+ * rebuilt.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_option_t *opt
+ *   The option to be set.
+ * @param const char *value
+ *   A pointer to the new value of the option.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_assign_option(pam_mysql_ctx_t *ctx,
+        pam_mysql_option_t *opt, const char *value)
+{
+    pam_mysql_err_t err;
+    void *val = (void *)((char *)ctx + opt->offset);
+    int old;
+
+    if (opt->accessor == &pam_mysql_string_opt_accr) {
+        if (*(char **)val != NULL && strcmp(*(char **)val, value) == 0) {
+            return PAM_MYSQL_ERR_SUCCESS;
+        }
+
+        if (!(err = opt->accessor->set_op(val, value))) {
+            ctx->options_gen++;
+        }
+
+        return err;
+    }
+
+    /* the other kinds of options are all ints */
+    old = *(int *)val;
+
+    if (!(err = opt->accessor->set_op(val, value)) && *(int *)val != old) {
+        ctx->options_gen++;
+    }
+
+    return err;
+}
+
 /* entry handler */
 static pam_mysql_option_t pam_mysql_entry_handler_options[] = {
     PAM_MYSQL_DEF_OPTION2(users.host, host, &pam_mysql_string_opt_accr),
@@ -2632,8 +3189,54 @@ static pam_mysql_option_t pam_mysql_entry_handler_options[] = {
     PAM_MYSQL_DEF_OPTION2(log.host_column, loghostcolumn, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(log.rhost_column, logrhostcolumn, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(log.time_column, logtimecolumn, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.async, logasync, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.queue_size, logqueuesize, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.batch_size, logbatchsize, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.flush_interval, logflushinterval, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.overflow, logoverflow, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.spool, logspool, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.coalesce, logcoalesce, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.immediate, logimmediate, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.piggyback, logpiggyback, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.host, loghost, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.database, logdb, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.db_user, loguser, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.db_passwd, logpasswd, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.ssl_mode, logssl_mode, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.ssl_cert, logssl_cert, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.ssl_key, logssl_key, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.ssl_ca, logssl_ca, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.ssl_capath, logssl_capath, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(log.ssl_cipher, logssl_cipher, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.use_323_password, use_323_passwd, &pam_mysql_boolean_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.disconnect_every_operation, disconnect_every_op, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.ping_interval, ping_interval, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.pool, pool, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.pool_min, pool_min, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.pool_max, pool_max, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.pool_idle_timeout, pool_idle_timeout, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.prepared, prepared, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.stat_cache_ttl, stat_cache_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.verify_cache, verify_cache, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.verify_cache_ttl, verify_cache_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.verify_cache_negative_ttl, verify_cache_negative_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.daemon_socket, daemon_socket, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.shm_cache, shm_cache, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.shm_cache_ttl, shm_cache_ttl, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.shm_cache_entries, shm_cache_entries, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.snapshot, snapshot, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.stale_max_age, stale_max_age, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.outage_retry, outage_retry, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.outage_threshold, outage_threshold, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.write_host, write_host, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.write_db_user, write_user, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.write_db_passwd, write_passwd, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.read_your_writes, read_your_writes, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.prefetch, prefetch, &pam_mysql_boolean_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.deadline, deadline, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.connect_timeout, connect_timeout, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.read_timeout, read_timeout, &pam_mysql_numeric_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.write_timeout, write_timeout, &pam_mysql_numeric_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.select, select, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.ssl_mode, ssl_mode, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.ssl_cert, ssl_cert, &pam_mysql_string_opt_accr),
@@ -2641,9 +3244,16 @@ static pam_mysql_option_t pam_mysql_entry_handler_options[] = {
     PAM_MYSQL_DEF_OPTION2(users.ssl_ca, ssl_ca, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.ssl_capath, ssl_capath, &pam_mysql_string_opt_accr),
     PAM_MYSQL_DEF_OPTION2(users.ssl_cipher, ssl_cipher, &pam_mysql_string_opt_accr),
+    PAM_MYSQL_DEF_OPTION2(users.ssl_session_reuse, ssl_session_reuse, &pam_mysql_boolean_opt_accr),
     { NULL, 0, 0, NULL }
 };
 
+static void pam_mysql_build_option_indexes(void)
+{
+    pam_mysql_build_option_index(&pam_mysql_option_indexes[0], options);
+    pam_mysql_build_option_index(&pam_mysql_option_indexes[1], pam_mysql_entry_handler_options);
+}
+
 /**
  * Handle one option in the configuration file.
  *
@@ -2681,7 +3291,7 @@ static pam_mysql_err_t pam_mysql_handle_entry(
         return PAM_MYSQL_ERR_SUCCESS;
     }
 
-    err = opt->accessor->set_op((void*)((char *)hdlr->ctx + opt->offset), value);
+    err = pam_mysql_assign_option(hdlr->ctx, opt, value);
     if (!err && hdlr->ctx->verbose) {
         char buf[1024];
         strnncpy(buf, sizeof(buf), name, name_len);
@@ -2941,6 +3551,8 @@ static pam_mysql_err_t pam_mysql_get_host_info(pam_mysql_ctx_t *ctx,
 static pam_mysql_err_t pam_mysql_init_ctx(pam_mysql_ctx_t *ctx)
 {
     ctx->mysql_hdl = NULL;
+    ctx->pool_conn = NULL;
+    memset(&ctx->stmts, 0, sizeof(ctx->stmts));
     ctx->host = NULL;
     ctx->where = NULL;
     ctx->db = NULL;
@@ -2963,6 +3575,55 @@ static pam_mysql_err_t pam_mysql_init_ctx(pam_mysql_ctx_t *ctx)
     ctx->use_first_pass = 0;
     ctx->try_first_pass = 1;
     ctx->disconnect_every_op = 0;
+    ctx->ping_interval = 10;
+    ctx->pool = 0;
+    ctx->pool_min = 0;
+    ctx->pool_max = 8;
+    ctx->pool_idle_timeout = 60;
+    ctx->prepared = 0;
+    ctx->stat_cache_ttl = 10;
+    ctx->verify_cache = 0;
+    ctx->verify_cache_ttl = 60;
+    ctx->verify_cache_negative_ttl = 10;
+    ctx->daemon_socket = NULL;
+    ctx->daemon_fd = -1;
+    ctx->daemon_pid = 0;
+    ctx->daemon_down = 0;
+    pam_mysql_str_init(&ctx->daemon_hello, 1);
+    ctx->peer_pid = 0;
+    ctx->shm_cache = NULL;
+    ctx->shm_cache_ttl = 30;
+    ctx->shm_cache_entries = 4096;
+    ctx->snapshot = NULL;
+    ctx->stale_max_age = 0;
+    ctx->outage_retry = 0;
+    ctx->outage_threshold = 1;
+    ctx->connect_timeout = 0;
+    ctx->read_timeout = 0;
+    ctx->write_timeout = 0;
+    ctx->deadline = 0;
+    timerclear(&ctx->deadline_at);
+    ctx->db_down = 0;
+    ctx->write_host = NULL;
+    ctx->write_user = NULL;
+    ctx->write_passwd = NULL;
+    ctx->read_your_writes = 0;
+    ctx->writing = 0;
+    memset(&ctx->other_conn, 0, sizeof(ctx->other_conn));
+    ctx->primary_user = NULL;
+    ctx->prefetch = 0;
+    ctx->prefetch_running = 0;
+    ctx->prefetch_user = NULL;
+    ctx->prefetch_err = PAM_MYSQL_ERR_NOTIMPL;
+    ctx->prefetched = NULL;
+    ctx->stat_user = NULL;
+    ctx->stat_value = 0;
+    ctx->stat_time = 0;
+    ctx->options_gen = 0;
+    ctx->templates = NULL;
+    ctx->conn_fp = 0;
+    ctx->conn_host = 0;
+    ctx->conn_checked = 0;
     ctx->logtable = NULL;
     ctx->logmsgcolumn = NULL;
     ctx->logpidcolumn = NULL;
@@ -2970,6 +3631,30 @@ static pam_mysql_err_t pam_mysql_init_ctx(pam_mysql_ctx_t *ctx)
     ctx->loghostcolumn = NULL;
     ctx->logrhostcolumn = NULL;
     ctx->logtimecolumn = NULL;
+    ctx->logasync = 0;
+    ctx->logqueuesize = 1024;
+    ctx->logbatchsize = 64;
+    ctx->logflushinterval = 1000;
+    ctx->logoverflow = NULL;
+    ctx->logspool = NULL;
+    ctx->logcoalesce = 0;
+    ctx->logimmediate = NULL;
+    ctx->logpiggyback = 0;
+    ctx->log_pending = NULL;
+    ctx->log_npending = 0;
+    ctx->log_pending_pid = 0;
+    ctx->loghost = NULL;
+    ctx->logdb = NULL;
+    ctx->loguser = NULL;
+    ctx->logpasswd = NULL;
+    ctx->logssl_mode = NULL;
+    ctx->logssl_cert = NULL;
+    ctx->logssl_key = NULL;
+    ctx->logssl_ca = NULL;
+    ctx->logssl_capath = NULL;
+    ctx->logssl_cipher = NULL;
+    ctx->log_conn = NULL;
+    ctx->log_conn_gen = 0;
     ctx->config_file = NULL;
     ctx->my_host_info = NULL;
     ctx->select = NULL;
@@ -2979,6 +3664,7 @@ static pam_mysql_err_t pam_mysql_init_ctx(pam_mysql_ctx_t *ctx)
     ctx->ssl_ca = NULL;
     ctx->ssl_capath = NULL;
     ctx->ssl_cipher = NULL;
+    ctx->ssl_session_reuse = 1;
 
     return PAM_MYSQL_ERR_SUCCESS;
 }
@@ -2995,7 +3681,8 @@ static void pam_mysql_destroy_ctx(pam_mysql_ctx_t *ctx)
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_destroy_ctx() called.");
     }
 
-    pam_mysql_close_db(ctx);
+    pam_mysql_prefetch_join(ctx);
+    pam_mysql_for_each_role(ctx, pam_mysql_close_db);
 
     xfree(ctx->host);
     ctx->host = NULL;
@@ -3027,6 +3714,41 @@ static void pam_mysql_destroy_ctx(pam_mysql_ctx_t *ctx)
     xfree(ctx->statcolumn);
     ctx->statcolumn = NULL;
 
+    xfree(ctx->stat_user);
+    ctx->stat_user = NULL;
+
+    xfree(ctx->daemon_socket);
+    ctx->daemon_socket = NULL;
+
+    xfree(ctx->shm_cache);
+    ctx->shm_cache = NULL;
+
+    xfree(ctx->snapshot);
+    ctx->snapshot = NULL;
+
+    xfree(ctx->write_host);
+    ctx->write_host = NULL;
+
+    xfree(ctx->write_user);
+    ctx->write_user = NULL;
+
+    xfree(ctx->write_passwd);
+    ctx->write_passwd = NULL;
+
+    xfree(ctx->primary_user);
+    ctx->primary_user = NULL;
+
+    pam_mysql_prefetch_clear(ctx);
+
+    pam_mysql_str_destroy(&ctx->daemon_hello);
+    pam_mysql_str_init(&ctx->daemon_hello, 1);
+
+    while (ctx->templates != NULL) {
+        pam_mysql_template_t *tpl = ctx->templates;
+        ctx->templates = tpl->next;
+        pam_mysql_template_free(tpl);
+    }
+
     xfree(ctx->logtable);
     ctx->logtable = NULL;
 
@@ -3048,6 +3770,49 @@ static void pam_mysql_destroy_ctx(pam_mysql_ctx_t *ctx)
     xfree(ctx->logtimecolumn);
     ctx->logtimecolumn = NULL;
 
+    xfree(ctx->logoverflow);
+    ctx->logoverflow = NULL;
+
+    xfree(ctx->logspool);
+    ctx->logspool = NULL;
+
+    xfree(ctx->logimmediate);
+    ctx->logimmediate = NULL;
+
+    pam_mysql_log_pending_clear(ctx);
+
+    xfree(ctx->loghost);
+    ctx->loghost = NULL;
+
+    xfree(ctx->logdb);
+    ctx->logdb = NULL;
+
+    xfree(ctx->loguser);
+    ctx->loguser = NULL;
+
+    xfree(ctx->logpasswd);
+    ctx->logpasswd = NULL;
+
+    xfree(ctx->logssl_mode);
+    ctx->logssl_mode = NULL;
+
+    xfree(ctx->logssl_cert);
+    ctx->logssl_cert = NULL;
+
+    xfree(ctx->logssl_key);
+    ctx->logssl_key = NULL;
+
+    xfree(ctx->logssl_ca);
+    ctx->logssl_ca = NULL;
+
+    xfree(ctx->logssl_capath);
+    ctx->logssl_capath = NULL;
+
+    xfree(ctx->logssl_cipher);
+    ctx->logssl_cipher = NULL;
+
+    pam_mysql_log_conn_clear(ctx);
+
     xfree(ctx->config_file);
     ctx->config_file = NULL;
 
@@ -3106,7 +3871,19 @@ static void pam_mysql_release_ctx(pam_mysql_ctx_t *ctx)
  */
 static void pam_mysql_cleanup_hdlr(pam_handle_t *pamh, void * voiddata, int status)
 {
-    pam_mysql_release_ctx((pam_mysql_ctx_t*)voiddata);
+    pam_mysql_ctx_t *ctx = (pam_mysql_ctx_t*)voiddata;
+
+    if (ctx != NULL) {
+#ifdef PAM_DATA_SILENT
+        /* a forked process tidying up; the parent writes the log entries */
+        if (status & PAM_DATA_SILENT) {
+            ctx->log_npending = 0;
+        }
+#endif
+        pam_mysql_log_pending_flush(ctx);
+    }
+
+    pam_mysql_release_ctx(ctx);
 }
 
 /**
@@ -3193,7 +3970,7 @@ pam_mysql_err_t pam_mysql_set_option(pam_mysql_ctx_t *ctx, const char *name, siz
         return PAM_MYSQL_ERR_NO_ENTRY;
     }
 
-    return opt->accessor->set_op((void *)((char *)ctx + opt->offset), val);
+    return pam_mysql_assign_option(ctx, opt, val);
 }
 
 /**
@@ -3246,7 +4023,7 @@ pam_mysql_err_t pam_mysql_get_option(pam_mysql_ctx_t *ctx, const char **pretval,
 pam_mysql_err_t pam_mysql_parse_args(pam_mysql_ctx_t *ctx, int argc, const char **argv)
 {
     pam_mysql_err_t err;
-    int param_changed = 0;
+    pam_mysql_str_t hello;
     char *value = NULL;
     int i;
 
@@ -3270,8 +4047,6 @@ pam_mysql_err_t pam_mysql_parse_args(pam_mysql_ctx_t *ctx, int argc, const char
             return err;
         }
 
-        param_changed = 1;
-
         if (ctx->verbose) {
             char buf[1024];
             strnncpy(buf, sizeof(buf), name, name_len);
@@ -3279,46 +4054,62 @@ pam_mysql_err_t pam_mysql_parse_args(pam_mysql_ctx_t *ctx, int argc, const char
         }
     }
 
-    /* close the database in case we get new args */
-    if (param_changed) {
-        pam_mysql_close_db(ctx);
+    /* an open connection is checked against the new arguments by
+     * pam_mysql_open_db(), so there is no need to drop it here */
+
+    /* keep the arguments for pam_mysqld, which configures itself the same
+     * way */
+    if ((err = pam_mysql_msg_begin(&hello, PAM_MYSQL_OP_HELLO)) ||
+            (err = pam_mysql_msg_add_int(&hello, (int)getpid()))) {
+        pam_mysql_str_destroy(&hello);
+        return err;
     }
 
-    return PAM_MYSQL_ERR_SUCCESS;
-}
+    for (i = 0; i < argc; i++) {
+        if ((err = pam_mysql_msg_add(&hello, argv[i], strlen(argv[i])))) {
+            pam_mysql_str_destroy(&hello);
+            return err;
+        }
+    }
+
+    if (hello.len != ctx->daemon_hello.len ||
+            memcmp(hello.p, ctx->daemon_hello.p, hello.len) != 0) {
+        pam_mysql_daemon_close(ctx);
+        pam_mysql_str_destroy(&ctx->daemon_hello);
+        ctx->daemon_hello = hello;
+    } else {
+        pam_mysql_str_destroy(&hello);
+    }
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
 
 /**
- * Read a configuration file.
+ * Parse a configuration file, passing each entry to a handler.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to a context data structure.
  * @param const char *path
  *   The path to the configuration file.
+ * @param pam_mysql_entry_handler_t *handler
+ *   A pointer to the handler data structure.
  *
  * @return pam_mysql_err_t
  *   Indication of success or failure.
  */
-static pam_mysql_err_t pam_mysql_read_config_file(pam_mysql_ctx_t *ctx,
-        const char *path)
+static pam_mysql_err_t pam_mysql_parse_config_file(pam_mysql_ctx_t *ctx,
+        const char *path, pam_mysql_entry_handler_t *handler)
 {
     pam_mysql_err_t err;
-    pam_mysql_entry_handler_t handler;
     pam_mysql_config_parser_t parser;
     pam_mysql_stream_t stream;
 
-
-    if ((err = pam_mysql_entry_handler_init(&handler, ctx))) {
-        return err;
-    }
-
     if ((err = pam_mysql_stream_open(&stream, ctx, path))) {
-        pam_mysql_entry_handler_destroy(&handler);
         return err;
     }
 
-    if ((err = pam_mysql_config_parser_init(&parser, ctx, &handler))) {
+    if ((err = pam_mysql_config_parser_init(&parser, ctx, handler))) {
         pam_mysql_stream_close(&stream);
-        pam_mysql_entry_handler_destroy(&handler);
         return err;
     }
 
@@ -3326,1192 +4117,7545 @@ static pam_mysql_err_t pam_mysql_read_config_file(pam_mysql_ctx_t *ctx,
 
     pam_mysql_config_parser_destroy(&parser);
     pam_mysql_stream_close(&stream);
-    pam_mysql_entry_handler_destroy(&handler);
 
     return err;
 }
 
+/* parsed configuration files, shared by every context in the process */
+
+static pam_mysql_config_cache_t *pam_mysql_config_cache = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t pam_mysql_config_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /**
- * Attempt to open a connection to the database server.
+ * Forget the parsed entries of a configuration file.
  *
- * @param pam_mysql_ctx_t *ctx
- *   A pointer to the context data structure.
+ * @param pam_mysql_config_cache_t *cfg
+ *   The cached configuration file.
+ */
+static void pam_mysql_config_cache_reset(pam_mysql_config_cache_t *cfg)
+{
+    size_t i;
+
+    for (i = 0; i < cfg->nentries; i++) {
+        xfree_overwrite(cfg->entries[i].value);
+    }
+
+    xfree(cfg->entries);
+    cfg->entries = NULL;
+    cfg->nentries = 0;
+    cfg->alloc_entries = 0;
+}
+
+/**
+ * Record one option of the configuration file instead of applying it.
+ *
+ * The parameters are those of pam_mysql_handle_entry().
  *
  * @return pam_mysql_err_t
  *   Indication of success or failure.
  */
-static pam_mysql_err_t pam_mysql_open_db(pam_mysql_ctx_t *ctx)
+static pam_mysql_err_t pam_mysql_record_entry(
+        pam_mysql_entry_handler_t *hdlr, int line_num, const char *name,
+        size_t name_len, const char *value, size_t value_len)
 {
-    pam_mysql_err_t err;
-    char *host = NULL;
-    char *socket = NULL;
-    int port = 0;
+    pam_mysql_config_cache_t *cfg = ((pam_mysql_config_recorder_t *)hdlr)->cfg;
+    pam_mysql_option_t *opt = pam_mysql_find_option(hdlr->options, name,
+            name_len);
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_open_db() called.");
+    if (opt == NULL) {
+        if (hdlr->ctx->verbose) {
+            char buf[1024];
+            strnncpy(buf, sizeof(buf), name, name_len);
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unknown option %s on line %d", buf, line_num);
+        }
+
+        return PAM_MYSQL_ERR_SUCCESS;
     }
 
-    if (ctx->mysql_hdl != NULL) {
-        return PAM_MYSQL_ERR_BUSY;
+    if (cfg->nentries >= cfg->alloc_entries) {
+        size_t new_alloc = cfg->alloc_entries == 0 ? 16 : cfg->alloc_entries * 2;
+        pam_mysql_config_entry_t *new_entries;
+
+        if (NULL == (new_entries = xrealloc(cfg->entries, new_alloc,
+                        sizeof(pam_mysql_config_entry_t)))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            return PAM_MYSQL_ERR_ALLOC;
+        }
+
+        cfg->entries = new_entries;
+        cfg->alloc_entries = new_alloc;
     }
 
-    if (NULL == (ctx->mysql_hdl = xcalloc(1, sizeof(MYSQL)))) {
+    if (NULL == (cfg->entries[cfg->nentries].value = xstrdup(value))) {
         syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
         return PAM_MYSQL_ERR_ALLOC;
     }
 
-    if (ctx->user == NULL) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "required option \"user\" is not set");
-        return PAM_MYSQL_ERR_INVAL;
-    }
+    cfg->entries[cfg->nentries++].opt = opt;
 
-    if (ctx->db == NULL) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "required option \"db\" is not set");
-        return PAM_MYSQL_ERR_INVAL;
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Apply a cached option value to the context.
+ *
+ * Options that already hold the value are left alone, so that applying an
+ * unchanged configuration does not allocate.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_config_entry_t *entry
+ *   The option and its value.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_apply_entry(pam_mysql_ctx_t *ctx,
+        pam_mysql_config_entry_t *entry)
+{
+    pam_mysql_err_t err;
+
+    err = pam_mysql_assign_option(ctx, entry->opt, entry->value);
+    if (!err && ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_INFO, PAM_MYSQL_LOG_PREFIX "option %s is set to \"%s\"", entry->opt->name, entry->value);
     }
 
-    if (ctx->host != NULL) {
-        if (ctx->host[0] == '/') {
-            host = NULL;
-            socket = ctx->host;
-        } else {
-            char *p;
+    return err;
+}
 
-            if ((p = strchr(ctx->host, ':')) != NULL) {
-                size_t len = (size_t)(p - ctx->host);
+/**
+ * Read a configuration file.
+ *
+ * The file is parsed once per process and the option values are kept;
+ * it is parsed again only when stat() reports a different file, mtime,
+ * ctime (to the nanosecond where the system records it) or size.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to a context data structure.
+ * @param const char *path
+ *   The path to the configuration file.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_read_config_file(pam_mysql_ctx_t *ctx,
+        const char *path)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_entry_handler_t handler;
+    pam_mysql_config_recorder_t recorder;
+    pam_mysql_config_cache_t *cfg;
+    struct stat st;
+    size_t i;
 
-                if (NULL == (host = xcalloc(len + 1, sizeof(char)))) {
-                    syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                    return PAM_MYSQL_ERR_ALLOC;
-                }
-                memcpy(host, ctx->host, len);
-                host[len] = '\0';
-                port = strtol(p + 1, NULL, 10);
-            } else {
-                host = ctx->host;
-            }
-            socket = NULL;
+    if (stat(path, &st)) {
+        /* let the parser report the problem */
+        if ((err = pam_mysql_entry_handler_init(&handler, ctx))) {
+            return err;
         }
-    }
 
-    if (NULL == mysql_init(ctx->mysql_hdl)) {
-        err = PAM_MYSQL_ERR_ALLOC;
-        goto out;
-    }
+        err = pam_mysql_parse_config_file(ctx, path, &handler);
+        pam_mysql_entry_handler_destroy(&handler);
 
-    if (ctx->ssl_cert != NULL || ctx->ssl_key != NULL ||
-        ctx->ssl_ca != NULL || ctx->ssl_capath != NULL || ctx->ssl_cipher != NULL) {
-        mysql_ssl_set(ctx->mysql_hdl, ctx->ssl_key, ctx->ssl_cert,
-            ctx->ssl_ca, ctx->ssl_capath, ctx->ssl_cipher);
+        return err;
     }
 
-    if (ctx->ssl_mode != NULL) {
-#ifdef MARIADB_BASE_VERSION
-        my_bool enable = 1;
-        if (strcasecmp(ctx->ssl_mode, "required") == 0 ||
-            strcasecmp(ctx->ssl_mode, "enforce")) {
-            if (mysql_optionsv(ctx->mysql_hdl, MYSQL_OPT_SSL_ENFORCE,
-                               (void *)&enable) != 0) {
-                err = PAM_MYSQL_ERR_DB;
-                goto out;
-            }
-        } else if (strcasecmp(ctx->ssl_mode, "verify_identity") == 0) {
-            if (mysql_optionsv(ctx->mysql_hdl, MYSQL_OPT_SSL_VERIFY_SERVER_CERT,
-                               (void *)&enable) != 0) {
-                err = PAM_MYSQL_ERR_DB;
-                goto out;
-            }
-        }
-#else
-        int ssl_mode = SSL_MODE_PREFERRED;
-        if (strcasecmp(ctx->ssl_mode, "disabled") == 0) {
-            ssl_mode = SSL_MODE_DISABLED;
-        } else if (strcasecmp(ctx->ssl_mode, "preferred") == 0) {
-            ssl_mode = SSL_MODE_PREFERRED;
-        } else if (strcasecmp(ctx->ssl_mode, "required") == 0 ||
-                   strcasecmp(ctx->ssl_mode, "enforced")) {
-            ssl_mode = SSL_MODE_REQUIRED;
-        } else if (strcasecmp(ctx->ssl_mode, "verify_ca") == 0) {
-            ssl_mode = SSL_MODE_VERIFY_CA;
-        } else if (strcasecmp(ctx->ssl_mode, "verify_identity") == 0) {
-            ssl_mode = SSL_MODE_VERIFY_IDENTITY;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pam_mysql_config_cache_lock);
+#endif
+
+    for (cfg = pam_mysql_config_cache; cfg != NULL; cfg = cfg->next) {
+        if (strcmp(cfg->path, path) == 0) {
+            break;
         }
-        if (mysql_options(ctx->mysql_hdl, MYSQL_OPT_SSL_MODE, ssl_mode) != 0) {
-            err = PAM_MYSQL_ERR_DB;
+    }
+
+    if (cfg == NULL) {
+        if (NULL == (cfg = xcalloc(1, sizeof(pam_mysql_config_cache_t))) ||
+                NULL == (cfg->path = xstrdup(path))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            xfree(cfg);
+            err = PAM_MYSQL_ERR_ALLOC;
             goto out;
         }
-#endif
+
+        cfg->next = pam_mysql_config_cache;
+        pam_mysql_config_cache = cfg;
+    } else if (cfg->dev == st.st_dev && cfg->ino == st.st_ino &&
+            cfg->mtime == st.st_mtime && cfg->ctime == st.st_ctime &&
+            cfg->mtime_nsec == PAM_MYSQL_ST_MTIME_NSEC(&st) &&
+            cfg->ctime_nsec == PAM_MYSQL_ST_CTIME_NSEC(&st) &&
+            cfg->size == st.st_size) {
+        goto apply;
     }
 
-    if (NULL == mysql_real_connect(ctx->mysql_hdl, host,
-                ctx->user, (ctx->passwd == NULL ? "": ctx->passwd),
-                ctx->db, port, socket, 0)) {
-        err = PAM_MYSQL_ERR_DB;
-        goto out;
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "parsing %s", path);
     }
 
-    if (mysql_select_db(ctx->mysql_hdl, ctx->db)) {
-        err = PAM_MYSQL_ERR_DB;
+    pam_mysql_config_cache_reset(cfg);
+    cfg->size = -1; /* not valid until parsed */
+
+    if ((err = pam_mysql_entry_handler_init(&recorder.hdlr, ctx))) {
         goto out;
     }
 
-    err = PAM_MYSQL_ERR_SUCCESS;
+    recorder.hdlr.handle_entry_fn = pam_mysql_record_entry;
+    recorder.cfg = cfg;
 
-out:
-    if (err == PAM_MYSQL_ERR_DB) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)\n", mysql_error(ctx->mysql_hdl));
-    }
+    err = pam_mysql_parse_config_file(ctx, path, &recorder.hdlr);
+    pam_mysql_entry_handler_destroy(&recorder.hdlr);
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_open_db() returning %d.", err);
+    if (err) {
+        /* apply what was read before the error, as an uncached read would */
+        for (i = 0; i < cfg->nentries; i++) {
+            pam_mysql_apply_entry(ctx, &cfg->entries[i]);
+        }
+        pam_mysql_config_cache_reset(cfg);
+        goto out;
     }
 
-    if (host != ctx->host) {
-        xfree(host);
+    cfg->dev = st.st_dev;
+    cfg->ino = st.st_ino;
+    cfg->mtime = st.st_mtime;
+    cfg->mtime_nsec = PAM_MYSQL_ST_MTIME_NSEC(&st);
+    cfg->ctime = st.st_ctime;
+    cfg->ctime_nsec = PAM_MYSQL_ST_CTIME_NSEC(&st);
+    cfg->size = st.st_size;
+
+apply:
+    for (i = 0; i < cfg->nentries; i++) {
+        if ((err = pam_mysql_apply_entry(ctx, &cfg->entries[i]))) {
+            break;
+        }
     }
 
+out:
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pam_mysql_config_cache_lock);
+#endif
+
     return err;
 }
 
+/* connection pool */
+
+#ifdef HAVE_PTHREAD_H
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    pam_mysql_pool_conn_t *conns;
+    int nconns;
+    pid_t pid;
+} pam_mysql_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0
+};
+
 /**
- * Close a connection to the database.
+ * Close a pooled connection and free it.
+ *
+ * @param pam_mysql_pool_conn_t *conn
+ *   The connection, already unlinked from the pool.
+ */
+static void pam_mysql_pool_conn_free(pam_mysql_pool_conn_t *conn)
+{
+    pam_mysql_stmt_cache_clear(&conn->stmts);
+    mysql_close(conn->mysql_hdl);
+    xfree(conn->mysql_hdl);
+    xfree(conn);
+}
+
+/**
+ * Take a connection out of the process-wide pool.
+ *
+ * Idle connections that have outlived pool_idle_timeout are closed on the
+ * way, except for the last pool_min of them. If no idle connection with the
+ * right fingerprint exists, a slot is reserved for the caller to connect
+ * itself; if the pool is full the caller waits for a connection to be
+ * released.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
+ * @param unsigned long long fp
+ *   The fingerprint of the wanted connection.
+ * @param time_t now
+ *   The current time.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS if ctx->mysql_hdl is now a pooled connection,
+ *   PAM_MYSQL_ERR_NO_ENTRY if a slot has been reserved for a new one.
  */
-static void pam_mysql_close_db(pam_mysql_ctx_t *ctx)
+static pam_mysql_err_t pam_mysql_pool_checkout(pam_mysql_ctx_t *ctx,
+        unsigned long long fp, time_t now)
 {
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_close_db() called.");
+    pam_mysql_err_t err;
+    pam_mysql_pool_conn_t *conn, **pp, *reaped = NULL;
+    struct timespec deadline;
+    int nidle;
+
+    deadline.tv_sec = now + PAM_MYSQL_POOL_WAIT;
+    deadline.tv_nsec = 0;
+
+    pthread_mutex_lock(&pam_mysql_pool.lock);
+
+    if (pam_mysql_pool.pid != getpid()) {
+        /* inherited across fork(); the sockets belong to the parent */
+        pam_mysql_pool.conns = NULL;
+        pam_mysql_pool.nconns = 0;
+        pam_mysql_pool.pid = getpid();
     }
 
-    if (ctx->mysql_hdl == NULL) {
-        return; /* closed already */
+    for (;;) {
+        nidle = 0;
+        for (conn = pam_mysql_pool.conns; conn != NULL; conn = conn->next) {
+            if (!conn->in_use) {
+                nidle++;
+            }
+        }
+
+        for (pp = &pam_mysql_pool.conns; (conn = *pp) != NULL;) {
+            if (!conn->in_use && nidle > ctx->pool_min &&
+                    now - conn->last_used >= ctx->pool_idle_timeout) {
+                *pp = conn->next;
+                conn->next = reaped;
+                reaped = conn;
+                pam_mysql_pool.nconns--;
+                nidle--;
+                continue;
+            }
+            pp = &conn->next;
+        }
+
+        for (conn = pam_mysql_pool.conns; conn != NULL; conn = conn->next) {
+            if (!conn->in_use && conn->fp == fp) {
+                break;
+            }
+        }
+
+        if (conn != NULL) {
+            conn->in_use = 1;
+            ctx->mysql_hdl = conn->mysql_hdl;
+            ctx->pool_conn = conn;
+            ctx->conn_fp = conn->fp;
+            ctx->conn_host = conn->host;
+            ctx->conn_checked = conn->last_used;
+            err = PAM_MYSQL_ERR_SUCCESS;
+            break;
+        }
+
+        if (pam_mysql_pool.nconns < ctx->pool_max) {
+            pam_mysql_pool.nconns++;
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            break;
+        }
+
+        /* full: make room by dropping an idle connection to another server */
+        for (pp = &pam_mysql_pool.conns; (conn = *pp) != NULL; pp = &conn->next) {
+            if (!conn->in_use) {
+                *pp = conn->next;
+                conn->next = reaped;
+                reaped = conn;
+                break;
+            }
+        }
+
+        if (conn != NULL) {
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            break;
+        }
+
+        if (pthread_cond_timedwait(&pam_mysql_pool.released,
+                    &pam_mysql_pool.lock, &deadline) == ETIMEDOUT) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "connection pool exhausted (pool_max = %d)", ctx->pool_max);
+            err = PAM_MYSQL_ERR_DB;
+            break;
+        }
+
+        now = time(NULL);
     }
 
-    mysql_close(ctx->mysql_hdl);
+    pthread_mutex_unlock(&pam_mysql_pool.lock);
 
-    mysql_library_end();
+    while ((conn = reaped) != NULL) {
+        reaped = conn->next;
+        pam_mysql_pool_conn_free(conn);
+    }
 
-    xfree(ctx->mysql_hdl);
-    ctx->mysql_hdl = NULL;
+    return err;
 }
 
 /**
- * Escape a string and append it to another.
+ * Hand a freshly opened connection over to the pool.
+ *
+ * Must follow a pam_mysql_pool_checkout() that reserved a slot.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
- * @param pam_mysql_str_t *append_to
- *   The string to which the escaped text should be appended.
- * @param const char *val
- *   The string to be escaped and appended.
- * @param size_t val_len
- *   The length of the string to be escaped and appended.
- *
- * @return pam_mysql_err_t
- *   Indication of success or failure.
+ * @param int connected
+ *   Zero if the connection could not be opened; the slot is given back.
  */
-static pam_mysql_err_t pam_mysql_quick_escape(pam_mysql_ctx_t *ctx, pam_mysql_str_t *append_to, const char *val, size_t val_len)
+static void pam_mysql_pool_add(pam_mysql_ctx_t *ctx, int connected)
 {
-    size_t len;
-
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_quick_escape() called.");
-    }
+    pam_mysql_pool_conn_t *conn = NULL;
 
-    if (val_len >= (((size_t)-1)>>1) || pam_mysql_str_reserve(append_to, val_len * 2)) {
+    if (connected && NULL == (conn = xcalloc(1, sizeof(pam_mysql_pool_conn_t)))) {
         syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-        return PAM_MYSQL_ERR_ALLOC;
     }
 
-#ifdef HAVE_MYSQL_REAL_ESCAPE_STRING
-    len = mysql_real_escape_string(ctx->mysql_hdl, &append_to->p[append_to->len], val, val_len);
-#else
-    len = mysql_escape_string(&append_to->p[append_to->len], val, val_len);
-#endif
-    append_to->p[append_to->len += len] = '\0';
+    pthread_mutex_lock(&pam_mysql_pool.lock);
 
-    return PAM_MYSQL_ERR_SUCCESS;
+    if (conn == NULL) {
+        /* the connection, if any, stays private to the context */
+        pam_mysql_pool.nconns--;
+        pthread_cond_signal(&pam_mysql_pool.released);
+    } else {
+        conn->mysql_hdl = ctx->mysql_hdl;
+        conn->fp = ctx->conn_fp;
+        conn->host = ctx->conn_host;
+        conn->last_used = ctx->conn_checked;
+        conn->pid = pam_mysql_pool.pid;
+        conn->in_use = 1;
+        conn->next = pam_mysql_pool.conns;
+        pam_mysql_pool.conns = conn;
+        ctx->pool_conn = conn;
+    }
+
+    pthread_mutex_unlock(&pam_mysql_pool.lock);
 }
 
 /**
- * Format a string.
+ * Return the context's connection to the pool.
+ *
+ * The connection is closed instead if it has been marked broken or the
+ * pool is above pool_max.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
- * @param pam_mysql_str_t *pretval
- *   A pointer to the output string.
- * @param const char *template
- *   The template to which arguments should be applied.
- * @param int mangle
- *   Unused parameter - va_start just wants to know where args start.
- * @param mixed
- *   Additional parameters used to replace % macros in the template.
- *
- * @return pam_mysql_err_t
- *   Indication of success or failure.
  */
-static pam_mysql_err_t pam_mysql_format_string(pam_mysql_ctx_t *ctx,
-        pam_mysql_str_t *pretval, const char *template, int mangle, ...)
+static void pam_mysql_pool_checkin(pam_mysql_ctx_t *ctx)
 {
-    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
-    const char *p;
-    const char *name = NULL;
-    const char *commit_ptr;
-    int state;
-    va_list ap;
+    pam_mysql_pool_conn_t *conn = ctx->pool_conn, **pp;
+    int discard = 0;
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_format_string() called");
-    }
+    ctx->pool_conn = NULL;
+    ctx->mysql_hdl = NULL;
+    ctx->conn_fp = 0;
+    ctx->conn_host = 0;
 
-    va_start(ap, mangle);
+    pthread_mutex_lock(&pam_mysql_pool.lock);
 
-    state = 0;
-    for (commit_ptr = p = template; *p != '\0'; p++) {
-        switch (state) {
-            case 0:
-                if (*p == '%') {
-                    if ((err = pam_mysql_str_append(pretval, commit_ptr, (size_t)(p - commit_ptr)))) {
-                        goto out;
-                    }
+    if (conn->pid != pam_mysql_pool.pid) {
+        /* abandoned at fork() */
+        pthread_mutex_unlock(&pam_mysql_pool.lock);
+        return;
+    }
 
-                    commit_ptr = p;
-                    state = 1;
-                }
+    if (conn->broken || pam_mysql_pool.nconns > ctx->pool_max) {
+        for (pp = &pam_mysql_pool.conns; *pp != NULL; pp = &(*pp)->next) {
+            if (*pp == conn) {
+                *pp = conn->next;
                 break;
+            }
+        }
+        pam_mysql_pool.nconns--;
+        discard = 1;
+    } else {
+        conn->in_use = 0;
+        conn->last_used = time(NULL);
+    }
 
-            case 1:
-                switch (*p) {
-                    case '{':
-                        state = 2;
-                        break;
+    pthread_cond_signal(&pam_mysql_pool.released);
+    pthread_mutex_unlock(&pam_mysql_pool.lock);
 
-                    case '[':
-                        state = 4;
-                        break;
+    if (discard) {
+        pam_mysql_pool_conn_free(conn);
+    }
+}
 
-                    case 's': {
-                                  const char *val = va_arg(ap, char *);
+/**
+ * Close every connection of the pool, in use or not.
+ *
+ * Only meant for the module teardown, when no context can use them any more.
+ */
+static void pam_mysql_pool_drain(void)
+{
+    pam_mysql_pool_conn_t *conn;
 
-                                  if ((err = pam_mysql_quick_escape(ctx, pretval, val, strlen(val)))) {
-                                      goto out;
-                                  }
+    pthread_mutex_lock(&pam_mysql_pool.lock);
 
-                                  state = 0;
-                                  commit_ptr = p + 1;
-                              } break;
+    if (pam_mysql_pool.pid == getpid()) {
+        while ((conn = pam_mysql_pool.conns) != NULL) {
+            pam_mysql_pool.conns = conn->next;
+            pam_mysql_pool_conn_free(conn);
+        }
+        pam_mysql_pool.nconns = 0;
+    }
 
-                    case 'S': {
-                                  const char *val = va_arg(ap, char *);
+    pthread_mutex_unlock(&pam_mysql_pool.lock);
+}
+#else
+static pam_mysql_err_t pam_mysql_pool_checkout(pam_mysql_ctx_t *ctx,
+        unsigned long long fp, time_t now)
+{
+    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "connection pooling is not supported in this build.");
+    ctx->pool = 0;
+    return PAM_MYSQL_ERR_NO_ENTRY;
+}
 
-                                  if ((err = pam_mysql_str_append(pretval, val, strlen(val)))) {
-                                      goto out;
-                                  }
+static void pam_mysql_pool_add(pam_mysql_ctx_t *ctx, int connected)
+{
+}
 
-                                  state = 0;
-                                  commit_ptr = p + 1;
-                              } break;
+static void pam_mysql_pool_checkin(pam_mysql_ctx_t *ctx)
+{
+}
 
-                    case 'u': {
-                                  char buf[128];
-                                  unsigned int val = va_arg(ap, unsigned int);
-                                  char *q = buf + sizeof(buf);
+static void pam_mysql_pool_drain(void)
+{
+}
+#endif /* HAVE_PTHREAD_H */
 
-                                  while (--q >= buf) {
-                                      *q = "0123456789"[val % 10];
-                                      val /= 10;
-                                      if (val == 0) break;
-                                  }
+/* a user record found without asking the server */
 
-                                  if ((err = pam_mysql_str_append(pretval, q, sizeof(buf) - (size_t)(q - buf)))) {
-                                      goto out;
-                                  }
+#define PAM_MYSQL_REC_MAX 1024
 
-                                  state = 0;
-                                  commit_ptr = p + 1;
-                              } break;
+typedef struct _pam_mysql_user_rec_t {
+    char data[PAM_MYSQL_REC_MAX];
+    char *row[2]; /* password, status */
+    time_t stored;
+} pam_mysql_user_rec_t;
 
-                    default:
-                              if ((err = pam_mysql_str_append_char(pretval, '%'))) {
-                                  goto out;
-                              }
+/**
+ * Fill a user record.
+ *
+ * @param pam_mysql_user_rec_t *rec
+ *   The record.
+ * @param const char *passwd
+ *   The password column.
+ * @param int passwd_len
+ *   The length of the password column, -1 for NULL.
+ * @param const char *stat
+ *   The status column.
+ * @param int stat_len
+ *   The length of the status column, -1 for NULL.
+ * @param time_t stored
+ *   When the columns were read from the server.
+ *
+ * @return int
+ *   0 on success, -1 if the columns do not fit.
+ */
+static int pam_mysql_user_rec_fill(pam_mysql_user_rec_t *rec,
+        const char *passwd, int passwd_len, const char *stat, int stat_len,
+        time_t stored)
+{
+    char *p = rec->data;
 
-                              if ((err = pam_mysql_str_append_char(pretval, *p))) {
-                                  goto out;
-                              }
+    if (passwd_len < -1 || stat_len < -1 ||
+            (size_t)(passwd_len + 1) + (size_t)(stat_len + 1) > sizeof(rec->data)) {
+        return -1;
+    }
 
-                              state = 0;
-                              commit_ptr = p + 1;
-                              break;
-                }
-                break;
+    rec->row[0] = rec->row[1] = NULL;
 
-            case 2:
-                name = p;
-                state = 3;
-                break;
+    if (passwd_len >= 0) {
+        memcpy(p, passwd, (size_t)passwd_len);
+        p[passwd_len] = '\0';
+        rec->row[0] = p;
+        p += passwd_len + 1;
+    }
 
-            case 3:
-                if (*p == '}') {
-                    const char *val;
-                    int to_release;
+    if (stat_len >= 0) {
+        memcpy(p, stat, (size_t)stat_len);
+        p[stat_len] = '\0';
+        rec->row[1] = p;
+    }
 
-                    if ((err = pam_mysql_get_option(ctx, &val, &to_release, name, (size_t)(p - name)))) {
-                        goto out;
-                    }
+    rec->stored = stored;
 
-                    if (val == NULL) {
-                        val = xstrdup("");
-                    }
+    return 0;
+}
 
-                    if ((err = pam_mysql_quick_escape(ctx, pretval, val, strlen(val)))) {
-                        if (to_release) {
-                            xfree((char *)val);
-                        }
-                        goto out;
-                    }
+/* members of the host list */
+#define PAM_MYSQL_HOSTS_MAX 16
+
+/* state of server outages, kept in the shared cache when there is one;
+ * room for a full host list plus the writer and log hosts and others */
+#define PAM_MYSQL_BREAKERS (PAM_MYSQL_HOSTS_MAX * 2)
+
+typedef struct _pam_mysql_breaker_t {
+    unsigned long long host;    /* hash of the host option, 0 if unused */
+    long long down_since;       /* first failure of the outage, 0 if up */
+    long long retry_at;         /* no attempt before this time */
+    unsigned int failures;      /* attempts failed in a row */
+    unsigned int outages;
+    unsigned int latency;       /* moving average in microseconds */
+    unsigned int samples;
+} pam_mysql_breaker_t;
+
+typedef struct _pam_mysql_outage_t {
+    unsigned int stale_hits;
+    unsigned int reserved;
+    pam_mysql_breaker_t hosts[PAM_MYSQL_BREAKERS];
+} pam_mysql_outage_t;
+
+/* TLS sessions kept for resumption, in the shared cache when there is one */
+#define PAM_MYSQL_TLS_SESSIONS  8
+#define PAM_MYSQL_TLS_DATA      4000
+#define PAM_MYSQL_TLS_REPORT    256
+#define PAM_MYSQL_TLS_RETRIES   4
+
+typedef struct _pam_mysql_tls_session_t {
+    unsigned int seq;           /* sequence lock, as for pam_mysql_shm_slot_t */
+    unsigned int len;
+    unsigned long long key;     /* connection and host, 0 if unused */
+    long long stored;
+    char data[PAM_MYSQL_TLS_DATA];
+} pam_mysql_tls_session_t;
+
+typedef struct _pam_mysql_tls_store_t {
+    unsigned int resumed;       /* handshakes since the last report */
+    unsigned int handshakes;
+    pam_mysql_tls_session_t sessions[PAM_MYSQL_TLS_SESSIONS];
+} pam_mysql_tls_store_t;
+
+/* user records shared between processes through a mapped file */
+
+#if defined(HAVE_SYS_MMAN_H) && defined(__GNUC__)
+#define PAM_MYSQL_SHM_MAGIC     0x504d5343 /* "PMSC" */
+#define PAM_MYSQL_SHM_VERSION   5
+#define PAM_MYSQL_SHM_DATA      480
+#define PAM_MYSQL_SHM_PROBE     8
+#define PAM_MYSQL_SHM_RETRIES   4
+
+typedef struct _pam_mysql_shm_header_t {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nslots;
+    unsigned int slot_size;
+    pam_mysql_outage_t outage;
+    pam_mysql_tls_store_t tls;
+    char reserved[40];
+} pam_mysql_shm_header_t;
 
-                    if (to_release) {
-                        xfree((char *)val);
-                    }
+/*
+ * Each slot is guarded by a sequence lock: a writer makes seq odd while it
+ * updates the slot, readers copy the slot and retry if seq was odd or has
+ * changed in the meantime. Writers claim a slot with compare-and-swap and
+ * simply skip it if another process holds it; this is only a cache.
+ */
+typedef struct _pam_mysql_shm_slot_t {
+    unsigned int seq;
+    unsigned int user_len;
+    unsigned long long key;
+    long long stored;
+    int passwd_len; /* -1 for NULL */
+    int stat_len;   /* -1 for NULL */
+    char data[PAM_MYSQL_SHM_DATA];
+} pam_mysql_shm_slot_t;
+
+static struct {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+    char *path;
+    int failed;
+    void *base;
+    size_t size;
+    pam_mysql_shm_slot_t *slots;
+    unsigned int nslots;
+} pam_mysql_shm = {
+#ifdef HAVE_PTHREAD_H
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    NULL
+};
 
-                    state = 0;
-                    commit_ptr = p + 1;
-                }
-                break;
+/**
+ * Map the cache file, creating it if needed.
+ *
+ * The file must belong to the effective user and be private to it, since
+ * it holds password hashes.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   0 if the cache is usable, -1 otherwise.
+ */
+static int pam_mysql_shm_attach(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_shm_header_t *hdr;
+    struct flock lk;
+    struct stat st;
+    size_t size;
+    void *base = MAP_FAILED;
+    int fd = -1;
+    int retval = -1;
 
-            case 4:
-                name = p;
-                state = 5;
-                break;
+    if (ctx->shm_cache == NULL || ctx->select != NULL) {
+        return -1;
+    }
 
-            case 5:
-                if (*p == ']') {
-                    const char *val;
-                    int to_release;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pam_mysql_shm.lock);
+#endif
 
-                    if ((err = pam_mysql_get_option(ctx, &val, &to_release, name, (size_t)(p - name)))) {
-                        goto out;
-                    }
+    if (pam_mysql_shm.path != NULL) {
+        if (strcmp(pam_mysql_shm.path, ctx->shm_cache) == 0) {
+            retval = pam_mysql_shm.failed ? -1: 0;
+        } else if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "shared cache %s already in use; ignoring %s", pam_mysql_shm.path, ctx->shm_cache);
+        }
+        goto out;
+    }
 
-                    if (val == NULL) {
-                        val = xstrdup("");
-                    }
+    if (NULL == (pam_mysql_shm.path = xstrdup(ctx->shm_cache))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        goto out;
+    }
+    pam_mysql_shm.failed = 1;
 
-                    if ((err = pam_mysql_str_append(pretval, val, strlen(val)))) {
-                        if (to_release) {
-                            xfree((char *)val);
-                        }
-                        goto out;
-                    }
+    if ((fd = open(ctx->shm_cache, O_RDWR | O_CREAT | O_NOFOLLOW, 0600)) < 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to open shared cache %s (%s)", ctx->shm_cache, strerror(errno));
+        goto out;
+    }
 
-                    if (to_release) {
-                        xfree((char *)val);
-                    }
+    memset(&lk, 0, sizeof(lk));
+    lk.l_type = F_WRLCK;
+    lk.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLKW, &lk) < 0 || fstat(fd, &st) < 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to lock shared cache %s (%s)", ctx->shm_cache, strerror(errno));
+        goto out;
+    }
 
-                    state = 0;
-                    commit_ptr = p + 1;
-                }
-                break;
-        }
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "shared cache %s must be a regular file private to uid %d", ctx->shm_cache, (int)geteuid());
+        goto out;
     }
 
-    if (commit_ptr < p) {
-        if ((err = pam_mysql_str_append(pretval, commit_ptr, (size_t)(p - commit_ptr)))) {
+    if (st.st_size == 0) {
+        if (ctx->shm_cache_entries <= 0) {
+            goto out;
+        }
+        size = sizeof(pam_mysql_shm_header_t) +
+            (size_t)ctx->shm_cache_entries * sizeof(pam_mysql_shm_slot_t);
+        if (ftruncate(fd, (off_t)size) < 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to size shared cache %s (%s)", ctx->shm_cache, strerror(errno));
             goto out;
         }
+    } else {
+        size = (size_t)st.st_size;
+    }
+
+    if ((base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to map shared cache %s (%s)", ctx->shm_cache, strerror(errno));
+        goto out;
+    }
+
+    hdr = (pam_mysql_shm_header_t *)base;
+
+    if (st.st_size == 0) {
+        hdr->version = PAM_MYSQL_SHM_VERSION;
+        hdr->nslots = (unsigned int)ctx->shm_cache_entries;
+        hdr->slot_size = sizeof(pam_mysql_shm_slot_t);
+        __atomic_store_n(&hdr->magic, PAM_MYSQL_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    if (hdr->magic != PAM_MYSQL_SHM_MAGIC || hdr->version != PAM_MYSQL_SHM_VERSION ||
+            hdr->slot_size != sizeof(pam_mysql_shm_slot_t) || hdr->nslots == 0 ||
+            sizeof(*hdr) + (size_t)hdr->nslots * sizeof(pam_mysql_shm_slot_t) > size) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "shared cache %s has an unknown format; remove it", ctx->shm_cache);
+        goto out;
     }
 
+    pam_mysql_shm.base = base;
+    pam_mysql_shm.size = size;
+    pam_mysql_shm.slots = (pam_mysql_shm_slot_t *)(hdr + 1);
+    pam_mysql_shm.nslots = hdr->nslots;
+    pam_mysql_shm.failed = 0;
+    base = MAP_FAILED;
+    retval = 0;
+
 out:
-    if (err) {
-        pam_mysql_str_destroy(pretval);
+    if (base != MAP_FAILED) {
+        munmap(base, size);
     }
 
-    va_end(ap);
+    if (fd >= 0) {
+        close(fd); /* also drops the lock */
+    }
 
-    return err;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pam_mysql_shm.lock);
+#endif
+
+    return retval;
 }
 
 /**
- * Check a password.
+ * Unmap the cache file.
+ */
+static void pam_mysql_shm_detach(void)
+{
+    if (pam_mysql_shm.base != NULL) {
+        munmap(pam_mysql_shm.base, pam_mysql_shm.size);
+        pam_mysql_shm.base = NULL;
+        pam_mysql_shm.slots = NULL;
+    }
+
+    xfree(pam_mysql_shm.path);
+    pam_mysql_shm.path = NULL;
+}
+
+/**
+ * Compute the key of a user record.
+ *
+ * The key covers every option that changes which row the user lookup
+ * returns.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
- * @ param const char *user
+ * @param const char *user
  *   A pointer to the user name string.
- * @param const char *password
- *   A pointer to the unencrypted password string.
- * @param int null_inhibited
- *   Whether null authentication tokens should be disallowed.
  *
- * @return pam_mysql_err_t
- *   Indication of success or failure.
+ * @return unsigned long long
+ *   The key, never 0.
  */
-static pam_mysql_err_t pam_mysql_check_passwd(pam_mysql_ctx_t *ctx,
-        const char *user, const char *passwd, int null_inhibited)
+static unsigned long long pam_mysql_shm_key(pam_mysql_ctx_t *ctx, const char *user)
 {
-    pam_mysql_err_t err;
-    pam_mysql_str_t query;
-    MYSQL_RES *result = NULL;
-    MYSQL_ROW row;
-    int vresult;
-
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_check_passwd() called.");
-    }
-
-    /* To avoid putting a plain password in the MySQL log file and on
-     * the wire more than needed we will request the encrypted password
-     * from MySQL. We will check encrypt the passed password against the
-     * one returned from MySQL.
-     */
-    if ((err = pam_mysql_str_init(&query, 1))) {
-        return err;
-    }
-
-    err = ctx->select == NULL ?
-          pam_mysql_format_string(ctx, &query,
-            (ctx->where == NULL ?
-            "SELECT %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = '%s'":
-            "SELECT %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = '%s' AND (%S)"),
-            1, user, ctx->where) :
-          pam_mysql_format_string(ctx, &query, ctx->select, 1, user);
+    unsigned long long key = pam_mysql_conn_fingerprint(ctx);
 
-    if (err) {
-        goto out;
-    }
+    key = pam_mysql_hash_str(key, ctx->table);
+    key = pam_mysql_hash_str(key, ctx->usercolumn);
+    key = pam_mysql_hash_str(key, ctx->passwdcolumn);
+    key = pam_mysql_hash_str(key, ctx->statcolumn);
+    key = pam_mysql_hash_str(key, ctx->where);
+    key = pam_mysql_hash_str(key, user);
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
-    }
+    return key == 0 ? 1: key;
+}
 
-#ifdef HAVE_MYSQL_REAL_QUERY
-    if (mysql_real_query(ctx->mysql_hdl, query.p, query.len)) {
-#else
-        if (mysql_query(ctx->mysql_hdl, query.p)) {
-#endif
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+/**
+ * Take a consistent copy of a slot.
+ *
+ * @return int
+ *   0 on success, -1 if writers kept the slot busy.
+ */
+static int pam_mysql_shm_read(pam_mysql_shm_slot_t *slot, pam_mysql_shm_slot_t *copy)
+{
+    unsigned int seq;
+    int i;
 
-        if (NULL == (result = mysql_store_result(ctx->mysql_hdl))) {
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
+    for (i = 0; i < PAM_MYSQL_SHM_RETRIES; i++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
         }
 
-        switch (mysql_num_rows(result)) {
-            case 0:
-                syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned no result.");
-                err = PAM_MYSQL_ERR_NO_ENTRY;
-                goto out;
-
-            case 1:
-                break;
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-            default:
-                syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned an indetermined result.");
-                err = PAM_MYSQL_ERR_UNKNOWN;
-                goto out;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
         }
+    }
 
-        /* Grab the password from RESULT_SET. */
-        if (NULL == (row = mysql_fetch_row(result))) {
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+    return -1;
+}
 
-        vresult = -1;
+/**
+ * Look up a user record.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param int max_age
+ *   The age in seconds beyond which a record is ignored.
+ * @param pam_mysql_user_rec_t *rec
+ *   Receives the record.
+ *
+ * @return int
+ *   0 on a hit, -1 on a miss.
+ */
+static int pam_mysql_shm_get(pam_mysql_ctx_t *ctx, const char *user,
+        int max_age, pam_mysql_user_rec_t *rec)
+{
+    pam_mysql_shm_slot_t *s, copy;
+    unsigned long long key;
+    int retval = -1;
+    size_t user_len;
+    time_t now;
+    unsigned int i;
 
-        if (row[0] != NULL) {
-            if (passwd != NULL) {
-                char *crypted_password = NULL;
-                switch (ctx->crypt_type) {
-                    /* PLAIN */
-                    case 0:
-                        vresult = strcmp(row[0], passwd);
-                        break;
+    if (max_age <= 0 || pam_mysql_shm_attach(ctx)) {
+        return -1;
+    }
 
-                        /* ENCRYPT */
-                    case 1:
-                        crypted_password = crypt(passwd, row[0]);
-                        if (crypted_password == NULL) {
-                            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "something went wrong when invoking crypt() - %s", strerror(errno));
-                            vresult = 1; // fail
-                        } else {
-                            vresult = strcmp(row[0], crypted_password);
-                        }
-                        break;
+    key = pam_mysql_shm_key(ctx, user);
+    user_len = strlen(user);
+    now = time(NULL);
 
-                        /* PASSWORD */
-                    case 2: {
-                                char buf[42];
-#ifdef HAVE_MAKE_SCRAMBLED_PASSWORD_323
-                                if (ctx->use_323_passwd) {
-                                    syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and enabled in pam_mysql_check_passwd");
-                                    make_scrambled_password_323(buf, passwd);
-                                } else {
-                                    syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and not enabled in pam_mysql_check_passwd");
-                                    make_scrambled_password(buf, passwd);
-                                }
-#else
-                                if (ctx->use_323_passwd) {
-                                    syslog(LOG_WARNING, PAM_MYSQL_LOG_PREFIX "Workaround applied. use_323_passwd not defined but use attempted in pam_mysql_check_passwd");
-                                    compat_make_scrambled_password_323(buf, passwd);
-                                } else {
-                                    syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd not defined and use not attempted in pam_mysql_check_passwd");
-                                    make_scrambled_password(buf, passwd);
-                                }
-#endif
+    for (i = 0; i < PAM_MYSQL_SHM_PROBE && i < pam_mysql_shm.nslots; i++) {
+        s = &pam_mysql_shm.slots[(key + i) % pam_mysql_shm.nslots];
 
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
-                            } break;
+        if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) != key ||
+                pam_mysql_shm_read(s, &copy) || copy.key != key) {
+            continue;
+        }
 
-                            /* MD5 hash (not MD5 crypt()) */
-                    case 3: {
-#ifdef HAVE_PAM_MYSQL_MD5_DATA
-                                char buf[33];
-                                pam_mysql_md5_data((unsigned char*)passwd, strlen(passwd),
-                                        buf);
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
-#else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
-#endif
-                            } break;
+        s = &copy;
 
-                    case 4: {
-#ifdef HAVE_PAM_MYSQL_SHA1_DATA
-                                char buf[41];
-                                pam_mysql_sha1_data((unsigned char*)passwd, strlen(passwd),
-                                        buf);
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
+        if (s->user_len != user_len || memcmp(s->data, user, user_len + 1) != 0 ||
+                s->stored > now || now - s->stored >= max_age ||
+                s->passwd_len < -1 || s->stat_len < -1 ||
+                user_len + 1 + (size_t)(s->passwd_len + 1) + (size_t)(s->stat_len + 1) > PAM_MYSQL_SHM_DATA) {
+            continue;
+        }
+
+        if (pam_mysql_user_rec_fill(rec, s->data + user_len + 1, s->passwd_len,
+                    s->data + user_len + 1 + (s->passwd_len < 0 ? 0: s->passwd_len + 1),
+                    s->stat_len, (time_t)s->stored) == 0) {
+            if (ctx->verbose) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "user record found in the shared cache.");
+            }
+            retval = 0;
+        }
+        break;
+    }
+
+    memset(&copy, 0, sizeof(copy));
+
+    return retval;
+}
+
+/**
+ * Store or drop a user record.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param int drop
+ *   Whether to drop the record rather than store it.
+ * @param const char *passwd
+ *   The password column (may be NULL).
+ * @param const char *stat
+ *   The status column (may be NULL).
+ */
+static void pam_mysql_shm_store(pam_mysql_ctx_t *ctx, const char *user,
+        int drop, const char *passwd, const char *stat)
+{
+    pam_mysql_shm_slot_t *s, *victim = NULL;
+    unsigned long long key;
+    size_t user_len, passwd_len, stat_len;
+    unsigned int seq, i;
+    time_t now;
+    char *p;
+
+    if ((!drop && ctx->shm_cache_ttl <= 0) || pam_mysql_shm_attach(ctx)) {
+        return;
+    }
+
+    user_len = strlen(user);
+    passwd_len = passwd == NULL ? 0: strlen(passwd) + 1;
+    stat_len = stat == NULL ? 0: strlen(stat) + 1;
+
+    if (user_len + 1 + passwd_len + stat_len > PAM_MYSQL_SHM_DATA) {
+        drop = 1; /* too large; make sure no old copy survives */
+    }
+
+    key = pam_mysql_shm_key(ctx, user);
+    now = time(NULL);
+
+    /* the slot already holding the user, or else the oldest one */
+    for (i = 0; i < PAM_MYSQL_SHM_PROBE && i < pam_mysql_shm.nslots; i++) {
+        s = &pam_mysql_shm.slots[(key + i) % pam_mysql_shm.nslots];
+
+        if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) == key) {
+            victim = s;
+            break;
+        }
+
+        if (victim == NULL || s->stored < victim->stored) {
+            victim = s;
+        }
+    }
+
+    if (victim == NULL || (drop && victim->key != key)) {
+        return;
+    }
+
+    seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1,
+                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return; /* somebody else is writing it */
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (drop) {
+        victim->key = 0;
+        victim->stored = 0;
+    } else {
+        victim->key = key;
+        victim->stored = (long long)now;
+        victim->user_len = (unsigned int)user_len;
+        victim->passwd_len = passwd == NULL ? -1: (int)passwd_len - 1;
+        victim->stat_len = stat == NULL ? -1: (int)stat_len - 1;
+
+        p = victim->data;
+        memcpy(p, user, user_len + 1);
+        p += user_len + 1;
+        if (passwd != NULL) {
+            memcpy(p, passwd, passwd_len);
+            p += passwd_len;
+        }
+        if (stat != NULL) {
+            memcpy(p, stat, stat_len);
+        }
+    }
+
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get the outage state kept in the cache file.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_outage_t *
+ *   The outage state, or NULL if there is no shared cache.
+ */
+static pam_mysql_outage_t *pam_mysql_shm_outage(pam_mysql_ctx_t *ctx)
+{
+    if (pam_mysql_shm_attach(ctx)) {
+        return NULL;
+    }
+
+    return &((pam_mysql_shm_header_t *)pam_mysql_shm.base)->outage;
+}
+
+#ifdef HAVE_MYSQL_GET_SSL_SESSION_DATA
+/**
+ * Get the TLS sessions kept in the cache file.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_tls_store_t *
+ *   The sessions, or NULL if there is no shared cache.
+ */
+static pam_mysql_tls_store_t *pam_mysql_shm_tls(pam_mysql_ctx_t *ctx)
+{
+    if (pam_mysql_shm_attach(ctx)) {
+        return NULL;
+    }
+
+    return &((pam_mysql_shm_header_t *)pam_mysql_shm.base)->tls;
+}
+#endif
 #else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA1 hash is not supported in this build.");
+static void pam_mysql_shm_detach(void)
+{
+}
+
+static int pam_mysql_shm_get(pam_mysql_ctx_t *ctx, const char *user,
+        int max_age, pam_mysql_user_rec_t *rec)
+{
+    return -1;
+}
+
+static void pam_mysql_shm_store(pam_mysql_ctx_t *ctx, const char *user,
+        int drop, const char *passwd, const char *stat)
+{
+}
+
+static pam_mysql_outage_t *pam_mysql_shm_outage(pam_mysql_ctx_t *ctx)
+{
+    return NULL;
+}
+
+#ifdef HAVE_MYSQL_GET_SSL_SESSION_DATA
+static pam_mysql_tls_store_t *pam_mysql_shm_tls(pam_mysql_ctx_t *ctx)
+{
+    return NULL;
+}
 #endif
-                            } break;
+#endif /* HAVE_SYS_MMAN_H && __GNUC__ */
 
-                    case 5: {
-#if defined(HAVE_PAM_MYSQL_MD5_DATA) && defined(HAVE_PAM_MYSQL_SHA1_DATA)
-                                char buf[128];
-                                memset(buf, 0, 128);
-                                pam_mysql_drupal7_data((unsigned char*)passwd, strlen(passwd),
-                                        buf, row[0]);
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
-#else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash or SHA support lacking in this build.");
+/* read-only snapshot of the users table, written by pam_mysql_snapshot */
+
+#define PAM_MYSQL_SNAPSHOT_MAGIC        "PMSNAP1"
+#define PAM_MYSQL_SNAPSHOT_BYTE_ORDER   0x01020304
+
+/*
+ * The file is a header, a hash table of nbuckets (a power of two) buckets
+ * probed linearly, and the records. A bucket holds the 32-bit hash of the
+ * user name and the offset of its record in the file, 0 if the bucket is
+ * free. A record is a pam_mysql_snapshot_rec_t followed by the user name,
+ * the password and the status, each terminated by '\0' unless NULL.
+ * Records start on 4-byte boundaries. The file is never modified in
+ * place: a new one is renamed over it.
+ */
+typedef struct _pam_mysql_snapshot_header_t {
+    char magic[8];
+    unsigned int byte_order;
+    unsigned int nbuckets;
+    unsigned int nrecords;
+    unsigned int reserved;
+    unsigned long long scope;
+    long long created;
+} pam_mysql_snapshot_header_t;
+
+typedef struct _pam_mysql_snapshot_bucket_t {
+    unsigned int hash;
+    unsigned int off;
+} pam_mysql_snapshot_bucket_t;
+
+typedef struct _pam_mysql_snapshot_rec_t {
+    unsigned int user_len;
+    int passwd_len; /* -1 for NULL */
+    int stat_len;   /* -1 for NULL */
+} pam_mysql_snapshot_rec_t;
+
+/**
+ * Compute the scope of a snapshot: the options that decide which rows and
+ * columns it holds.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return unsigned long long
+ *   The scope.
+ */
+static unsigned long long pam_mysql_snapshot_scope(pam_mysql_ctx_t *ctx)
+{
+    unsigned long long h = PAM_MYSQL_HASH_INIT;
+
+    h = pam_mysql_hash_str(h, ctx->db);
+    h = pam_mysql_hash_str(h, ctx->table);
+    h = pam_mysql_hash_str(h, ctx->usercolumn);
+    h = pam_mysql_hash_str(h, ctx->passwdcolumn);
+    h = pam_mysql_hash_str(h, ctx->statcolumn);
+    h = pam_mysql_hash_str(h, ctx->where);
+
+    return h;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static struct {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
 #endif
-                            } break;
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    void *base;
+    size_t size;
+} pam_mysql_snapshot = {
+#ifdef HAVE_PTHREAD_H
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    NULL
+};
 
-                    case 6:
-                            {
-                                /* Joomla 1.5 like password */
-#ifdef HAVE_PAM_MYSQL_MD5_DATA
-                                char buf[33];
-                                buf[32]=0;
+/**
+ * Unmap the snapshot. Must be called with the snapshot locked, or at exit.
+ */
+static void pam_mysql_snapshot_detach(void)
+{
+    if (pam_mysql_snapshot.base != NULL) {
+        munmap(pam_mysql_snapshot.base, pam_mysql_snapshot.size);
+        pam_mysql_snapshot.base = NULL;
+    }
 
-                                char *salt = row[0];
-                                char *hash = strsep(&salt,":");
+    xfree(pam_mysql_snapshot.path);
+    pam_mysql_snapshot.path = NULL;
+}
 
-                                if (!salt) {
-                                    syslog(LOG_AUTHPRIV | LOG_WARNING, PAM_MYSQL_LOG_PREFIX "unknown hash format");
-                                    err = PAM_MYSQL_ERR_MISMATCH;
-                                    goto out;
-                                }
-                                int len = strlen(passwd)+strlen(salt);
+/**
+ * Map the current snapshot file, unless it is mapped already. Must be called
+ * with the snapshot locked.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   0 on success, -1 if the file is not usable.
+ */
+static int pam_mysql_snapshot_attach(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_snapshot_header_t *hdr;
+    struct stat st;
+    void *base;
+    int fd;
 
-                                char *tmp;
+    if (lstat(ctx->snapshot, &st) < 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to access snapshot %s (%s)", ctx->snapshot, strerror(errno));
+        return -1;
+    }
 
-                                if (NULL == (tmp = xcalloc(len+1, sizeof(char)))) {
-                                    syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                                    err = PAM_MYSQL_ERR_ALLOC;
-                                    goto out;
-                                }
+    /* pam_mysql_snapshot renames a new file in place */
+    if (pam_mysql_snapshot.base != NULL && pam_mysql_snapshot.dev == st.st_dev &&
+            pam_mysql_snapshot.ino == st.st_ino &&
+            strcmp(pam_mysql_snapshot.path, ctx->snapshot) == 0) {
+        return 0;
+    }
 
-                                strcat(tmp,passwd);
-                                strcat(tmp,salt);
+    pam_mysql_snapshot_detach();
+
+    if ((fd = open(ctx->snapshot, O_RDONLY | O_NOFOLLOW)) < 0 || fstat(fd, &st) < 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to open snapshot %s (%s)", ctx->snapshot, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    /* it is trusted for authentication, so only its owner may write it */
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "snapshot %s must be a regular file owned and only writable by uid %d", ctx->snapshot, (int)geteuid());
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(*hdr) ||
+            (base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to map snapshot %s", ctx->snapshot);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    hdr = (pam_mysql_snapshot_header_t *)base;
+
+    if (memcmp(hdr->magic, PAM_MYSQL_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->byte_order != PAM_MYSQL_SNAPSHOT_BYTE_ORDER ||
+            hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+            sizeof(*hdr) + (size_t)hdr->nbuckets * sizeof(pam_mysql_snapshot_bucket_t) > (size_t)st.st_size) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "snapshot %s has an unknown format", ctx->snapshot);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+
+    if (NULL == (pam_mysql_snapshot.path = xstrdup(ctx->snapshot))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+
+    pam_mysql_snapshot.dev = st.st_dev;
+    pam_mysql_snapshot.ino = st.st_ino;
+    pam_mysql_snapshot.base = base;
+    pam_mysql_snapshot.size = (size_t)st.st_size;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "mapped snapshot %s (%u records)", ctx->snapshot, hdr->nrecords);
+    }
+
+    return 0;
+}
+
+/**
+ * Look a user up in the snapshot.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param pam_mysql_user_rec_t *rec
+ *   Receives the record.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS if the user was found, PAM_MYSQL_ERR_NO_ENTRY if
+ *   not, PAM_MYSQL_ERR_NOTIMPL if the snapshot cannot be used.
+ */
+static pam_mysql_err_t pam_mysql_snapshot_get(pam_mysql_ctx_t *ctx,
+        const char *user, pam_mysql_user_rec_t *rec)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_NOTIMPL;
+    pam_mysql_snapshot_header_t *hdr;
+    pam_mysql_snapshot_bucket_t *buckets;
+    const pam_mysql_snapshot_rec_t *r;
+    const char *data;
+    size_t user_len, avail;
+    unsigned int hash, i, off;
+
+    if (ctx->snapshot == NULL || ctx->select != NULL) {
+        return PAM_MYSQL_ERR_NOTIMPL;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pam_mysql_snapshot.lock);
+#endif
+
+    if (pam_mysql_snapshot_attach(ctx)) {
+        goto out;
+    }
+
+    hdr = (pam_mysql_snapshot_header_t *)pam_mysql_snapshot.base;
+    buckets = (pam_mysql_snapshot_bucket_t *)(hdr + 1);
+
+    if (hdr->scope != pam_mysql_snapshot_scope(ctx)) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "snapshot %s was made with other options; not using it", ctx->snapshot);
+        goto out;
+    }
+
+    user_len = strlen(user);
+    hash = (unsigned int)pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, user);
+    err = PAM_MYSQL_ERR_NO_ENTRY;
+
+    for (i = 0; i < hdr->nbuckets; i++) {
+        pam_mysql_snapshot_bucket_t *b = &buckets[(hash + i) & (hdr->nbuckets - 1)];
+
+        if ((off = b->off) == 0) {
+            break;
+        }
+
+        if (b->hash != hash || (size_t)off + sizeof(*r) > pam_mysql_snapshot.size) {
+            continue;
+        }
+
+        r = (const pam_mysql_snapshot_rec_t *)((const char *)pam_mysql_snapshot.base + off);
+        data = (const char *)(r + 1);
+        avail = pam_mysql_snapshot.size - off - sizeof(*r);
+
+        if (r->user_len != user_len || user_len + 1 > avail ||
+                memcmp(data, user, user_len + 1) != 0) {
+            continue;
+        }
+
+        if (r->passwd_len < -1 || r->stat_len < -1 ||
+                user_len + 1 + (size_t)(r->passwd_len + 1) + (size_t)(r->stat_len + 1) > avail ||
+                pam_mysql_user_rec_fill(rec, data + user_len + 1, r->passwd_len,
+                    data + user_len + 1 + (r->passwd_len < 0 ? 0: r->passwd_len + 1),
+                    r->stat_len, (time_t)hdr->created)) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "snapshot %s is damaged", ctx->snapshot);
+            err = PAM_MYSQL_ERR_NOTIMPL;
+            goto out;
+        }
+
+        err = PAM_MYSQL_ERR_SUCCESS;
+        break;
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "user %s in the snapshot.",
+                err == PAM_MYSQL_ERR_SUCCESS ? "found": "not found");
+    }
+
+out:
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pam_mysql_snapshot.lock);
+#endif
+
+    return err;
+}
+#else
+static void pam_mysql_snapshot_detach(void)
+{
+}
+
+static pam_mysql_err_t pam_mysql_snapshot_get(pam_mysql_ctx_t *ctx,
+        const char *user, pam_mysql_user_rec_t *rec)
+{
+    return PAM_MYSQL_ERR_NOTIMPL;
+}
+#endif /* HAVE_SYS_MMAN_H */
+
+/**
+ * Find a user record without asking the server.
+ *
+ * The snapshot, when configured, is authoritative; otherwise a fresh record
+ * from the shared cache is used.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param pam_mysql_user_rec_t *rec
+ *   Receives the record.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS if found, PAM_MYSQL_ERR_NO_ENTRY if the snapshot
+ *   does not know the user, PAM_MYSQL_ERR_NOTIMPL if the server has to be
+ *   asked.
+ */
+static pam_mysql_err_t pam_mysql_local_record(pam_mysql_ctx_t *ctx,
+        const char *user, pam_mysql_user_rec_t *rec)
+{
+    pam_mysql_err_t err;
+
+    if ((err = pam_mysql_snapshot_get(ctx, user, rec)) != PAM_MYSQL_ERR_NOTIMPL) {
+        return err;
+    }
+
+    if (pam_mysql_shm_get(ctx, user, ctx->shm_cache_ttl, rec) == 0) {
+        return PAM_MYSQL_ERR_SUCCESS;
+    }
+
+    return PAM_MYSQL_ERR_NOTIMPL;
+}
+
+/* degraded operation while the server cannot be reached */
+
+static pam_mysql_outage_t pam_mysql_outage_local;
+
+/**
+ * Get the outage state: the one in the shared cache if there is one, so that
+ * all processes agree on it, or else the one of this process.
+ *
+ * Only claiming the half-open probe of a host is atomic; other updates are
+ * not serialized, and a lost one costs at most an extra connection attempt
+ * or a miscounted log line.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_outage_t *
+ *   The outage state.
+ */
+static pam_mysql_outage_t *pam_mysql_outage(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_outage_t *o = pam_mysql_shm_outage(ctx);
+
+    return o != NULL ? o: &pam_mysql_outage_local;
+}
+
+/**
+ * Compute the key identifying a member of the host list.
+ *
+ * @param const char *host
+ *   The member as given in the options (NULL for the default).
+ *
+ * @return unsigned long long
+ *   The key, never 0.
+ */
+static unsigned long long pam_mysql_host_key(const char *host)
+{
+    return pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, host == NULL ? "": host) | 1;
+}
+
+/**
+ * Get the circuit breaker of a host, taking over a free one if needed.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param unsigned long long key
+ *   The key of the host.
+ *
+ * @return pam_mysql_breaker_t *
+ *   The breaker.
+ */
+static pam_mysql_breaker_t *pam_mysql_breaker(pam_mysql_ctx_t *ctx,
+        unsigned long long key)
+{
+    pam_mysql_outage_t *o = pam_mysql_outage(ctx);
+    pam_mysql_breaker_t *b, *victim = NULL;
+    int i;
+
+    for (i = 0; i < PAM_MYSQL_BREAKERS; i++) {
+        b = &o->hosts[i];
+
+        if (b->host == key) {
+            return b;
+        }
+
+        /* prefer a free entry, then a host that is up, then the one that
+         * failed longest ago */
+        if (victim == NULL || (victim->host != 0 && (b->host == 0 ||
+                        (victim->down_since != 0 && (b->down_since == 0 ||
+                            b->retry_at < victim->retry_at))))) {
+            victim = b;
+        }
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    victim->host = key;
+
+    return victim;
+}
+
+/**
+ * Tell whether a connection to a host may be attempted.
+ *
+ * Once outage_threshold attempts in a row have failed, none is made for
+ * outage_retry seconds; then a single process gets to try again while the
+ * others keep waiting for another outage_retry seconds.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_breaker_t *b
+ *   The breaker of the host.
+ *
+ * @return int
+ *   Non-zero if an attempt may be made.
+ */
+static int pam_mysql_breaker_allow(pam_mysql_ctx_t *ctx, pam_mysql_breaker_t *b)
+{
+    long long retry_at, now;
+
+    if (ctx->outage_retry <= 0 || b->failures < (unsigned int)ctx->outage_threshold) {
+        return 1;
+    }
+
+    now = (long long)time(NULL);
+    retry_at = b->retry_at;
+
+    /* a retry time too far ahead means the clock went back */
+    if (retry_at > now && retry_at - now <= ctx->outage_retry) {
+        return 0;
+    }
+
+#ifdef __GNUC__
+    if (!__atomic_compare_exchange_n(&b->retry_at, &retry_at, now + ctx->outage_retry,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return 0; /* another process is probing */
+    }
+#else
+    b->retry_at = now + ctx->outage_retry;
+#endif
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "probing a database server that was unavailable.");
+    }
+
+    return 1;
+}
+
+/**
+ * Record a failed connection attempt.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_breaker_t *b
+ *   The breaker of the host.
+ * @param const char *host
+ *   The host, for the log.
+ */
+static void pam_mysql_breaker_failure(pam_mysql_ctx_t *ctx,
+        pam_mysql_breaker_t *b, const char *host)
+{
+    time_t now = time(NULL);
+
+    if (b->down_since == 0) {
+        b->down_since = (long long)now;
+        b->outages++;
+
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "database server %s unavailable (outage %u)%s",
+                host == NULL ? "(default)": host, b->outages,
+                ctx->stale_max_age > 0 ? "; using cached user records": "");
+    }
+
+    if (++b->failures == (unsigned int)ctx->outage_threshold && ctx->outage_retry > 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "database server %s failed %u times in a row; trying again every %d seconds",
+                host == NULL ? "(default)": host, b->failures, ctx->outage_retry);
+    }
+
+    if (b->failures >= (unsigned int)ctx->outage_threshold && ctx->outage_retry > 0) {
+        b->retry_at = (long long)now + ctx->outage_retry;
+    }
+}
+
+/**
+ * Record a successful connection.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_breaker_t *b
+ *   The breaker of the host.
+ * @param const char *host
+ *   The host, for the log.
+ */
+static void pam_mysql_breaker_success(pam_mysql_ctx_t *ctx,
+        pam_mysql_breaker_t *b, const char *host)
+{
+    pam_mysql_outage_t *o;
+
+    if (b->down_since == 0) {
+        return;
+    }
+
+    o = pam_mysql_outage(ctx);
+
+    syslog(LOG_AUTHPRIV | LOG_NOTICE, PAM_MYSQL_LOG_PREFIX "database server %s available again after %ld seconds (%u requests answered from cached records)",
+            host == NULL ? "(default)": host,
+            (long)(time(NULL) - (time_t)b->down_since), o->stale_hits);
+
+    o->stale_hits = 0;
+    b->down_since = 0;
+    b->retry_at = 0;
+    b->failures = 0;
+}
+
+/**
+ * Account for the time a connection or a query took on a host.
+ *
+ * @param pam_mysql_breaker_t *b
+ *   The breaker of the host.
+ * @param const struct timeval *start
+ *   When the operation started.
+ */
+static void pam_mysql_host_sample(pam_mysql_breaker_t *b,
+        const struct timeval *start)
+{
+    struct timeval now;
+    long long us;
+
+    gettimeofday(&now, NULL);
+
+    us = (long long)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec);
+    if (us < 0) {
+        return; /* the clock went back */
+    }
+    if (us > 0x7fffffff) {
+        us = 0x7fffffff;
+    }
+
+    /* exponentially weighted, 1/8 for the new sample */
+    if (b->samples++ == 0) {
+        b->latency = (unsigned int)us;
+    } else {
+        b->latency = (unsigned int)(((long long)b->latency * 7 + us) / 8);
+    }
+}
+
+/**
+ * Find a user record to answer with while the server cannot be reached.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_err_t err
+ *   The error that prevented the server from being asked.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param pam_mysql_user_rec_t *rec
+ *   Receives the record.
+ *
+ * @return int
+ *   0 if a record no older than stale_max_age seconds was found, -1
+ *   otherwise.
+ */
+static int pam_mysql_stale_record(pam_mysql_ctx_t *ctx, pam_mysql_err_t err,
+        const char *user, pam_mysql_user_rec_t *rec)
+{
+    pam_mysql_outage_t *o;
+
+    if ((err != PAM_MYSQL_ERR_DB && err != PAM_MYSQL_ERR_IO &&
+                err != PAM_MYSQL_ERR_TIMEOUT) ||
+            pam_mysql_shm_get(ctx, user, ctx->stale_max_age, rec)) {
+        return -1;
+    }
+
+    o = pam_mysql_outage(ctx);
+    o->stale_hits++;
+
+    syslog(LOG_AUTHPRIV | LOG_NOTICE, PAM_MYSQL_LOG_PREFIX "database server unavailable; using a user record %ld seconds old",
+            (long)(time(NULL) - rec->stored));
+
+    return 0;
+}
+
+/**
+ * Connect for an operation on a user record that may be answered locally.
+ *
+ * Nothing is done if the record is in the snapshot or the shared cache; the
+ * operation then connects by itself should the record expire in the
+ * meantime. If the server cannot be reached but a record no older than
+ * stale_max_age seconds is at hand, success is reported as well.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_open_db_for_user(pam_mysql_ctx_t *ctx, const char *user)
+{
+    pam_mysql_err_t err;
+    pam_mysql_user_rec_t rec;
+    int primary = pam_mysql_reads_primary(ctx, user);
+
+    pam_mysql_use_writer(ctx, primary);
+
+    if (ctx->mysql_hdl == NULL && ctx->daemon_fd < 0 && !primary &&
+            pam_mysql_local_record(ctx, user, &rec) != PAM_MYSQL_ERR_NOTIMPL) {
+        memset(&rec, 0, sizeof(rec));
+        return PAM_MYSQL_ERR_SUCCESS;
+    }
+
+    err = pam_mysql_open_db(ctx);
+
+    /* the operation will fall back on the stale record */
+    if ((err == PAM_MYSQL_ERR_DB || err == PAM_MYSQL_ERR_IO ||
+                err == PAM_MYSQL_ERR_TIMEOUT) &&
+            pam_mysql_shm_get(ctx, user, ctx->stale_max_age, &rec) == 0) {
+        err = PAM_MYSQL_ERR_SUCCESS;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+
+    return err;
+}
+
+/**
+ * Make sure a connection is open before issuing a query.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_need_db(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_err_t err;
+
+    if (ctx->mysql_hdl != NULL || ctx->daemon_fd >= 0) {
+        return PAM_MYSQL_ERR_SUCCESS;
+    }
+
+    err = pam_mysql_open_db(ctx);
+
+    return err == PAM_MYSQL_ERR_BUSY ? PAM_MYSQL_ERR_SUCCESS: err;
+}
+
+/* client library lifecycle */
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t pam_mysql_library_once = PTHREAD_ONCE_INIT;
+#endif
+static int pam_mysql_library_ready = 0;
+
+static void pam_mysql_library_init_once(void)
+{
+    if (mysql_library_init(0, NULL, NULL)) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "failed to initialize the MySQL client library");
+        return;
+    }
+
+    pam_mysql_library_ready = 1;
+}
+
+/**
+ * Initialize the MySQL client library once per process.
+ *
+ * mysql_init() would do it implicitly, but not in a thread-safe manner.
+ *
+ * @return pam_mysql_err_t
+ */
+static pam_mysql_err_t pam_mysql_library_init(void)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_once(&pam_mysql_library_once, pam_mysql_library_init_once);
+#else
+    if (!pam_mysql_library_ready) {
+        pam_mysql_library_init_once();
+    }
+#endif
+
+    return pam_mysql_library_ready ? PAM_MYSQL_ERR_SUCCESS : PAM_MYSQL_ERR_DB;
+}
+
+#ifdef __GNUC__
+static void pam_mysql_library_end(void) __attribute__((destructor));
+#endif
+
+/**
+ * Release the MySQL client library when the module is unloaded.
+ */
+static void pam_mysql_library_end(void)
+{
+    /* the log writer may still have entries to write */
+    pam_mysql_log_writer_stop();
+
+    pam_mysql_shm_detach();
+    pam_mysql_snapshot_detach();
+
+    if (!pam_mysql_library_ready) {
+        return;
+    }
+
+    pam_mysql_pool_drain();
+    mysql_library_end();
+    pam_mysql_library_ready = 0;
+}
+
+/**
+ * Compute a fingerprint of the parameters that define a connection.
+ *
+ * Two contexts with the same fingerprint can share a connection; a change in
+ * any of these options requires a new one.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return unsigned long long
+ *   The fingerprint.
+ */
+static unsigned long long pam_mysql_conn_fingerprint(pam_mysql_ctx_t *ctx)
+{
+    unsigned long long h = PAM_MYSQL_HASH_INIT;
+    int multi = pam_mysql_log_piggyback(ctx);
+
+    h = pam_mysql_hash_str(h, ctx->host);
+    h = pam_mysql_hash_str(h, ctx->db);
+    h = pam_mysql_hash_str(h, ctx->user);
+    h = pam_mysql_hash_str(h, ctx->passwd);
+    h = pam_mysql_hash_str(h, ctx->ssl_mode);
+    h = pam_mysql_hash_str(h, ctx->ssl_cert);
+    h = pam_mysql_hash_str(h, ctx->ssl_key);
+    h = pam_mysql_hash_str(h, ctx->ssl_ca);
+    h = pam_mysql_hash_str(h, ctx->ssl_capath);
+    h = pam_mysql_hash_str(h, ctx->ssl_cipher);
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->connect_timeout, sizeof(ctx->connect_timeout));
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->read_timeout, sizeof(ctx->read_timeout));
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->write_timeout, sizeof(ctx->write_timeout));
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->deadline, sizeof(ctx->deadline));
+    h = pam_mysql_hash_mem(h, (const char *)&multi, sizeof(multi));
+
+    return h;
+}
+
+/* reader and writer connections */
+
+/**
+ * Tell whether writes go to a connection of their own.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   Non-zero if write_host or write_user is set.
+ */
+static int pam_mysql_split_roles(pam_mysql_ctx_t *ctx)
+{
+    return ctx->write_host != NULL || ctx->write_user != NULL;
+}
+
+/**
+ * Get the host list for the role the context is in.
+ */
+static const char *pam_mysql_role_host(pam_mysql_ctx_t *ctx)
+{
+    return ctx->writing && ctx->write_host != NULL ? ctx->write_host: ctx->host;
+}
+
+/**
+ * Get the database user for the role the context is in.
+ */
+static const char *pam_mysql_role_user(pam_mysql_ctx_t *ctx)
+{
+    return ctx->writing && ctx->write_user != NULL ? ctx->write_user: ctx->user;
+}
+
+/**
+ * Get the database password for the role the context is in.
+ */
+static const char *pam_mysql_role_passwd(pam_mysql_ctx_t *ctx)
+{
+    return ctx->writing && ctx->write_user != NULL ? ctx->write_passwd: ctx->passwd;
+}
+
+/**
+ * Compute the fingerprint of the connection for the role the context is in.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return unsigned long long
+ *   The fingerprint.
+ */
+static unsigned long long pam_mysql_role_fingerprint(pam_mysql_ctx_t *ctx)
+{
+    unsigned long long h = pam_mysql_conn_fingerprint(ctx);
+
+    if (ctx->writing) {
+        h = pam_mysql_hash_str(h, "writer");
+        h = pam_mysql_hash_str(h, ctx->write_host);
+        h = pam_mysql_hash_str(h, ctx->write_user);
+        h = pam_mysql_hash_str(h, ctx->write_passwd);
+    }
+
+    return h;
+}
+
+/**
+ * Exchange the connection in use with the one of the other role.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_swap_roles(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_conn_t active;
+
+    active.mysql_hdl = ctx->mysql_hdl;
+    active.pool_conn = ctx->pool_conn;
+    active.stmts = ctx->stmts;
+    active.conn_fp = ctx->conn_fp;
+    active.conn_host = ctx->conn_host;
+    active.conn_checked = ctx->conn_checked;
+    active.db_down = ctx->db_down;
+
+    ctx->mysql_hdl = ctx->other_conn.mysql_hdl;
+    ctx->pool_conn = ctx->other_conn.pool_conn;
+    ctx->stmts = ctx->other_conn.stmts;
+    ctx->conn_fp = ctx->other_conn.conn_fp;
+    ctx->conn_host = ctx->other_conn.conn_host;
+    ctx->conn_checked = ctx->other_conn.conn_checked;
+    ctx->db_down = ctx->other_conn.db_down;
+
+    ctx->other_conn = active;
+    ctx->writing = !ctx->writing;
+
+    /* the statement buffers may hold a password */
+    memset(&active, 0, sizeof(active));
+}
+
+/**
+ * Switch the context to the writer or the reader connection.
+ *
+ * Nothing changes unless write_host or write_user is set. The switch is
+ * made before connecting and lasts until the next one, so that a
+ * connection is always opened for the role of the statement that needs it.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param int writing
+ *   Non-zero for the writer.
+ */
+static void pam_mysql_use_writer(pam_mysql_ctx_t *ctx, int writing)
+{
+    if (pam_mysql_split_roles(ctx) && !writing != !ctx->writing) {
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "using the %s connection.", writing ? "writer": "reader");
+        }
+        pam_mysql_swap_roles(ctx);
+    }
+}
+
+/**
+ * Tell whether reads of a user record must go to the writer.
+ *
+ * With read_your_writes, this is the case once this context has changed
+ * the password of the user, as replicas may not have the change yet.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ *
+ * @return int
+ *   Non-zero if the writer must be read.
+ */
+static int pam_mysql_reads_primary(pam_mysql_ctx_t *ctx, const char *user)
+{
+    return ctx->primary_user != NULL && user != NULL &&
+        strcmp(ctx->primary_user, user) == 0;
+}
+
+/**
+ * Let go of the connections of both roles.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param void (*fn)(pam_mysql_ctx_t *)
+ *   pam_mysql_close_db() or pam_mysql_release_db().
+ */
+static void pam_mysql_for_each_role(pam_mysql_ctx_t *ctx,
+        void (*fn)(pam_mysql_ctx_t *))
+{
+    fn(ctx);
+
+    if (ctx->other_conn.mysql_hdl != NULL || ctx->other_conn.db_down) {
+        pam_mysql_swap_roles(ctx);
+        fn(ctx);
+        pam_mysql_swap_roles(ctx);
+    }
+}
+
+/* requests forwarded to pam_mysqld */
+
+/*
+ * Every message starts with a 4-byte header: the protocol version, the
+ * operation (in a request) or the resulting pam_mysql_err_t (in a reply),
+ * and the length of the rest of the message in network byte order. The
+ * rest is a sequence of fields, each made of a 2-byte length in network
+ * byte order, the data, and a '\0' that is not counted in the length, so
+ * that string fields can be used in place. A length of 0xffff stands for
+ * a NULL string.
+ */
+
+typedef struct _pam_mysql_msg_t {
+    int code;
+    pam_mysql_str_t data;
+    const char *fields[PAM_MYSQL_DAEMON_FIELDS_MAX];
+    size_t lens[PAM_MYSQL_DAEMON_FIELDS_MAX];
+    int nfields;
+} pam_mysql_msg_t;
+
+/**
+ * Start a new message.
+ *
+ * @param pam_mysql_str_t *msg
+ *   The string that receives the encoded message.
+ * @param int code
+ *   The operation or the result.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_msg_begin(pam_mysql_str_t *msg, int code)
+{
+    char hdr[4] = { PAM_MYSQL_DAEMON_VERSION, (char)code, 0, 0 };
+
+    pam_mysql_str_init(msg, 1);
+
+    return pam_mysql_str_append(msg, hdr, sizeof(hdr));
+}
+
+/**
+ * Append a field to a message.
+ *
+ * @param pam_mysql_str_t *msg
+ *   The message.
+ * @param const char *val
+ *   The field data, or NULL.
+ * @param size_t len
+ *   The length of the field data.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_msg_add(pam_mysql_str_t *msg,
+        const char *val, size_t len)
+{
+    pam_mysql_err_t err;
+    char hdr[2];
+
+    if (val == NULL) {
+        len = PAM_MYSQL_DAEMON_NULL;
+    } else if (len >= PAM_MYSQL_DAEMON_NULL ||
+            msg->len - 4 + 2 + len + 1 > PAM_MYSQL_DAEMON_MSG_MAX) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "request too large for pam_mysqld");
+        return PAM_MYSQL_ERR_INVAL;
+    }
+
+    hdr[0] = (char)((len >> 8) & 0xff);
+    hdr[1] = (char)(len & 0xff);
+
+    if ((err = pam_mysql_str_append(msg, hdr, sizeof(hdr)))) {
+        return err;
+    }
+
+    if (val == NULL) {
+        return PAM_MYSQL_ERR_SUCCESS;
+    }
+
+    if ((err = pam_mysql_str_append(msg, val, len))) {
+        return err;
+    }
+
+    return pam_mysql_str_append_char(msg, '\0');
+}
+
+/**
+ * Append an integer field to a message.
+ *
+ * @param pam_mysql_str_t *msg
+ *   The message.
+ * @param int val
+ *   The value, sent as 4 bytes in network byte order.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_msg_add_int(pam_mysql_str_t *msg, int val)
+{
+    unsigned int v = (unsigned int)val;
+    char buf[4];
+
+    buf[0] = (char)((v >> 24) & 0xff);
+    buf[1] = (char)((v >> 16) & 0xff);
+    buf[2] = (char)((v >> 8) & 0xff);
+    buf[3] = (char)(v & 0xff);
+
+    return pam_mysql_msg_add(msg, buf, sizeof(buf));
+}
+
+/**
+ * Read an integer field of a received message.
+ *
+ * @param pam_mysql_msg_t *msg
+ *   The message.
+ * @param int idx
+ *   The index of the field.
+ * @param int *pretval
+ *   Receives the value.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_msg_int(pam_mysql_msg_t *msg, int idx, int *pretval)
+{
+    const unsigned char *p;
+
+    if (idx >= msg->nfields || msg->fields[idx] == NULL || msg->lens[idx] != 4) {
+        return PAM_MYSQL_ERR_SYNTAX;
+    }
+
+    p = (const unsigned char *)msg->fields[idx];
+    *pretval = (int)(((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+            ((unsigned int)p[2] << 8) | (unsigned int)p[3]);
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Free a received message.
+ *
+ * @param pam_mysql_msg_t *msg
+ *   The message.
+ */
+static void pam_mysql_msg_destroy(pam_mysql_msg_t *msg)
+{
+    pam_mysql_str_destroy(&msg->data);
+    msg->nfields = 0;
+}
+
+/**
+ * Send a message.
+ *
+ * @param int fd
+ *   The socket.
+ * @param pam_mysql_str_t *msg
+ *   The message.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_msg_send(int fd, pam_mysql_str_t *msg)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    msg->p[2] = (char)(((msg->len - 4) >> 8) & 0xff);
+    msg->p[3] = (char)((msg->len - 4) & 0xff);
+
+    while (off < msg->len) {
+        if ((n = send(fd, msg->p + off, msg->len - off, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return PAM_MYSQL_ERR_IO;
+        }
+        off += (size_t)n;
+    }
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Read exactly len bytes.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_EOF if the peer closed the socket before sending
+ *   anything, PAM_MYSQL_ERR_IO on other failures.
+ */
+static pam_mysql_err_t pam_mysql_read_full(int fd, char *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < len) {
+        if ((n = read(fd, buf + off, len - off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return PAM_MYSQL_ERR_IO;
+        } else if (n == 0) {
+            return off == 0 ? PAM_MYSQL_ERR_EOF: PAM_MYSQL_ERR_IO;
+        }
+        off += (size_t)n;
+    }
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Receive and decode a message.
+ *
+ * @param int fd
+ *   The socket.
+ * @param pam_mysql_msg_t *msg
+ *   Receives the message; to be freed with pam_mysql_msg_destroy() even
+ *   on failure.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_msg_recv(int fd, pam_mysql_msg_t *msg)
+{
+    pam_mysql_err_t err;
+    unsigned char hdr[4];
+    size_t len, off, flen;
+
+    pam_mysql_str_init(&msg->data, 1);
+    msg->nfields = 0;
+
+    if ((err = pam_mysql_read_full(fd, (char *)hdr, sizeof(hdr)))) {
+        return err;
+    }
+
+    if (hdr[0] != PAM_MYSQL_DAEMON_VERSION) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysqld protocol version mismatch (%d)", hdr[0]);
+        return PAM_MYSQL_ERR_IO;
+    }
+
+    msg->code = (signed char)hdr[1];
+    len = ((size_t)hdr[2] << 8) | hdr[3];
+
+    if ((err = pam_mysql_str_reserve(&msg->data, len))) {
+        return err;
+    }
+
+    if (len > 0 && (err = pam_mysql_read_full(fd, msg->data.p, len))) {
+        return err == PAM_MYSQL_ERR_EOF ? PAM_MYSQL_ERR_IO: err;
+    }
+
+    msg->data.len = len;
+
+    for (off = 0; off < len; ) {
+        if (off + 2 > len || msg->nfields >= PAM_MYSQL_DAEMON_FIELDS_MAX) {
+            return PAM_MYSQL_ERR_SYNTAX;
+        }
+
+        flen = ((size_t)(unsigned char)msg->data.p[off] << 8) |
+            (unsigned char)msg->data.p[off + 1];
+        off += 2;
+
+        if (flen == PAM_MYSQL_DAEMON_NULL) {
+            msg->fields[msg->nfields] = NULL;
+            msg->lens[msg->nfields++] = 0;
+            continue;
+        }
+
+        if (off + flen + 1 > len || msg->data.p[off + flen] != '\0') {
+            return PAM_MYSQL_ERR_SYNTAX;
+        }
+
+        msg->fields[msg->nfields] = msg->data.p + off;
+        msg->lens[msg->nfields++] = flen;
+        off += flen + 1;
+    }
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Close the connection to pam_mysqld, if any.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_daemon_close(pam_mysql_ctx_t *ctx)
+{
+    if (ctx->daemon_fd >= 0) {
+        close(ctx->daemon_fd);
+        ctx->daemon_fd = -1;
+    }
+}
+
+/**
+ * Bound the waits on the pam_mysqld socket by the deadline, if it is
+ * nearer than the usual timeout.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param int fd
+ *   The socket.
+ *
+ * @return int
+ *   0, or -1 if the deadline has passed.
+ */
+static int pam_mysql_daemon_timeout(pam_mysql_ctx_t *ctx, int fd)
+{
+    struct timeval tv;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return -1;
+    }
+
+    if (left > 0 && left < PAM_MYSQL_DAEMON_TIMEOUT * 1000) {
+        tv.tv_sec = left / 1000;
+        tv.tv_usec = (left % 1000) * 1000;
+    } else {
+        tv.tv_sec = PAM_MYSQL_DAEMON_TIMEOUT;
+        tv.tv_usec = 0;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    return 0;
+}
+
+/**
+ * Connect to pam_mysqld and hand it the module arguments.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_daemon_connect(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_err_t err;
+    struct sockaddr_un addr;
+    pam_mysql_msg_t resp;
+    int fd;
+
+    if (strlen(ctx->daemon_socket) >= sizeof(addr.sun_path)) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "daemon_socket is too long");
+        return PAM_MYSQL_ERR_INVAL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, ctx->daemon_socket);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return PAM_MYSQL_ERR_IO;
+    }
+
+    if (pam_mysql_daemon_timeout(ctx, fd)) {
+        close(fd);
+        return PAM_MYSQL_ERR_TIMEOUT;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysqld is not available (%s); connecting directly.", strerror(errno));
+        }
+        close(fd);
+        return PAM_MYSQL_ERR_IO;
+    }
+
+    /* freed below even if the HELLO does not get through */
+    pam_mysql_str_init(&resp.data, 1);
+    resp.nfields = 0;
+
+    if ((err = pam_mysql_msg_send(fd, &ctx->daemon_hello)) == PAM_MYSQL_ERR_SUCCESS &&
+            (err = pam_mysql_msg_recv(fd, &resp)) == PAM_MYSQL_ERR_SUCCESS) {
+        err = resp.code;
+    }
+    pam_mysql_msg_destroy(&resp);
+
+    if (err == PAM_MYSQL_ERR_EOF) {
+        syslog(LOG_AUTHPRIV | LOG_WARNING, PAM_MYSQL_LOG_PREFIX "pam_mysqld is busy; connecting directly.");
+        close(fd);
+        return err;
+    } else if (err) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysqld refused the arguments (%d); connecting directly.", err);
+        close(fd);
+        return err;
+    }
+
+    ctx->daemon_fd = fd;
+    ctx->daemon_pid = getpid();
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Forward an operation to pam_mysqld.
+ *
+ * The daemon drops clients that stay idle, so a kept connection found
+ * closed before the request got through is opened again once. If the
+ * daemon cannot be reached anymore, the context falls back to a direct
+ * connection for the rest of its life.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param int op
+ *   The operation.
+ * @param const char **params
+ *   The parameters of the operation.
+ * @param int nparams
+ *   The number of parameters.
+ * @param pam_mysql_msg_t *resp
+ *   Receives the reply; to be freed with pam_mysql_msg_destroy().
+ *
+ * @return pam_mysql_err_t
+ *   The result of the operation, or PAM_MYSQL_ERR_NOTIMPL if it must be
+ *   carried out locally, in which case the database connection is open.
+ */
+static pam_mysql_err_t pam_mysql_daemon_call(pam_mysql_ctx_t *ctx, int op,
+        const char **params, int nparams, pam_mysql_msg_t *resp)
+{
+    pam_mysql_err_t err;
+    pam_mysql_str_t req;
+    int retried = 0;
+    int i;
+
+    pam_mysql_str_init(&resp->data, 1);
+    resp->nfields = 0;
+
+    if ((err = pam_mysql_msg_begin(&req, op))) {
+        goto out;
+    }
+
+    for (i = 0; i < nparams; i++) {
+        if ((err = pam_mysql_msg_add(&req, params[i],
+                        params[i] == NULL ? 0: strlen(params[i])))) {
+            goto out;
+        }
+    }
+
+    for (;;) {
+        if (pam_mysql_daemon_timeout(ctx, ctx->daemon_fd)) {
+            err = PAM_MYSQL_ERR_TIMEOUT;
+            break;
+        }
+
+        if ((err = pam_mysql_msg_send(ctx->daemon_fd, &req)) == PAM_MYSQL_ERR_SUCCESS) {
+            if ((err = pam_mysql_msg_recv(ctx->daemon_fd, resp)) == PAM_MYSQL_ERR_SUCCESS) {
+                err = resp->code;
+                goto out;
+            }
+
+            /* a reply cut short may follow a request that was carried out */
+            if (err != PAM_MYSQL_ERR_EOF) {
+                break;
+            }
+        } else if (err != PAM_MYSQL_ERR_IO) {
+            break;
+        }
+
+        if (retried) {
+            break;
+        }
+
+        pam_mysql_msg_destroy(resp);
+        pam_mysql_daemon_close(ctx);
+        retried = 1;
+
+        if (pam_mysql_daemon_connect(ctx)) {
+            break;
+        }
+    }
+
+    /* a late reply would be taken for the next one */
+    if (err == PAM_MYSQL_ERR_TIMEOUT || pam_mysql_deadline_left(ctx) == 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "deadline of %d seconds passed while waiting for pam_mysqld", ctx->deadline);
+        pam_mysql_daemon_close(ctx);
+        err = PAM_MYSQL_ERR_TIMEOUT;
+        goto out;
+    }
+
+    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "lost pam_mysqld (%d); connecting directly.", err);
+
+    pam_mysql_daemon_close(ctx);
+    ctx->daemon_down = 1;
+
+    err = pam_mysql_open_db(ctx);
+    if (err == PAM_MYSQL_ERR_SUCCESS || err == PAM_MYSQL_ERR_BUSY) {
+        err = PAM_MYSQL_ERR_NOTIMPL;
+    }
+
+out:
+    pam_mysql_str_destroy(&req);
+
+    return err;
+}
+
+/* the deadline option */
+
+/**
+ * Start the clock for the current PAM operation.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_deadline_start(pam_mysql_ctx_t *ctx)
+{
+    timerclear(&ctx->deadline_at);
+
+    if (ctx->deadline > 0) {
+        gettimeofday(&ctx->deadline_at, NULL);
+        ctx->deadline_at.tv_sec += ctx->deadline;
+    }
+}
+
+/**
+ * Get the time left before the deadline of the current operation.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   The number of milliseconds left, 0 if the deadline has passed, or -1
+ *   if there is no deadline.
+ */
+static int pam_mysql_deadline_left(pam_mysql_ctx_t *ctx)
+{
+    struct timeval now;
+    long long ms;
+
+    if (!timerisset(&ctx->deadline_at)) {
+        return -1;
+    }
+
+    gettimeofday(&now, NULL);
+    ms = (long long)(ctx->deadline_at.tv_sec - now.tv_sec) * 1000 +
+        (ctx->deadline_at.tv_usec - now.tv_usec) / 1000;
+
+    return ms > 0 ? (int)ms: 0;
+}
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+/**
+ * Wait for what a non-blocking call of the client library is waiting for.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param MYSQL *hdl
+ *   The handle the call was made on.
+ * @param int status
+ *   The MYSQL_WAIT_* flags returned by the call.
+ *
+ * @return int
+ *   The MYSQL_WAIT_* flags to pass to the _cont() function, or 0 if the
+ *   deadline has passed.
+ */
+static int pam_mysql_wait(pam_mysql_ctx_t *ctx, MYSQL *hdl, int status)
+{
+    struct pollfd pfd;
+    int timeout, left, rc;
+
+    for (;;) {
+        pfd.fd = mysql_get_socket(hdl);
+        pfd.events = (status & MYSQL_WAIT_READ ? POLLIN: 0) |
+            (status & MYSQL_WAIT_WRITE ? POLLOUT: 0) |
+            (status & MYSQL_WAIT_EXCEPT ? POLLPRI: 0);
+        pfd.revents = 0;
+
+        timeout = (status & MYSQL_WAIT_TIMEOUT) ? (int)mysql_get_timeout_value_ms(hdl): -1;
+
+        if ((left = pam_mysql_deadline_left(ctx)) == 0) {
+            return 0;
+        }
+        if (left > 0 && (timeout < 0 || left <= timeout)) {
+            timeout = left;
+        } else {
+            left = -1;
+        }
+
+        if ((rc = poll(&pfd, 1, timeout)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+
+        if (rc == 0) {
+            /* the wait was cut short by the deadline */
+            return left >= 0 ? 0: MYSQL_WAIT_TIMEOUT;
+        }
+
+        return (pfd.revents & (POLLIN | POLLHUP | POLLERR) ? MYSQL_WAIT_READ: 0) |
+            (pfd.revents & (POLLOUT | POLLERR) ? MYSQL_WAIT_WRITE: 0) |
+            (pfd.revents & POLLPRI ? MYSQL_WAIT_EXCEPT: 0);
+    }
+}
+#endif
+
+/**
+ * Give up on the connection after the deadline has passed.
+ *
+ * The connection may be in the middle of a statement, so it is closed
+ * rather than reused.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *what
+ *   What was being done, for the log.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_deadline_abort(pam_mysql_ctx_t *ctx,
+        const char *what)
+{
+    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "deadline of %d seconds passed while %s", ctx->deadline, what);
+
+    if (ctx->mysql_hdl != NULL) {
+        if (ctx->pool_conn != NULL) {
+            ctx->pool_conn->broken = 1;
+        }
+        pam_mysql_close_db(ctx);
+    }
+
+    return PAM_MYSQL_ERR_TIMEOUT;
+}
+
+/**
+ * Send a query on the open connection.
+ *
+ * Within a deadline, the client library's non-blocking API is used where
+ * it is available, so that the query can be abandoned when the deadline
+ * passes. Otherwise the deadline is checked before the query is sent and
+ * the wait is bounded by the read and write timeouts. Log entries held
+ * back for logpiggyback are sent in front of the query.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const pam_mysql_str_t *query
+ *   The query.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_query(pam_mysql_ctx_t *ctx,
+        const pam_mysql_str_t *query)
+{
+    int rc;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return pam_mysql_deadline_abort(ctx, "querying");
+    }
+
+    if (ctx->log_npending > 0 && ctx->log_pending_pid == getpid() &&
+            pam_mysql_log_piggyback(ctx)) {
+        return pam_mysql_log_piggyback_query(ctx, query);
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = mysql_real_query_start(&rc, ctx->mysql_hdl, query->p, query->len);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                return pam_mysql_deadline_abort(ctx, "querying");
+            }
+            status = mysql_real_query_cont(&rc, ctx->mysql_hdl, status);
+        }
+
+        return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+#ifdef HAVE_MYSQL_REAL_QUERY
+    rc = mysql_real_query(ctx->mysql_hdl, query->p, query->len);
+#else
+    rc = mysql_query(ctx->mysql_hdl, query->p);
+#endif
+
+    return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Read the result of the last query; see pam_mysql_query().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param MYSQL_RES **presult
+ *   Receives the result, which is NULL for statements without one.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_store_result(pam_mysql_ctx_t *ctx,
+        MYSQL_RES **presult)
+{
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return pam_mysql_deadline_abort(ctx, "reading a result");
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = mysql_store_result_start(presult, ctx->mysql_hdl);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                *presult = NULL;
+                return pam_mysql_deadline_abort(ctx, "reading a result");
+            }
+            status = mysql_store_result_cont(presult, ctx->mysql_hdl, status);
+        }
+
+        return *presult == NULL ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    *presult = mysql_store_result(ctx->mysql_hdl);
+
+    return *presult == NULL ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Move on to the result of the next statement of a multiple-statement
+ * query; see pam_mysql_query().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_next_result(pam_mysql_ctx_t *ctx)
+{
+    int rc;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return pam_mysql_deadline_abort(ctx, "reading a result");
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = mysql_next_result_start(&rc, ctx->mysql_hdl);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                return pam_mysql_deadline_abort(ctx, "reading a result");
+            }
+            status = mysql_next_result_cont(&rc, ctx->mysql_hdl, status);
+        }
+
+        return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    rc = mysql_next_result(ctx->mysql_hdl);
+
+    return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Check that the open connection is still alive; see pam_mysql_query().
+ *
+ * Unlike the other calls, a passed deadline leaves the connection to the
+ * caller.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_ping(pam_mysql_ctx_t *ctx)
+{
+    int rc;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return PAM_MYSQL_ERR_TIMEOUT;
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = mysql_ping_start(&rc, ctx->mysql_hdl);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                return PAM_MYSQL_ERR_TIMEOUT;
+            }
+            status = mysql_ping_cont(&rc, ctx->mysql_hdl, status);
+        }
+
+        return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    rc = mysql_ping(ctx->mysql_hdl);
+
+    return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Select the database on a connection just made; see pam_mysql_ping().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_select_db(pam_mysql_ctx_t *ctx)
+{
+    int rc;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return PAM_MYSQL_ERR_TIMEOUT;
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = mysql_select_db_start(&rc, ctx->mysql_hdl, ctx->db);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                return PAM_MYSQL_ERR_TIMEOUT;
+            }
+            status = mysql_select_db_cont(&rc, ctx->mysql_hdl, status);
+        }
+
+        return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    rc = mysql_select_db(ctx->mysql_hdl, ctx->db);
+
+    return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Prepare a statement; see pam_mysql_query().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param MYSQL_STMT *stmt
+ *   The statement.
+ * @param const pam_mysql_str_t *sql
+ *   The text of the statement.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_stmt_prepare(pam_mysql_ctx_t *ctx,
+        MYSQL_STMT *stmt, const pam_mysql_str_t *sql)
+{
+    int rc;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return pam_mysql_deadline_abort(ctx, "preparing a statement");
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = mysql_stmt_prepare_start(&rc, stmt, sql->p, sql->len);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                return pam_mysql_deadline_abort(ctx, "preparing a statement");
+            }
+            status = mysql_stmt_prepare_cont(&rc, stmt, status);
+        }
+
+        return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    rc = mysql_stmt_prepare(stmt, sql->p, sql->len);
+
+    return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Execute a prepared statement; see pam_mysql_query().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param MYSQL_STMT *stmt
+ *   The statement, with its parameters bound.
+ * @param int store
+ *   Non-zero to read the result of the statement executed last instead.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_stmt_execute(pam_mysql_ctx_t *ctx,
+        MYSQL_STMT *stmt, int store)
+{
+    int rc;
+    int left = pam_mysql_deadline_left(ctx);
+
+    if (left == 0) {
+        return pam_mysql_deadline_abort(ctx, "executing a statement");
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (left > 0) {
+        int status = store ? mysql_stmt_store_result_start(&rc, stmt):
+            mysql_stmt_execute_start(&rc, stmt);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                return pam_mysql_deadline_abort(ctx, "executing a statement");
+            }
+            status = store ? mysql_stmt_store_result_cont(&rc, stmt, status):
+                mysql_stmt_execute_cont(&rc, stmt, status);
+        }
+
+        return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    rc = store ? mysql_stmt_store_result(stmt): mysql_stmt_execute(stmt);
+
+    return rc ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Apply the connect_timeout, read_timeout and write_timeout options to a
+ * handle that is about to connect.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   0 on success, non-zero if the client library refused an option.
+ */
+static int pam_mysql_set_timeouts(pam_mysql_ctx_t *ctx)
+{
+    unsigned int t;
+    int left = pam_mysql_deadline_left(ctx);
+
+    /* whole seconds at least; the deadline itself is checked more finely */
+    if ((t = (unsigned int)ctx->connect_timeout) > 0 || left > 0) {
+        if (left > 0 && (t == 0 || t > (unsigned int)(left + 999) / 1000)) {
+            t = (unsigned int)(left + 999) / 1000;
+        }
+        if (mysql_options(ctx->mysql_hdl, MYSQL_OPT_CONNECT_TIMEOUT, (const void *)&t)) {
+            return -1;
+        }
+    }
+
+    /* these outlive the operation, so they are bounded by the option */
+    if ((t = (unsigned int)ctx->read_timeout) > 0 || ctx->deadline > 0) {
+        if (ctx->deadline > 0 && (t == 0 || t > (unsigned int)ctx->deadline)) {
+            t = (unsigned int)ctx->deadline;
+        }
+        if (mysql_options(ctx->mysql_hdl, MYSQL_OPT_READ_TIMEOUT, (const void *)&t)) {
+            return -1;
+        }
+    }
+
+    if ((t = (unsigned int)ctx->write_timeout) > 0 || ctx->deadline > 0) {
+        if (ctx->deadline > 0 && (t == 0 || t > (unsigned int)ctx->deadline)) {
+            t = (unsigned int)ctx->deadline;
+        }
+        if (mysql_options(ctx->mysql_hdl, MYSQL_OPT_WRITE_TIMEOUT, (const void *)&t)) {
+            return -1;
+        }
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (ctx->deadline > 0 && mysql_options(ctx->mysql_hdl, MYSQL_OPT_NONBLOCK, 0)) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* members of the host list */
+typedef struct _pam_mysql_host_t {
+    char *spec;     /* the entry as given, NULL for the default */
+    char *host;
+    char *socket;
+    int port;
+    pam_mysql_breaker_t *breaker;
+} pam_mysql_host_t;
+
+/**
+ * Split the host option into its members, in the order they should be
+ * tried: hosts that have not failed lately first, each group ordered by
+ * measured latency.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param char *buf
+ *   A writable copy of the host option, or NULL; entries point into it.
+ * @param pam_mysql_host_t *hosts
+ *   Receives the members, PAM_MYSQL_HOSTS_MAX at most.
+ *
+ * @return int
+ *   The number of members.
+ */
+static int pam_mysql_split_hosts(pam_mysql_ctx_t *ctx, char *buf,
+        pam_mysql_host_t *hosts)
+{
+    pam_mysql_host_t h;
+    char *p, *next = NULL;
+    int n = 0, i, j;
+
+    for (p = buf; p != NULL && n < PAM_MYSQL_HOSTS_MAX; p = next) {
+        char *end;
+
+        if ((next = strchr(p, ',')) != NULL) {
+            *next++ = '\0';
+        }
+
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        for (end = p + strlen(p); end > p && (end[-1] == ' ' || end[-1] == '\t'); end--);
+        *end = '\0';
+
+        if (*p == '\0') {
+            continue;
+        }
+
+        memset(&h, 0, sizeof(h));
+        h.spec = p;
+        h.breaker = pam_mysql_breaker(ctx, pam_mysql_host_key(p));
+        hosts[n++] = h;
+    }
+
+    if (next != NULL) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "only the first %d hosts are used", PAM_MYSQL_HOSTS_MAX);
+    }
+
+    if (n == 0) {
+        memset(&h, 0, sizeof(h));
+        h.breaker = pam_mysql_breaker(ctx, pam_mysql_host_key(NULL));
+        hosts[n++] = h;
+    }
+
+    /* the spec is used for logging; split host and port apart in a copy */
+    for (i = 0; i < n; i++) {
+        if (hosts[i].spec == NULL) {
+            continue;
+        }
+
+        if (hosts[i].spec[0] == '/') {
+            hosts[i].socket = hosts[i].spec;
+        } else if ((p = strchr(hosts[i].spec, ':')) != NULL) {
+            hosts[i].host = hosts[i].spec;
+            hosts[i].port = strtol(p + 1, NULL, 10);
+        } else {
+            hosts[i].host = hosts[i].spec;
+        }
+    }
+
+    /* insertion sort; the list is short and usually in order already */
+    for (i = 1; i < n; i++) {
+        h = hosts[i];
+
+        for (j = i; j > 0; j--) {
+            pam_mysql_breaker_t *a = hosts[j - 1].breaker;
+
+            if ((a->failures != 0) < (h.breaker->failures != 0) ||
+                    ((a->failures != 0) == (h.breaker->failures != 0) &&
+                     a->latency <= h.breaker->latency)) {
+                break;
+            }
+            hosts[j] = hosts[j - 1];
+        }
+        hosts[j] = h;
+    }
+
+    return n;
+}
+
+/* TLS session resumption */
+
+#if defined(HAVE_MYSQL_GET_SSL_SESSION_DATA) && defined(__GNUC__)
+static pam_mysql_tls_store_t pam_mysql_tls_local;
+
+/**
+ * Get the saved TLS sessions: the ones in the shared cache if there is
+ * one, so that forked processes can resume each other's, or else the ones
+ * of this process.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_tls_store_t *
+ *   The sessions.
+ */
+static pam_mysql_tls_store_t *pam_mysql_tls(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_tls_store_t *t = pam_mysql_shm_tls(ctx);
+
+    return t != NULL ? t: &pam_mysql_tls_local;
+}
+
+/**
+ * Compute the key of the TLS session for a member of the host list.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_host_t *h
+ *   The member.
+ *
+ * @return unsigned long long
+ *   The key, never 0.
+ */
+static unsigned long long pam_mysql_tls_key(pam_mysql_ctx_t *ctx,
+        pam_mysql_host_t *h)
+{
+    unsigned long long key = pam_mysql_role_fingerprint(ctx);
+
+    key = pam_mysql_hash_str(key, "tls");
+    key = pam_mysql_hash_str(key, h->spec);
+
+    return key == 0 ? 1: key;
+}
+#endif
+
+/**
+ * Hand the TLS session saved for a host to a handle about to connect.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_host_t *h
+ *   The member of the host list.
+ * @param char *buf
+ *   A buffer of PAM_MYSQL_TLS_DATA bytes that must outlive the connect.
+ */
+static void pam_mysql_tls_offer(pam_mysql_ctx_t *ctx, pam_mysql_host_t *h,
+        char *buf)
+{
+#if defined(HAVE_MYSQL_GET_SSL_SESSION_DATA) && defined(__GNUC__)
+    pam_mysql_tls_store_t *t;
+    pam_mysql_tls_session_t *s;
+    unsigned long long key;
+    unsigned int seq, len;
+    int i, j;
+
+    if (!ctx->ssl_session_reuse) {
+        return;
+    }
+
+    t = pam_mysql_tls(ctx);
+    key = pam_mysql_tls_key(ctx, h);
+
+    for (i = 0; i < PAM_MYSQL_TLS_SESSIONS; i++) {
+        s = &t->sessions[i];
+
+        if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) != key) {
+            continue;
+        }
+
+        for (j = 0; j < PAM_MYSQL_TLS_RETRIES; j++) {
+            seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                continue;
+            }
+
+            len = s->len;
+            if (s->key != key || len == 0 || len >= PAM_MYSQL_TLS_DATA) {
+                return;
+            }
+            memcpy(buf, s->data, len);
+            buf[len] = '\0';
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+                if (mysql_options(ctx->mysql_hdl, MYSQL_OPT_SSL_SESSION_DATA, buf) == 0 &&
+                        ctx->verbose) {
+                    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "offering the saved TLS session for %s.",
+                            h->spec == NULL ? "(default)": h->spec);
+                }
+                return;
+            }
+        }
+
+        return;
+    }
+#endif
+}
+
+/**
+ * Save the TLS session of a new connection, and account for whether it
+ * resumed the one offered.
+ *
+ * The share of resumed sessions is logged every PAM_MYSQL_TLS_REPORT
+ * connections.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_host_t *h
+ *   The member of the host list.
+ */
+static void pam_mysql_tls_save(pam_mysql_ctx_t *ctx, pam_mysql_host_t *h)
+{
+#if defined(HAVE_MYSQL_GET_SSL_SESSION_DATA) && defined(__GNUC__)
+    pam_mysql_tls_store_t *t;
+    pam_mysql_tls_session_t *s, *victim = NULL;
+    unsigned long long key;
+    unsigned int seq, len = 0, n;
+    void *data;
+    int resumed, i;
+
+    if (!ctx->ssl_session_reuse) {
+        return;
+    }
+
+    /* NULL when the connection is not encrypted */
+    if (NULL == (data = mysql_get_ssl_session_data(ctx->mysql_hdl, 0, &len))) {
+        return;
+    }
+
+    t = pam_mysql_tls(ctx);
+    key = pam_mysql_tls_key(ctx, h);
+    resumed = mysql_get_ssl_session_reused(ctx->mysql_hdl) ? 1: 0;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "TLS session with %s %s.",
+                h->spec == NULL ? "(default)": h->spec,
+                resumed ? "resumed": "negotiated in full");
+    }
+
+    /* like the outage state, the counters are not serialized */
+    if (resumed) {
+        __atomic_add_fetch(&t->resumed, 1, __ATOMIC_RELAXED);
+    }
+    if ((n = __atomic_add_fetch(&t->handshakes, 1, __ATOMIC_RELAXED)) == PAM_MYSQL_TLS_REPORT) {
+        syslog(LOG_AUTHPRIV | LOG_INFO, PAM_MYSQL_LOG_PREFIX "TLS sessions resumed on %u of the last %u connections",
+                __atomic_exchange_n(&t->resumed, 0, __ATOMIC_RELAXED), n);
+        __atomic_sub_fetch(&t->handshakes, n, __ATOMIC_RELAXED);
+    }
+
+    if (len == 0 || len >= PAM_MYSQL_TLS_DATA) {
+        goto out;
+    }
+
+    /* the entry of the host, or else the oldest one */
+    for (i = 0; i < PAM_MYSQL_TLS_SESSIONS; i++) {
+        s = &t->sessions[i];
+
+        if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) == key) {
+            victim = s;
+            break;
+        }
+
+        if (victim == NULL || s->stored < victim->stored) {
+            victim = s;
+        }
+    }
+
+    seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1,
+                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        goto out; /* somebody else is writing it */
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    victim->key = key;
+    victim->stored = (long long)time(NULL);
+    victim->len = len;
+    memcpy(victim->data, data, len);
+
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+
+out:
+    mysql_free_ssl_session_data(ctx->mysql_hdl, data);
+#endif
+}
+
+/**
+ * Open the connection on a handle set up by pam_mysql_connect_host().
+ *
+ * Within a deadline, this uses the non-blocking API of the client library
+ * where it is available, like pam_mysql_query().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *host
+ *   The host name, or NULL.
+ * @param int port
+ *   The port number, or 0.
+ * @param const char *socket
+ *   The path to the unix socket, or NULL.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_DB, or PAM_MYSQL_ERR_TIMEOUT.
+ */
+static pam_mysql_err_t pam_mysql_real_connect(pam_mysql_ctx_t *ctx,
+        const char *host, int port, const char *socket)
+{
+    MYSQL *ret;
+    const char *passwd = pam_mysql_role_passwd(ctx);
+    unsigned long flags = 0;
+
+#ifdef CLIENT_MULTI_STATEMENTS
+    /* log entries go in front of lookups (see logpiggyback) */
+    if (pam_mysql_log_piggyback(ctx)) {
+        flags |= CLIENT_MULTI_STATEMENTS;
+    }
+#endif
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    if (pam_mysql_deadline_left(ctx) > 0) {
+        int status = mysql_real_connect_start(&ret, ctx->mysql_hdl, host,
+                pam_mysql_role_user(ctx), (passwd == NULL ? "": passwd),
+                ctx->db, port, socket, flags);
+
+        while (status) {
+            if (!(status = pam_mysql_wait(ctx, ctx->mysql_hdl, status))) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "deadline of %d seconds passed while connecting", ctx->deadline);
+                return PAM_MYSQL_ERR_TIMEOUT;
+            }
+            status = mysql_real_connect_cont(&ret, ctx->mysql_hdl, status);
+        }
+
+        return ret == NULL ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+    }
+#endif
+
+    ret = mysql_real_connect(ctx->mysql_hdl, host, pam_mysql_role_user(ctx),
+            (passwd == NULL ? "": passwd), ctx->db, port, socket, flags);
+
+    return ret == NULL ? PAM_MYSQL_ERR_DB: PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Connect to one member of the host list.
+ *
+ * ctx->mysql_hdl must point to an unused handle; it is left unused again
+ * if the connection fails.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_host_t *h
+ *   The member.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_connect_host(pam_mysql_ctx_t *ctx,
+        pam_mysql_host_t *h)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_DB;
+    char *host = NULL;
+    char session[PAM_MYSQL_TLS_DATA];
+    struct timeval start;
+
+    if (NULL == mysql_init(ctx->mysql_hdl)) {
+        return PAM_MYSQL_ERR_ALLOC;
+    }
+
+    if (h->host != NULL && h->port != 0) {
+        size_t len = (size_t)(strchr(h->host, ':') - h->host);
+
+        if (NULL == (host = xcalloc(len + 1, sizeof(char)))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            err = PAM_MYSQL_ERR_ALLOC;
+            goto out;
+        }
+        memcpy(host, h->host, len);
+        host[len] = '\0';
+    }
+
+    if (ctx->ssl_cert != NULL || ctx->ssl_key != NULL ||
+        ctx->ssl_ca != NULL || ctx->ssl_capath != NULL || ctx->ssl_cipher != NULL) {
+        mysql_ssl_set(ctx->mysql_hdl, ctx->ssl_key, ctx->ssl_cert,
+            ctx->ssl_ca, ctx->ssl_capath, ctx->ssl_cipher);
+    }
+
+    if (ctx->ssl_mode != NULL) {
+#ifdef MARIADB_BASE_VERSION
+        my_bool enable = 1;
+        if (strcasecmp(ctx->ssl_mode, "required") == 0 ||
+            strcasecmp(ctx->ssl_mode, "enforce")) {
+            if (mysql_optionsv(ctx->mysql_hdl, MYSQL_OPT_SSL_ENFORCE,
+                               (void *)&enable) != 0) {
+                err = PAM_MYSQL_ERR_DB;
+                goto out;
+            }
+        } else if (strcasecmp(ctx->ssl_mode, "verify_identity") == 0) {
+            if (mysql_optionsv(ctx->mysql_hdl, MYSQL_OPT_SSL_VERIFY_SERVER_CERT,
+                               (void *)&enable) != 0) {
+                err = PAM_MYSQL_ERR_DB;
+                goto out;
+            }
+        }
+#else
+        int ssl_mode = SSL_MODE_PREFERRED;
+        if (strcasecmp(ctx->ssl_mode, "disabled") == 0) {
+            ssl_mode = SSL_MODE_DISABLED;
+        } else if (strcasecmp(ctx->ssl_mode, "preferred") == 0) {
+            ssl_mode = SSL_MODE_PREFERRED;
+        } else if (strcasecmp(ctx->ssl_mode, "required") == 0 ||
+                   strcasecmp(ctx->ssl_mode, "enforced")) {
+            ssl_mode = SSL_MODE_REQUIRED;
+        } else if (strcasecmp(ctx->ssl_mode, "verify_ca") == 0) {
+            ssl_mode = SSL_MODE_VERIFY_CA;
+        } else if (strcasecmp(ctx->ssl_mode, "verify_identity") == 0) {
+            ssl_mode = SSL_MODE_VERIFY_IDENTITY;
+        }
+        if (mysql_options(ctx->mysql_hdl, MYSQL_OPT_SSL_MODE, ssl_mode) != 0) {
+            err = PAM_MYSQL_ERR_DB;
+            goto out;
+        }
+#endif
+    }
+
+    if (pam_mysql_set_timeouts(ctx)) {
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+    pam_mysql_tls_offer(ctx, h, session);
+
+    gettimeofday(&start, NULL);
+
+    if ((err = pam_mysql_real_connect(ctx, (host != NULL ? host: h->host),
+                    h->port, h->socket))) {
+        pam_mysql_breaker_failure(ctx, h->breaker, h->spec);
+        goto out;
+    }
+
+    if ((err = pam_mysql_select_db(ctx))) {
+        if (err == PAM_MYSQL_ERR_TIMEOUT) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "deadline of %d seconds passed while selecting the database", ctx->deadline);
+        }
+        goto out;
+    }
+
+    pam_mysql_breaker_success(ctx, h->breaker, h->spec);
+    pam_mysql_host_sample(h->breaker, &start);
+    pam_mysql_tls_save(ctx, h);
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "connected to %s (%u us on average).",
+                h->spec == NULL ? "(default)": h->spec, h->breaker->latency);
+    }
+
+    err = PAM_MYSQL_ERR_SUCCESS;
+
+out:
+    if (err == PAM_MYSQL_ERR_DB) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s) on %s\n", mysql_error(ctx->mysql_hdl),
+                h->spec == NULL ? "(default)": h->spec);
+    }
+
+    if (err != PAM_MYSQL_ERR_SUCCESS) {
+        mysql_close(ctx->mysql_hdl);
+    }
+
+    xfree(host);
+
+    return err;
+}
+
+/**
+ * Attempt to open a connection to the database server.
+ *
+ * If a connection is already open and was made with the current connection
+ * parameters it is reused; a connection left idle for longer than
+ * ping_interval seconds is checked with mysql_ping() first. With the "pool"
+ * option the connection is taken from the process-wide pool, and given back
+ * by pam_mysql_release_db().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_open_db(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_err_t err;
+    pam_mysql_host_t hosts[PAM_MYSQL_HOSTS_MAX];
+    char *hosts_buf = NULL;
+    int nhosts, i;
+    unsigned long long fp;
+    time_t now;
+    int pool_slot = 0;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_open_db() called.");
+    }
+
+    if (ctx->daemon_socket != NULL && !ctx->daemon_down && ctx->mysql_hdl == NULL) {
+        /* a forked child must not talk over its parent's connection */
+        if (ctx->daemon_fd >= 0 && ctx->daemon_pid != getpid()) {
+            pam_mysql_daemon_close(ctx);
+        }
+
+        if (ctx->daemon_fd >= 0) {
+            return PAM_MYSQL_ERR_BUSY;
+        }
+
+        if (pam_mysql_daemon_connect(ctx) == PAM_MYSQL_ERR_SUCCESS) {
+            return PAM_MYSQL_ERR_SUCCESS;
+        }
+
+        ctx->daemon_down = 1;
+    }
+
+    fp = pam_mysql_role_fingerprint(ctx);
+    now = time(NULL);
+
+    for (;;) {
+        if (ctx->mysql_hdl == NULL) {
+            if (!ctx->pool) {
+                break;
+            }
+
+            err = pam_mysql_pool_checkout(ctx, fp, now);
+            if (err == PAM_MYSQL_ERR_NO_ENTRY) {
+                pool_slot = ctx->pool;
+                break;
+            } else if (err) {
+                return err;
+            }
+        }
+
+        if (ctx->conn_fp != fp) {
+            if (ctx->verbose) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "connection parameters changed; reconnecting.");
+            }
+            pam_mysql_close_db(ctx);
+        } else if (ctx->ping_interval >= 0 &&
+                now - ctx->conn_checked >= ctx->ping_interval &&
+                pam_mysql_ping(ctx)) {
+            if (ctx->verbose) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "stale connection (%s); reconnecting.", mysql_error(ctx->mysql_hdl));
+            }
+            if (ctx->pool_conn != NULL) {
+                ctx->pool_conn->broken = 1;
+            }
+            pam_mysql_close_db(ctx);
+        } else {
+            ctx->conn_checked = now;
+            return PAM_MYSQL_ERR_BUSY;
+        }
+    }
+
+    if (pam_mysql_role_user(ctx) == NULL) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "required option \"user\" is not set");
+        err = PAM_MYSQL_ERR_INVAL;
+        goto out;
+    }
+
+    if (ctx->db == NULL) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "required option \"db\" is not set");
+        err = PAM_MYSQL_ERR_INVAL;
+        goto out;
+    }
+
+    /* at most one attempt per operation */
+    if (ctx->db_down) {
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "database server unavailable; not connecting.");
+        }
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+    if ((err = pam_mysql_library_init())) {
+        goto out;
+    }
+
+    if (pam_mysql_role_host(ctx) != NULL && NULL == (hosts_buf = xstrdup(pam_mysql_role_host(ctx)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        err = PAM_MYSQL_ERR_ALLOC;
+        goto out;
+    }
+
+    if (NULL == (ctx->mysql_hdl = xcalloc(1, sizeof(MYSQL)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        err = PAM_MYSQL_ERR_ALLOC;
+        goto out;
+    }
+
+    nhosts = pam_mysql_split_hosts(ctx, hosts_buf, hosts);
+
+    /* hosts whose breaker is open are skipped; the next one is tried */
+    err = PAM_MYSQL_ERR_DB;
+    for (i = 0; i < nhosts; i++) {
+        if (pam_mysql_deadline_left(ctx) == 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "deadline of %d seconds passed before connecting", ctx->deadline);
+            err = PAM_MYSQL_ERR_TIMEOUT;
+            break;
+        }
+
+        if (!pam_mysql_breaker_allow(ctx, hosts[i].breaker)) {
+            if (ctx->verbose) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "skipping unavailable database server %s.",
+                        hosts[i].spec == NULL ? "(default)": hosts[i].spec);
+            }
+            continue;
+        }
+
+        if ((err = pam_mysql_connect_host(ctx, &hosts[i])) != PAM_MYSQL_ERR_DB) {
+            break;
+        }
+    }
+
+    if (err) {
+        ctx->db_down = (err == PAM_MYSQL_ERR_DB || err == PAM_MYSQL_ERR_TIMEOUT);
+        goto out;
+    }
+
+    ctx->conn_fp = fp;
+    ctx->conn_host = pam_mysql_host_key(hosts[i].spec);
+    ctx->conn_checked = now;
+
+    err = PAM_MYSQL_ERR_SUCCESS;
+
+out:
+    /* do not leave a handle behind that looks like a connection */
+    if (err != PAM_MYSQL_ERR_SUCCESS && ctx->mysql_hdl != NULL) {
+        xfree(ctx->mysql_hdl);
+        ctx->mysql_hdl = NULL;
+    }
+
+    if (pool_slot) {
+        pam_mysql_pool_add(ctx, err == PAM_MYSQL_ERR_SUCCESS);
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_open_db() returning %d.", err);
+    }
+
+    xfree(hosts_buf);
+
+    return err;
+}
+
+/**
+ * Close a connection to the database.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_close_db(pam_mysql_ctx_t *ctx)
+{
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_close_db() called.");
+    }
+
+    pam_mysql_daemon_close(ctx);
+
+    if (ctx->mysql_hdl == NULL) {
+        return; /* closed already */
+    }
+
+    if (ctx->pool_conn != NULL) {
+        pam_mysql_pool_checkin(ctx);
+        return;
+    }
+
+    pam_mysql_stmt_cache_clear(&ctx->stmts);
+    mysql_close(ctx->mysql_hdl);
+
+    xfree(ctx->mysql_hdl);
+    ctx->mysql_hdl = NULL;
+    ctx->conn_fp = 0;
+    ctx->conn_host = 0;
+}
+
+/**
+ * Let go of the connection of the current role; see pam_mysql_release_db().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_release_role(pam_mysql_ctx_t *ctx)
+{
+    ctx->db_down = 0;
+
+    if (ctx->disconnect_every_op || ctx->pool_conn != NULL) {
+        pam_mysql_close_db(ctx);
+    }
+}
+
+/**
+ * Let go of the connection at the end of a PAM operation.
+ *
+ * A pooled connection goes back to the pool; a private one is only closed
+ * if disconnect_every_op is set. The connection to pam_mysqld is kept for
+ * the life of the context as well, so that the arguments are sent once.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_release_db(pam_mysql_ctx_t *ctx)
+{
+    timerclear(&ctx->deadline_at);
+    if (ctx->disconnect_every_op) {
+        pam_mysql_daemon_close(ctx);
+    }
+    pam_mysql_for_each_role(ctx, pam_mysql_release_role);
+    if (ctx->log_conn != NULL) {
+        pam_mysql_release_db(ctx->log_conn);
+    }
+}
+
+/**
+ * Escape a string and append it to another.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_str_t *append_to
+ *   The string to which the escaped text should be appended.
+ * @param const char *val
+ *   The string to be escaped and appended.
+ * @param size_t val_len
+ *   The length of the string to be escaped and appended.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_quick_escape(pam_mysql_ctx_t *ctx, pam_mysql_str_t *append_to, const char *val, size_t val_len)
+{
+    size_t len;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_quick_escape() called.");
+    }
+
+    if (val_len >= (((size_t)-1)>>1) || pam_mysql_str_reserve(append_to, val_len * 2)) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return PAM_MYSQL_ERR_ALLOC;
+    }
+
+#ifdef HAVE_MYSQL_REAL_ESCAPE_STRING
+    len = mysql_real_escape_string(ctx->mysql_hdl, &append_to->p[append_to->len], val, val_len);
+#else
+    len = mysql_escape_string(&append_to->p[append_to->len], val, val_len);
+#endif
+    append_to->p[append_to->len += len] = '\0';
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Free a compiled query template.
+ *
+ * @param pam_mysql_template_t *tpl
+ *   The template.
+ */
+static void pam_mysql_template_free(pam_mysql_template_t *tpl)
+{
+    xfree(tpl->segs);
+    xfree_overwrite(tpl->text);
+    xfree(tpl);
+}
+
+/**
+ * Append a segment to a compiled query template.
+ *
+ * Adjacent literal segments are merged.
+ *
+ * @param pam_mysql_template_t *tpl
+ *   The template being compiled.
+ * @param pam_mysql_str_t *text
+ *   The literal text of the template so far.
+ * @param int type
+ *   The PAM_MYSQL_SEG_* type of the segment.
+ * @param const char *lit
+ *   The literal to be appended (PAM_MYSQL_SEG_LITERAL only).
+ * @param size_t lit_len
+ *   The length of the literal.
+ * @param pam_mysql_option_t *opt
+ *   The option to be spliced in (PAM_MYSQL_SEG_OPTION only).
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_template_add(pam_mysql_template_t *tpl,
+        pam_mysql_str_t *text, int type, const char *lit, size_t lit_len,
+        pam_mysql_option_t *opt)
+{
+    pam_mysql_err_t err;
+    pam_mysql_segment_t *seg;
+
+    if (type == PAM_MYSQL_SEG_LITERAL) {
+        if (lit_len == 0) {
+            return PAM_MYSQL_ERR_SUCCESS;
+        }
+
+        if ((err = pam_mysql_str_append(text, lit, lit_len))) {
+            return err;
+        }
+
+        tpl->literal_len += lit_len;
+
+        if (tpl->nsegs > 0 && tpl->segs[tpl->nsegs - 1].type == PAM_MYSQL_SEG_LITERAL) {
+            tpl->segs[tpl->nsegs - 1].len += lit_len;
+            return PAM_MYSQL_ERR_SUCCESS;
+        }
+    }
+
+    if (NULL == (seg = xrealloc(tpl->segs, tpl->nsegs + 1, sizeof(pam_mysql_segment_t)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return PAM_MYSQL_ERR_ALLOC;
+    }
+
+    tpl->segs = seg;
+    seg = &tpl->segs[tpl->nsegs++];
+    seg->type = type;
+    seg->off = text->len - (type == PAM_MYSQL_SEG_LITERAL ? lit_len: 0);
+    seg->len = (type == PAM_MYSQL_SEG_LITERAL ? lit_len: 0);
+    seg->opt = opt;
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Compile a query template.
+ *
+ * The template is split into literal text and the slots for the
+ * arguments; %[option] placeholders are resolved into the literal text,
+ * since they only change with the options.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_template_t *tpl
+ *   The template to be filled.
+ * @param const char *template
+ *   The template source.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_compile_template(pam_mysql_ctx_t *ctx,
+        pam_mysql_template_t *tpl, const char *template)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_str_t text;
+    const char *p;
+    const char *name = NULL;
+    const char *commit_ptr;
+    int state;
+
+    if ((err = pam_mysql_str_init(&text, 1))) {
+        return err;
+    }
+
+    state = 0;
+    for (commit_ptr = p = template; *p != '\0'; p++) {
+        switch (state) {
+            case 0:
+                if (*p == '%') {
+                    if ((err = pam_mysql_template_add(tpl, &text, PAM_MYSQL_SEG_LITERAL, commit_ptr, (size_t)(p - commit_ptr), NULL))) {
+                        goto out;
+                    }
+
+                    commit_ptr = p;
+                    state = 1;
+                }
+                break;
+
+            case 1:
+                switch (*p) {
+                    case '{':
+                        state = 2;
+                        break;
+
+                    case '[':
+                        state = 4;
+                        break;
+
+                    case 's':
+                    case 'S':
+                    case 'u':
+                        if ((err = pam_mysql_template_add(tpl, &text,
+                                        (*p == 's' ? PAM_MYSQL_SEG_ESCAPE:
+                                         *p == 'S' ? PAM_MYSQL_SEG_RAW: PAM_MYSQL_SEG_UINT),
+                                        NULL, 0, NULL))) {
+                            goto out;
+                        }
+
+                        state = 0;
+                        commit_ptr = p + 1;
+                        break;
+
+                    default:
+                        if ((err = pam_mysql_template_add(tpl, &text, PAM_MYSQL_SEG_LITERAL, p - 1, 2, NULL))) {
+                            goto out;
+                        }
+
+                        state = 0;
+                        commit_ptr = p + 1;
+                        break;
+                }
+                break;
+
+            case 2:
+                name = p;
+                state = 3;
+                break;
+
+            case 3:
+                if (*p == '}') {
+                    pam_mysql_option_t *opt = pam_mysql_find_option(options, name, (size_t)(p - name));
+
+                    if (opt == NULL) {
+                        if (ctx->verbose) {
+                            char buf[1024];
+                            strnncpy(buf, sizeof(buf), name, (size_t)(p - name));
+                            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unknown option: %s", buf);
+                        }
+
+                        err = PAM_MYSQL_ERR_NO_ENTRY;
+                        goto out;
+                    }
+
+                    if ((err = pam_mysql_template_add(tpl, &text, PAM_MYSQL_SEG_OPTION, NULL, 0, opt))) {
+                        goto out;
+                    }
+
+                    state = 0;
+                    commit_ptr = p + 1;
+                }
+                break;
+
+            case 4:
+                name = p;
+                state = 5;
+                break;
+
+            case 5:
+                if (*p == ']') {
+                    const char *val;
+                    int to_release;
+
+                    if ((err = pam_mysql_get_option(ctx, &val, &to_release, name, (size_t)(p - name)))) {
+                        goto out;
+                    }
+
+                    if (val != NULL) {
+                        err = pam_mysql_template_add(tpl, &text, PAM_MYSQL_SEG_LITERAL, val, strlen(val), NULL);
+
+                        if (to_release) {
+                            xfree((char *)val);
+                        }
+
+                        if (err) {
+                            goto out;
+                        }
+                    }
+
+                    state = 0;
+                    commit_ptr = p + 1;
+                }
+                break;
+        }
+    }
+
+    if (commit_ptr < p) {
+        if ((err = pam_mysql_template_add(tpl, &text, PAM_MYSQL_SEG_LITERAL, commit_ptr, (size_t)(p - commit_ptr), NULL))) {
+            goto out;
+        }
+    }
+
+    if (text.alloc_size > 0) {
+        tpl->text = text.p;
+        text.alloc_size = 0;
+    }
+
+out:
+    pam_mysql_str_destroy(&text);
+
+    return err;
+}
+
+/**
+ * Get the compiled form of a query template.
+ *
+ * Templates are compiled once per context and recompiled when an option
+ * has changed since.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *template
+ *   The template source; identified by its address.
+ * @param pam_mysql_template_t **pretval
+ *   Receives the compiled template.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_get_template(pam_mysql_ctx_t *ctx,
+        const char *template, pam_mysql_template_t **pretval)
+{
+    pam_mysql_err_t err;
+    pam_mysql_template_t *tpl, **ptpl;
+
+    for (ptpl = &ctx->templates; (tpl = *ptpl) != NULL; ptpl = &tpl->next) {
+        if (tpl->src == template) {
+            if (tpl->gen == ctx->options_gen) {
+                *pretval = tpl;
+                return PAM_MYSQL_ERR_SUCCESS;
+            }
+
+            *ptpl = tpl->next;
+            pam_mysql_template_free(tpl);
+            break;
+        }
+    }
+
+    if (NULL == (tpl = xcalloc(1, sizeof(pam_mysql_template_t)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return PAM_MYSQL_ERR_ALLOC;
+    }
+
+    if ((err = pam_mysql_compile_template(ctx, tpl, template))) {
+        pam_mysql_template_free(tpl);
+        return err;
+    }
+
+    tpl->src = template;
+    tpl->gen = ctx->options_gen;
+    tpl->next = ctx->templates;
+    ctx->templates = tpl;
+
+    *pretval = tpl;
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Format a string.
+ *
+ * The template is compiled on first use (see pam_mysql_get_template()),
+ * so that a call only splices the arguments in between the precomputed
+ * literals, into a buffer sized up front.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_str_t *pretval
+ *   A pointer to the output string.
+ * @param const char *template
+ *   The template to which arguments should be applied.
+ * @param int mangle
+ *   Unused parameter - va_start just wants to know where args start.
+ * @param mixed
+ *   Additional parameters used to replace % macros in the template.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_format_string(pam_mysql_ctx_t *ctx,
+        pam_mysql_str_t *pretval, const char *template, int mangle, ...)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_template_t *tpl;
+    pam_mysql_segment_t *seg;
+    size_t len, i;
+    va_list ap, aq;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_format_string() called");
+    }
+
+    va_start(ap, mangle);
+
+    if ((err = pam_mysql_get_template(ctx, template, &tpl))) {
+        goto out;
+    }
+
+    /* size the output */
+    len = tpl->literal_len;
+    va_copy(aq, ap);
+    for (i = 0, seg = tpl->segs; i < tpl->nsegs; i++, seg++) {
+        switch (seg->type) {
+            case PAM_MYSQL_SEG_ESCAPE:
+                len += strlen(va_arg(aq, char *)) * 2;
+                break;
+
+            case PAM_MYSQL_SEG_RAW:
+                len += strlen(va_arg(aq, char *));
+                break;
+
+            case PAM_MYSQL_SEG_UINT:
+                (void)va_arg(aq, unsigned int);
+                len += 10;
+                break;
+        }
+    }
+    va_end(aq);
+
+    if ((err = pam_mysql_str_reserve(pretval, len))) {
+        goto out;
+    }
+
+    for (i = 0, seg = tpl->segs; i < tpl->nsegs; i++, seg++) {
+        switch (seg->type) {
+            case PAM_MYSQL_SEG_LITERAL:
+                err = pam_mysql_str_append(pretval, &tpl->text[seg->off], seg->len);
+                break;
+
+            case PAM_MYSQL_SEG_ESCAPE: {
+                                           const char *val = va_arg(ap, char *);
+                                           err = pam_mysql_quick_escape(ctx, pretval, val, strlen(val));
+                                       } break;
+
+            case PAM_MYSQL_SEG_RAW: {
+                                        const char *val = va_arg(ap, char *);
+                                        err = pam_mysql_str_append(pretval, val, strlen(val));
+                                    } break;
+
+            case PAM_MYSQL_SEG_UINT: {
+                                         char buf[128];
+                                         unsigned int val = va_arg(ap, unsigned int);
+                                         char *q = buf + sizeof(buf);
+
+                                         while (--q >= buf) {
+                                             *q = "0123456789"[val % 10];
+                                             val /= 10;
+                                             if (val == 0) break;
+                                         }
+
+                                         err = pam_mysql_str_append(pretval, q, sizeof(buf) - (size_t)(q - buf));
+                                     } break;
+
+            case PAM_MYSQL_SEG_OPTION: {
+                                           const char *val;
+                                           int to_release;
+
+                                           if ((err = seg->opt->accessor->get_op((void *)((char *)ctx + seg->opt->offset), &val, &to_release))) {
+                                               break;
+                                           }
+
+                                           err = pam_mysql_quick_escape(ctx, pretval, val == NULL ? "": val, val == NULL ? 0: strlen(val));
+
+                                           if (to_release) {
+                                               xfree((char *)val);
+                                           }
+                                       } break;
+        }
+
+        if (err) {
+            goto out;
+        }
+    }
+
+out:
+    if (err) {
+        pam_mysql_str_destroy(pretval);
+    }
+
+    va_end(ap);
+
+    return err;
+}
+
+/**
+ * Close the prepared statements of a connection.
+ *
+ * @param pam_mysql_stmt_cache_t *cache
+ *   The statement cache of the connection.
+ */
+static void pam_mysql_stmt_cache_clear(pam_mysql_stmt_cache_t *cache)
+{
+    int i;
+
+    for (i = 0; i < PAM_MYSQL_STMT_MAX; i++) {
+        if (cache->stmt[i] != NULL) {
+            mysql_stmt_close(cache->stmt[i]);
+        }
+        xfree(cache->sql[i]);
+    }
+
+    for (i = 0; i < PAM_MYSQL_STMT_MAX_COLS; i++) {
+        xfree(cache->big[i]);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * Run one of the built-in queries as a prepared statement.
+ *
+ * The statement is prepared on first use on a connection and kept with it.
+ * The template is expanded like in pam_mysql_format_string() with the
+ * value of the "where" option as the only argument, and must contain one
+ * "?" marker per parameter. Result columns are fetched into buffers that
+ * belong to the connection and stay valid until the next call.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param int slot
+ *   The PAM_MYSQL_STMT_* identifier of the statement.
+ * @param const char *template
+ *   The query template.
+ * @param const char **params
+ *   The string parameters.
+ * @param unsigned int nparams
+ *   The number of parameters.
+ * @param MYSQL_ROW *prow
+ *   Receives the only row of the result, or NULL for statements that
+ *   return none.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_NOTIMPL if the statement could not be prepared, in which
+ *   case the caller should fall back to a plain query.
+ */
+static pam_mysql_err_t pam_mysql_stmt_run(pam_mysql_ctx_t *ctx, int slot,
+        const char *template, const char **params, unsigned int nparams,
+        MYSQL_ROW *prow)
+{
+    pam_mysql_err_t err;
+    pam_mysql_stmt_cache_t *cache;
+    pam_mysql_str_t sql;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND pbind[PAM_MYSQL_STMT_MAX_PARAMS];
+    MYSQL_BIND rbind[PAM_MYSQL_STMT_MAX_COLS];
+    unsigned long plen[PAM_MYSQL_STMT_MAX_PARAMS];
+    unsigned long rlen[PAM_MYSQL_STMT_MAX_COLS];
+    my_bool rnull[PAM_MYSQL_STMT_MAX_COLS];
+    unsigned int i, ncols = 0;
+    int stored = 0;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_stmt_run() called.");
+    }
+
+    cache = ctx->pool_conn != NULL ? &ctx->pool_conn->stmts : &ctx->stmts;
+
+    /* the server refused it before; don't ask again on this connection */
+    if (cache->unpreparable[slot]) {
+        return PAM_MYSQL_ERR_NOTIMPL;
+    }
+
+    if ((err = pam_mysql_str_init(&sql, 0))) {
+        return err;
+    }
+
+    if ((err = pam_mysql_format_string(ctx, &sql, template, 1, ctx->where))) {
+        goto out;
+    }
+
+    if ((stmt = cache->stmt[slot]) == NULL || strcmp(cache->sql[slot], sql.p) != 0) {
+        if (stmt != NULL) {
+            mysql_stmt_close(stmt);
+            xfree(cache->sql[slot]);
+            cache->stmt[slot] = NULL;
+            cache->sql[slot] = NULL;
+        }
+
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "preparing %s", sql.p);
+        }
+
+        if (NULL == (stmt = mysql_stmt_init(ctx->mysql_hdl))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            err = PAM_MYSQL_ERR_ALLOC;
+            goto out;
+        }
+
+        if ((err = pam_mysql_stmt_prepare(ctx, stmt, &sql)) == PAM_MYSQL_ERR_TIMEOUT) {
+            /* the connection has been closed under it */
+            mysql_stmt_close(stmt);
+            goto out;
+        }
+
+        if (err || mysql_stmt_param_count(stmt) != nparams ||
+                mysql_stmt_field_count(stmt) > PAM_MYSQL_STMT_MAX_COLS) {
+            syslog(LOG_AUTHPRIV | LOG_WARNING, PAM_MYSQL_LOG_PREFIX "unable to prepare statement (%s); falling back to plain queries", mysql_stmt_error(stmt));
+            mysql_stmt_close(stmt);
+            cache->unpreparable[slot] = 1;
+            err = PAM_MYSQL_ERR_NOTIMPL;
+            goto out;
+        }
+
+        if (NULL == (cache->sql[slot] = xstrdup(sql.p))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            mysql_stmt_close(stmt);
+            err = PAM_MYSQL_ERR_ALLOC;
+            goto out;
+        }
+
+        cache->stmt[slot] = stmt;
+    }
+
+    memset(pbind, 0, sizeof(pbind));
+    for (i = 0; i < nparams; i++) {
+        plen[i] = strlen(params[i]);
+        pbind[i].buffer_type = MYSQL_TYPE_STRING;
+        pbind[i].buffer = (char *)params[i];
+        pbind[i].buffer_length = plen[i];
+        pbind[i].length = &plen[i];
+    }
+
+    if (nparams > 0 && mysql_stmt_bind_param(stmt, pbind)) {
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+    if ((err = pam_mysql_stmt_execute(ctx, stmt, 0))) {
+        goto out;
+    }
+
+    if (prow == NULL) {
+        err = PAM_MYSQL_ERR_SUCCESS;
+        goto out;
+    }
+
+    ncols = mysql_stmt_field_count(stmt);
+
+    memset(rbind, 0, sizeof(rbind));
+    for (i = 0; i < ncols; i++) {
+        xfree(cache->big[i]);
+        cache->big[i] = NULL;
+        rbind[i].buffer_type = MYSQL_TYPE_STRING;
+        rbind[i].buffer = cache->buf[i];
+        rbind[i].buffer_length = sizeof(cache->buf[i]);
+        rbind[i].length = &rlen[i];
+        rbind[i].is_null = &rnull[i];
+    }
+
+    if (mysql_stmt_bind_result(stmt, rbind)) {
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+    if ((err = pam_mysql_stmt_execute(ctx, stmt, 1))) {
+        goto out;
+    }
+
+    stored = 1;
+
+    switch (mysql_stmt_num_rows(stmt)) {
+        case 0:
+            syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned no result.");
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            goto out;
+
+        case 1:
+            break;
+
+        default:
+            syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned an indetermined result.");
+            err = PAM_MYSQL_ERR_UNKNOWN;
+            goto out;
+    }
+
+    switch (mysql_stmt_fetch(stmt)) {
+        case 0:
+        case MYSQL_DATA_TRUNCATED:
+            break;
+
+        default:
+            err = PAM_MYSQL_ERR_DB;
+            goto out;
+    }
+
+    for (i = 0; i < ncols; i++) {
+        if (rnull[i]) {
+            cache->row[i] = NULL;
+            continue;
+        }
+
+        if (rlen[i] < sizeof(cache->buf[i])) {
+            cache->buf[i][rlen[i]] = '\0';
+            cache->row[i] = cache->buf[i];
+            continue;
+        }
+
+        /* too long for the preallocated buffer */
+        if (NULL == (cache->big[i] = xcalloc(rlen[i] + 1, sizeof(char)))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            err = PAM_MYSQL_ERR_ALLOC;
+            goto out;
+        }
+
+        rbind[i].buffer = cache->big[i];
+        rbind[i].buffer_length = rlen[i] + 1;
+
+        if (mysql_stmt_fetch_column(stmt, &rbind[i], i, 0)) {
+            err = PAM_MYSQL_ERR_DB;
+            goto out;
+        }
+
+        cache->row[i] = cache->big[i];
+    }
+
+    *prow = cache->row;
+    err = PAM_MYSQL_ERR_SUCCESS;
+
+out:
+    if (stored) {
+        mysql_stmt_free_result(stmt);
+    }
+
+    if (err == PAM_MYSQL_ERR_DB && cache->stmt[slot] != NULL) {
+        /* the handle does not carry statement errors; report it here */
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_stmt_error(cache->stmt[slot]));
+
+        /* prepare it afresh next time */
+        mysql_stmt_close(cache->stmt[slot]);
+        xfree(cache->sql[slot]);
+        cache->stmt[slot] = NULL;
+        cache->sql[slot] = NULL;
+    }
+
+    pam_mysql_str_destroy(&sql);
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_stmt_run() returning %d.", err);
+    }
+
+    return err;
+}
+
+/**
+ * Compute the PAM_MYSQL_USER_STAT_* flags of a user.
+ *
+ * @param const char *stat
+ *   The value of the status column.
+ * @param const char *passwd
+ *   The value of the password column.
+ *
+ * @return int
+ *   The status flags.
+ */
+static int pam_mysql_user_stat_of(const char *stat, const char *passwd)
+{
+    int retval;
+
+    if (stat == NULL) {
+        retval = PAM_MYSQL_USER_STAT_EXPIRED;
+    } else {
+        retval = strtol(stat, NULL, 10) & ~PAM_MYSQL_USER_STAT_NULL_PASSWD;
+    }
+
+    if (passwd == NULL) {
+        retval |= PAM_MYSQL_USER_STAT_NULL_PASSWD;
+    }
+
+    return retval;
+}
+
+/**
+ * Remember the status of a user fetched along with the password, so that
+ * pam_mysql_query_user_stat() can answer without another query.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param int stat
+ *   The status flags.
+ */
+static void pam_mysql_stat_cache_put(pam_mysql_ctx_t *ctx, const char *user, int stat)
+{
+    if (ctx->stat_cache_ttl <= 0) {
+        return;
+    }
+
+    if (ctx->stat_user == NULL || strcmp(ctx->stat_user, user) != 0) {
+        xfree(ctx->stat_user);
+
+        if (NULL == (ctx->stat_user = xstrdup(user))) {
+            return; /* it is only a cache */
+        }
+    }
+
+    ctx->stat_value = stat;
+    ctx->stat_time = time(NULL);
+}
+
+/**
+ * Get the status of a user remembered by pam_mysql_stat_cache_put().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param int *pstat
+ *   Receives the status flags.
+ *
+ * @return int
+ *   0 on a hit, -1 on a miss.
+ */
+static int pam_mysql_stat_cache_get(pam_mysql_ctx_t *ctx, const char *user, int *pstat)
+{
+    if (ctx->stat_user == NULL || strcmp(ctx->stat_user, user) != 0 ||
+            time(NULL) - ctx->stat_time >= ctx->stat_cache_ttl) {
+        return -1;
+    }
+
+    *pstat = ctx->stat_value;
+
+    return 0;
+}
+
+/* cache of verification results, shared by every context in the process */
+
+#define PAM_MYSQL_VCACHE_SIZE 1024
+
+typedef struct _pam_mysql_vcache_entry_t {
+    unsigned long long key;
+    unsigned char mac[32];
+    pam_mysql_err_t result;
+    time_t expires;
+} pam_mysql_vcache_entry_t;
+
+#ifdef HAVE_OPENSSL
+static struct {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+    int state; /* 0: no secret yet, 1: ready, -1: unusable */
+    unsigned char secret[32];
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+    pam_mysql_vcache_entry_t entries[PAM_MYSQL_VCACHE_SIZE];
+} pam_mysql_vcache = {
+#ifdef HAVE_PTHREAD_H
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    0
+};
+
+/**
+ * Compute the cache key and the keyed hash of a set of credentials.
+ *
+ * The key covers the user and every option that affects the outcome of
+ * pam_mysql_check_passwd(); the HMAC, keyed with a per-process secret,
+ * covers the key, the user name and the password. Must be called with the
+ * cache locked.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param const char *passwd
+ *   A pointer to the unencrypted password string.
+ * @param int null_inhibited
+ *   Whether null authentication tokens should be disallowed.
+ * @param unsigned long long *pkey
+ *   Receives the cache key.
+ * @param unsigned char *mac
+ *   Receives the HMAC (32 bytes).
+ *
+ * @return int
+ *   0 on success, -1 if the credentials cannot be cached.
+ */
+static int pam_mysql_vcache_digest(pam_mysql_ctx_t *ctx, const char *user,
+        const char *passwd, int null_inhibited, unsigned long long *pkey,
+        unsigned char *mac)
+{
+    unsigned char data[512];
+    size_t user_len, passwd_len;
+    unsigned long long key;
+    char crypt_type[2] = { (char)('0' + ctx->crypt_type), '\0' };
+    int retval = -1;
+
+    if (pam_mysql_vcache.state == 0) {
+        pam_mysql_vcache.state = RAND_bytes(pam_mysql_vcache.secret,
+                sizeof(pam_mysql_vcache.secret)) == 1 ? 1: -1;
+        if (pam_mysql_vcache.state < 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to seed the verification cache; it is disabled.");
+        }
+    }
+
+    if (pam_mysql_vcache.state < 0 || passwd == NULL) {
+        return -1;
+    }
+
+    user_len = strlen(user);
+    passwd_len = strlen(passwd);
+
+    if (sizeof(key) + user_len + 1 + passwd_len > sizeof(data)) {
+        return -1;
+    }
+
+    key = pam_mysql_conn_fingerprint(ctx);
+    key = pam_mysql_hash_str(key, ctx->table);
+    key = pam_mysql_hash_str(key, ctx->usercolumn);
+    key = pam_mysql_hash_str(key, ctx->passwdcolumn);
+    key = pam_mysql_hash_str(key, ctx->where);
+    key = pam_mysql_hash_str(key, ctx->select);
+    key = pam_mysql_hash_str(key, crypt_type);
+    key = pam_mysql_hash_str(key, null_inhibited ? "1": "0");
+    key = pam_mysql_hash_str(key, user);
+    if (key == 0) {
+        key = 1; /* 0 marks a free slot */
+    }
+
+    memcpy(data, &key, sizeof(key));
+    memcpy(data + sizeof(key), user, user_len + 1);
+    memcpy(data + sizeof(key) + user_len + 1, passwd, passwd_len);
+
+    if (HMAC(EVP_sha256(), pam_mysql_vcache.secret, sizeof(pam_mysql_vcache.secret),
+                data, sizeof(key) + user_len + 1 + passwd_len, mac, NULL) != NULL) {
+        *pkey = key;
+        retval = 0;
+    }
+
+    memset(data, 0, sizeof(data));
+
+    return retval;
+}
+
+/**
+ * Look a verification result up in the cache.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param const char *passwd
+ *   A pointer to the unencrypted password string.
+ * @param int null_inhibited
+ *   Whether null authentication tokens should be disallowed.
+ * @param pam_mysql_err_t *presult
+ *   Receives the cached result of pam_mysql_check_passwd().
+ *
+ * @return int
+ *   0 on a hit, -1 on a miss.
+ */
+static int pam_mysql_vcache_get(pam_mysql_ctx_t *ctx, const char *user,
+        const char *passwd, int null_inhibited, pam_mysql_err_t *presult)
+{
+    pam_mysql_vcache_entry_t *entry;
+    unsigned long long key;
+    unsigned char mac[32];
+    int retval = -1;
+
+    if (!ctx->verify_cache) {
+        return -1;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pam_mysql_vcache.lock);
+#endif
+
+    if (pam_mysql_vcache_digest(ctx, user, passwd, null_inhibited, &key, mac) == 0) {
+        entry = &pam_mysql_vcache.entries[key % PAM_MYSQL_VCACHE_SIZE];
+
+        if (entry->key == key && entry->expires > time(NULL) &&
+                memcmp(entry->mac, mac, sizeof(mac)) == 0) {
+            *presult = entry->result;
+            retval = 0;
+        }
+    }
+
+    if (retval == 0) {
+        if (*presult == PAM_MYSQL_ERR_SUCCESS) {
+            pam_mysql_vcache.hits++;
+        } else {
+            pam_mysql_vcache.negative_hits++;
+        }
+    } else {
+        pam_mysql_vcache.misses++;
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "verification cache %s (hits=%lu, negative hits=%lu, misses=%lu)",
+                retval == 0 ? "hit": "miss", pam_mysql_vcache.hits,
+                pam_mysql_vcache.negative_hits, pam_mysql_vcache.misses);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pam_mysql_vcache.lock);
+#endif
+
+    memset(mac, 0, sizeof(mac));
+
+    return retval;
+}
+
+/**
+ * Store a verification result in the cache.
+ *
+ * Only definite answers are cached: a match for verify_cache_ttl seconds,
+ * a mismatch or an unknown user for verify_cache_negative_ttl seconds.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param const char *passwd
+ *   A pointer to the unencrypted password string.
+ * @param int null_inhibited
+ *   Whether null authentication tokens should be disallowed.
+ * @param pam_mysql_err_t result
+ *   The result of pam_mysql_check_passwd().
+ */
+static void pam_mysql_vcache_put(pam_mysql_ctx_t *ctx, const char *user,
+        const char *passwd, int null_inhibited, pam_mysql_err_t result)
+{
+    pam_mysql_vcache_entry_t *entry;
+    unsigned long long key;
+    unsigned char mac[32];
+    int ttl;
+
+    if (!ctx->verify_cache) {
+        return;
+    }
+
+    switch (result) {
+        case PAM_MYSQL_ERR_SUCCESS:
+            ttl = ctx->verify_cache_ttl;
+            break;
+
+        case PAM_MYSQL_ERR_MISMATCH:
+        case PAM_MYSQL_ERR_NO_ENTRY:
+            ttl = ctx->verify_cache_negative_ttl;
+            break;
+
+        default:
+            return;
+    }
+
+    if (ttl <= 0) {
+        return;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pam_mysql_vcache.lock);
+#endif
+
+    if (pam_mysql_vcache_digest(ctx, user, passwd, null_inhibited, &key, mac) == 0) {
+        entry = &pam_mysql_vcache.entries[key % PAM_MYSQL_VCACHE_SIZE];
+        entry->key = key;
+        memcpy(entry->mac, mac, sizeof(mac));
+        entry->result = result;
+        entry->expires = time(NULL) + ttl;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pam_mysql_vcache.lock);
+#endif
+
+    memset(mac, 0, sizeof(mac));
+}
+
+/**
+ * Drop the cached verification results of a user.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ */
+static void pam_mysql_vcache_forget(pam_mysql_ctx_t *ctx, const char *user)
+{
+    unsigned long long key;
+    unsigned char mac[32];
+    int null_inhibited;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pam_mysql_vcache.lock);
+#endif
+
+    for (null_inhibited = 0; null_inhibited <= 1; null_inhibited++) {
+        if (pam_mysql_vcache_digest(ctx, user, "", null_inhibited, &key, mac) == 0 &&
+                pam_mysql_vcache.entries[key % PAM_MYSQL_VCACHE_SIZE].key == key) {
+            memset(&pam_mysql_vcache.entries[key % PAM_MYSQL_VCACHE_SIZE], 0,
+                    sizeof(pam_mysql_vcache_entry_t));
+        }
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pam_mysql_vcache.lock);
+#endif
+}
+#else
+static int pam_mysql_vcache_get(pam_mysql_ctx_t *ctx, const char *user,
+        const char *passwd, int null_inhibited, pam_mysql_err_t *presult)
+{
+    return -1;
+}
+
+static void pam_mysql_vcache_put(pam_mysql_ctx_t *ctx, const char *user,
+        const char *passwd, int null_inhibited, pam_mysql_err_t result)
+{
+}
+
+static void pam_mysql_vcache_forget(pam_mysql_ctx_t *ctx, const char *user)
+{
+}
+#endif /* HAVE_OPENSSL */
+
+/**
+ * Select the password and status columns of a user.
+ *
+ * The built-in query runs as a prepared statement when prepared is set and
+ * the server takes it, and as a plain query otherwise; a custom select
+ * always runs as a plain query. The time taken is recorded for the host.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param MYSQL_RES **presult
+ *   Receives the result of a plain query, to be freed by the caller, or
+ *   NULL.
+ * @param MYSQL_ROW *prow
+ *   Receives the row: the password column, then the status column.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_NO_ENTRY, or another error.
+ */
+static pam_mysql_err_t pam_mysql_select_user(pam_mysql_ctx_t *ctx,
+        const char *user, MYSQL_RES **presult, MYSQL_ROW *prow)
+{
+    pam_mysql_err_t err;
+    pam_mysql_str_t query;
+    struct timeval started;
+
+    *presult = NULL;
+
+    if ((err = pam_mysql_str_init(&query, 1))) {
+        return err;
+    }
+
+    gettimeofday(&started, NULL);
+
+    if (ctx->prepared && ctx->select == NULL) {
+        err = pam_mysql_stmt_run(ctx, PAM_MYSQL_STMT_PASSWD,
+                (ctx->where == NULL ?
+                "SELECT %[passwdcolumn], %[statcolumn] FROM %[table] WHERE %[usercolumn] = ?":
+                "SELECT %[passwdcolumn], %[statcolumn] FROM %[table] WHERE %[usercolumn] = ? AND (%S)"),
+                &user, 1, prow);
+
+        if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            goto out;
+        }
+    }
+
+    err = ctx->select == NULL ?
+          pam_mysql_format_string(ctx, &query,
+            (ctx->where == NULL ?
+            "SELECT %[passwdcolumn], %[statcolumn] FROM %[table] WHERE %[usercolumn] = '%s'":
+            "SELECT %[passwdcolumn], %[statcolumn] FROM %[table] WHERE %[usercolumn] = '%s' AND (%S)"),
+            1, user, ctx->where) :
+          pam_mysql_format_string(ctx, &query, ctx->select, 1, user);
+
+    if (err) {
+        goto out;
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
+    }
+
+    if ((err = pam_mysql_query(ctx, &query))) {
+        goto out;
+    }
+
+    if ((err = pam_mysql_store_result(ctx, presult))) {
+        goto out;
+    }
+
+    switch (mysql_num_rows(*presult)) {
+        case 0:
+            syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned no result.");
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            goto out;
+
+        case 1:
+            break;
+
+        default:
+            syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned an indetermined result.");
+            err = PAM_MYSQL_ERR_UNKNOWN;
+            goto out;
+    }
+
+    if (NULL == (*prow = mysql_fetch_row(*presult))) {
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+out:
+    if (err == PAM_MYSQL_ERR_SUCCESS && ctx->conn_host != 0) {
+        pam_mysql_host_sample(pam_mysql_breaker(ctx, ctx->conn_host), &started);
+    }
+
+    pam_mysql_str_destroy(&query);
+
+    return err;
+}
+
+/* lookups started while the password is being asked for */
+
+#ifdef HAVE_PTHREAD_H
+/**
+ * Read the password and status columns of a user into a record.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param pam_mysql_user_rec_t *rec
+ *   The record to fill.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_NO_ENTRY, or another error.
+ */
+static pam_mysql_err_t pam_mysql_fetch_user(pam_mysql_ctx_t *ctx,
+        const char *user, pam_mysql_user_rec_t *rec)
+{
+    pam_mysql_err_t err;
+    MYSQL_RES *result = NULL;
+    MYSQL_ROW row = NULL;
+
+    if ((err = pam_mysql_select_user(ctx, user, &result, &row))) {
+        goto out;
+    }
+
+    if (pam_mysql_user_rec_fill(rec,
+                row[0], row[0] == NULL ? -1: (int)strlen(row[0]),
+                row[1], row[1] == NULL ? -1: (int)strlen(row[1]),
+                time(NULL))) {
+        err = PAM_MYSQL_ERR_NOTIMPL;
+    }
+
+out:
+    if (result != NULL) {
+        mysql_free_result(result);
+    }
+
+    return err;
+}
+
+/**
+ * Body of the prefetch thread.
+ *
+ * @param void *arg
+ *   A pointer to the context data structure.
+ *
+ * @return void *
+ *   NULL.
+ */
+static void *pam_mysql_prefetch_main(void *arg)
+{
+    pam_mysql_ctx_t *ctx = (pam_mysql_ctx_t *)arg;
+    pam_mysql_err_t err;
+
+    mysql_thread_init();
+
+    err = pam_mysql_open_db_for_user(ctx, ctx->prefetch_user);
+
+    /* nothing to fetch when the lookup will be answered locally */
+    if ((err == PAM_MYSQL_ERR_SUCCESS || err == PAM_MYSQL_ERR_BUSY) &&
+            ctx->mysql_hdl != NULL && ctx->daemon_fd < 0) {
+        ctx->prefetch_err = pam_mysql_fetch_user(ctx, ctx->prefetch_user,
+                ctx->prefetched);
+    }
+
+    mysql_thread_end();
+
+    return NULL;
+}
+#endif
+
+/**
+ * Start connecting and looking the user up while the password is asked for.
+ *
+ * The lookup runs in a thread of its own, which owns the connection of
+ * the context until pam_mysql_prefetch_join() is called. Nothing is
+ * started when prefetch is off, a connection is already open, a custom
+ * select is configured, or lookups go through daemon_socket.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ */
+static void pam_mysql_prefetch_start(pam_mysql_ctx_t *ctx, const char *user)
+{
+#ifdef HAVE_PTHREAD_H
+    int rc;
+
+    if (!ctx->prefetch || ctx->prefetch_running || ctx->mysql_hdl != NULL ||
+            ctx->daemon_socket != NULL || ctx->select != NULL ||
+            pam_mysql_reads_primary(ctx, user)) {
+        return;
+    }
+
+    if (ctx->prefetched == NULL &&
+            NULL == (ctx->prefetched = xcalloc(1, sizeof(*ctx->prefetched)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return;
+    }
+
+    xfree(ctx->prefetch_user);
+    if (NULL == (ctx->prefetch_user = xstrdup(user))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return;
+    }
+
+    /* the client library must be set up before a second thread uses it */
+    if (pam_mysql_library_init()) {
+        return;
+    }
+
+    ctx->prefetch_err = PAM_MYSQL_ERR_NOTIMPL;
+
+    if ((rc = pthread_create(&ctx->prefetch_thread, NULL,
+                    pam_mysql_prefetch_main, ctx)) != 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to start the prefetch thread (%s)", strerror(rc));
+        return;
+    }
+
+    ctx->prefetch_running = 1;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "prefetching %s.", user);
+    }
+#endif
+}
+
+/**
+ * Wait for the prefetch thread, if any, to finish.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_prefetch_join(pam_mysql_ctx_t *ctx)
+{
+#ifdef HAVE_PTHREAD_H
+    if (ctx->prefetch_running) {
+        pthread_join(ctx->prefetch_thread, NULL);
+        ctx->prefetch_running = 0;
+    }
+#endif
+}
+
+/**
+ * Drop the prefetched record.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_prefetch_clear(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_prefetch_join(ctx);
+
+    xfree(ctx->prefetch_user);
+    ctx->prefetch_user = NULL;
+
+    if (ctx->prefetched != NULL) {
+        memset(ctx->prefetched, 0, sizeof(*ctx->prefetched));
+        xfree(ctx->prefetched);
+        ctx->prefetched = NULL;
+    }
+
+    ctx->prefetch_err = PAM_MYSQL_ERR_NOTIMPL;
+}
+
+/**
+ * Take the record prefetched for a user.
+ *
+ * The record is handed out once.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the user name string.
+ * @param pam_mysql_user_rec_t *rec
+ *   Receives the record.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_SUCCESS, PAM_MYSQL_ERR_NO_ENTRY, or PAM_MYSQL_ERR_NOTIMPL
+ *   if nothing was prefetched for the user.
+ */
+static pam_mysql_err_t pam_mysql_prefetch_take(pam_mysql_ctx_t *ctx,
+        const char *user, pam_mysql_user_rec_t *rec)
+{
+    pam_mysql_err_t err;
+
+    pam_mysql_prefetch_join(ctx);
+
+    if (ctx->prefetch_user == NULL || user == NULL ||
+            strcmp(ctx->prefetch_user, user) != 0 ||
+            pam_mysql_reads_primary(ctx, user)) {
+        return PAM_MYSQL_ERR_NOTIMPL;
+    }
+
+    err = ctx->prefetch_err;
+    ctx->prefetch_err = PAM_MYSQL_ERR_NOTIMPL;
+
+    switch (err) {
+        case PAM_MYSQL_ERR_SUCCESS:
+            *rec = *ctx->prefetched;
+            rec->row[0] = rec->row[0] == NULL ? NULL:
+                rec->data + (ctx->prefetched->row[0] - ctx->prefetched->data);
+            rec->row[1] = rec->row[1] == NULL ? NULL:
+                rec->data + (ctx->prefetched->row[1] - ctx->prefetched->data);
+            memset(ctx->prefetched, 0, sizeof(*ctx->prefetched));
+            return err;
+
+        case PAM_MYSQL_ERR_NO_ENTRY:
+            return err;
+
+        default:
+            return PAM_MYSQL_ERR_NOTIMPL;
+    }
+}
+
+/**
+ * Check a password.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @ param const char *user
+ *   A pointer to the user name string.
+ * @param const char *password
+ *   A pointer to the unencrypted password string.
+ * @param int null_inhibited
+ *   Whether null authentication tokens should be disallowed.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_check_passwd(pam_mysql_ctx_t *ctx,
+        const char *user, const char *passwd, int null_inhibited)
+{
+    pam_mysql_err_t err;
+    MYSQL_RES *result = NULL;
+    MYSQL_ROW row = NULL;
+    pam_mysql_user_rec_t cached;
+    int from_cache = 0;
+    int vresult;
+    int primary;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_check_passwd() called.");
+    }
+
+    primary = pam_mysql_reads_primary(ctx, user);
+    pam_mysql_use_writer(ctx, primary);
+
+    switch (primary ? PAM_MYSQL_ERR_NOTIMPL: pam_mysql_local_record(ctx, user, &cached)) {
+        case PAM_MYSQL_ERR_SUCCESS:
+            row = cached.row;
+            from_cache = 1;
+            goto verify;
+
+        case PAM_MYSQL_ERR_NO_ENTRY:
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            goto out;
+
+        default:
+            break;
+    }
+
+    switch (pam_mysql_prefetch_take(ctx, user, &cached)) {
+        case PAM_MYSQL_ERR_SUCCESS:
+            row = cached.row;
+            goto verify;
+
+        case PAM_MYSQL_ERR_NO_ENTRY:
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            goto out;
+
+        default:
+            break;
+    }
+
+    if ((err = pam_mysql_need_db(ctx))) {
+        if (pam_mysql_stale_record(ctx, err, user, &cached) == 0) {
+            row = cached.row;
+            from_cache = 1;
+            goto verify;
+        }
+        goto out;
+    }
+
+    if (ctx->daemon_fd >= 0) {
+        const char *params[3];
+        pam_mysql_msg_t resp;
+        int stat;
+
+        params[0] = user;
+        params[1] = passwd;
+        params[2] = null_inhibited ? "1": "0";
+
+        err = pam_mysql_daemon_call(ctx, PAM_MYSQL_OP_CHECK, params, 3, &resp);
+        if (err == PAM_MYSQL_ERR_SUCCESS &&
+                pam_mysql_msg_int(&resp, 0, &stat) == PAM_MYSQL_ERR_SUCCESS) {
+            pam_mysql_stat_cache_put(ctx, user, stat);
+        }
+        pam_mysql_msg_destroy(&resp);
+
+        if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            goto out;
+        }
+    }
+
+    /* To avoid putting a plain password in the MySQL log file and on
+     * the wire more than needed we will request the encrypted password
+     * from MySQL. We will check encrypt the passed password against the
+     * one returned from MySQL. The status column comes along for
+     * pam_sm_acct_mgmt().
+     */
+    if ((err = pam_mysql_select_user(ctx, user, &result, &row))) {
+        goto out;
+    }
+
+verify:
+        if (ctx->select == NULL) {
+            pam_mysql_stat_cache_put(ctx, user, pam_mysql_user_stat_of(row[1], row[0]));
+            if (!from_cache) {
+                pam_mysql_shm_store(ctx, user, 0, row[0], row[1]);
+            }
+        }
+
+        vresult = -1;
+
+        if (row[0] != NULL) {
+            if (passwd != NULL) {
+                char *crypted_password = NULL;
+                switch (ctx->crypt_type) {
+                    /* PLAIN */
+                    case 0:
+                        vresult = strcmp(row[0], passwd);
+                        break;
+
+                        /* ENCRYPT */
+                    case 1:
+                        crypted_password = crypt(passwd, row[0]);
+                        if (crypted_password == NULL) {
+                            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "something went wrong when invoking crypt() - %s", strerror(errno));
+                            vresult = 1; // fail
+                        } else {
+                            vresult = strcmp(row[0], crypted_password);
+                        }
+                        break;
+
+                        /* PASSWORD */
+                    case 2: {
+                                char buf[42];
+#ifdef HAVE_MAKE_SCRAMBLED_PASSWORD_323
+                                if (ctx->use_323_passwd) {
+                                    syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and enabled in pam_mysql_check_passwd");
+                                    make_scrambled_password_323(buf, passwd);
+                                } else {
+                                    syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and not enabled in pam_mysql_check_passwd");
+                                    make_scrambled_password(buf, passwd);
+                                }
+#else
+                                if (ctx->use_323_passwd) {
+                                    syslog(LOG_WARNING, PAM_MYSQL_LOG_PREFIX "Workaround applied. use_323_passwd not defined but use attempted in pam_mysql_check_passwd");
+                                    compat_make_scrambled_password_323(buf, passwd);
+                                } else {
+                                    syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd not defined and use not attempted in pam_mysql_check_passwd");
+                                    make_scrambled_password(buf, passwd);
+                                }
+#endif
+
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+                            } break;
+
+                            /* MD5 hash (not MD5 crypt()) */
+                    case 3: {
+#ifdef HAVE_PAM_MYSQL_MD5_DATA
+                                char buf[33];
+                                pam_mysql_md5_data((unsigned char*)passwd, strlen(passwd),
+                                        buf);
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
+#endif
+                            } break;
+
+                    case 4: {
+#ifdef HAVE_PAM_MYSQL_SHA1_DATA
+                                char buf[41];
+                                pam_mysql_sha1_data((unsigned char*)passwd, strlen(passwd),
+                                        buf);
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA1 hash is not supported in this build.");
+#endif
+                            } break;
+
+                    case 5: {
+#if defined(HAVE_PAM_MYSQL_MD5_DATA) && defined(HAVE_PAM_MYSQL_SHA1_DATA)
+                                char buf[128];
+                                memset(buf, 0, 128);
+                                pam_mysql_drupal7_data((unsigned char*)passwd, strlen(passwd),
+                                        buf, row[0]);
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash or SHA support lacking in this build.");
+#endif
+                            } break;
+
+                    case 6:
+                            {
+                                /* Joomla 1.5 like password */
+#ifdef HAVE_PAM_MYSQL_MD5_DATA
+                                char buf[33];
+                                buf[32]=0;
+
+                                char *salt = row[0];
+                                char *hash = strsep(&salt,":");
+
+                                if (!salt) {
+                                    syslog(LOG_AUTHPRIV | LOG_WARNING, PAM_MYSQL_LOG_PREFIX "unknown hash format");
+                                    err = PAM_MYSQL_ERR_MISMATCH;
+                                    goto out;
+                                }
+                                int len = strlen(passwd)+strlen(salt);
+
+                                char *tmp;
+
+                                if (NULL == (tmp = xcalloc(len+1, sizeof(char)))) {
+                                    syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                                    err = PAM_MYSQL_ERR_ALLOC;
+                                    goto out;
+                                }
+
+                                strcat(tmp,passwd);
+                                strcat(tmp,salt);
+
+                                pam_mysql_md5_data((unsigned char*)tmp, len, buf);
+
+                                vresult = strcmp(hash, buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+
+                                xfree(tmp);
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
+#endif
+                            } break;
+
+                    case 7:
+                            {
+                                /* Salted SHA */
+#ifdef HAVE_PAM_MYSQL_SHA1_DATA
+                                unsigned char* hash;
+                                size_t sha1_size;
+                                Base64Decode(row[0], &hash, &sha1_size);
+                                size_t salt_length = sha1_size - 20;
+                                unsigned char salt[salt_length];
+                                memcpy(salt, &(hash[20]), salt_length);
+
+                                char buf[41];
+                                pam_mysql_ssha_data((unsigned char*)passwd, strlen(passwd), salt, salt_length,
+                                    buf);
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SSHA hash is not supported in this build.");
+#endif
+                            } break;
+
+                    case 8:
+                            {
+#ifdef HAVE_PAM_MYSQL_SHA512_DATA
+                                char buf[128];
+                                pam_mysql_sha512_data((unsigned char*)passwd, strlen(passwd), buf);
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA512 hash is not supported in this build.");
+#endif
+                            }
+                            break;
+
+                    case 9:
+                            {
+#ifdef HAVE_PAM_MYSQL_SHA256_DATA
+                                char buf[64];
+                                pam_mysql_sha256_data((unsigned char*)passwd, strlen(passwd), buf);
+                                vresult = strcmp(row[0], buf);
+                                {
+                                    char *p = buf - 1;
+                                    while (*(++p)) *p = '\0';
+                                }
+#else
+                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA256 hash is not supported in this build.");
+#endif
+                            }
+                            break;
+
+                    default: {
+                             }
+                }
+            }
+        } else {
+            vresult = null_inhibited;
+        }
+
+        if (vresult == 0) {
+            err = PAM_MYSQL_ERR_SUCCESS;
+        } else {
+            err = PAM_MYSQL_ERR_MISMATCH;
+        }
+
+out:
+        if (err == PAM_MYSQL_ERR_DB && ctx->mysql_hdl != NULL) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error(%s)", mysql_error(ctx->mysql_hdl));
+        }
+
+        if (result != NULL) {
+            mysql_free_result(result);
+        }
+
+        if (from_cache) {
+            memset(&cached, 0, sizeof(cached));
+        }
+
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_check_passwd() returning %i.", err);
+        }
+
+        return err;
+    }
+
+/**
+ * Create a random salt for use with CRYPT() when changing passwords.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param char *salt
+ *   A pointer to the string to be filled.
+ * @param const char *salter
+ *   A pointer to the string used to generate the salt. (NB: Pointless if
+ *   HAVE_GETTIMEOFDAY is defined).
+ */
+static void pam_mysql_saltify(pam_mysql_ctx_t *ctx, char *salt, const char *salter)
+{
+    unsigned int i = 0;
+    char *q;
+    unsigned int seed = 0;
+    static const char saltstr[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789./";
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "saltify called.");
+    }
+
+    if (salter != NULL) {
+        const char *p;
+        for (p = salter; *p != '\0'; p++) {
+            seed += salter[i];
+        }
+    }
+
+#ifdef HAVE_GETTIMEOFDAY
+    {
+        struct timeval *tv;
+        if (gettimeofday(&tv, NULL)) {
+            tv.tv_usec = 0;
+        }
+        seed = (unsigned int)((tv.tv_usec + j) % 65535);
+    }
+#endif
+
+    if ((ctx->blowfish + ctx->sha512 + ctx->sha256 + ctx->md5) > 1) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, "Only one of blowfish, sha512, sha256 or md5 should be specified. Falling back to the strongest of selected values.");
+    }
+
+    q = salt;
+
+#ifdef HAVE_BLOWFISH
+    if (ctx->blowfish) {
+        strcpy(salt, "$2a$");
+        q += sizeof("$2a$") - 1;
+        if (ctx->rounds < 4 || ctx->rounds > 31) {
+            strcpy(q, "05$");
+            q += sizeof("05$") - 1;
+        } else {
+            int a;
+            a = snprintf(q, 5, "%02d$", ctx->rounds);
+            if (a == 3) {
+                q += a;
+            }
+        }
+        i = 22;
+    } else if ((ctx->sha256) || (ctx->sha512)) {
+#else
+        if (ctx->blowfish) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, "Blowfish is unavailable in this version in glibc.");
+        }
+        if ((ctx->sha256) || (ctx->sha512)) {
+#endif
+            if (ctx->sha512) {
+                strcpy(salt, "$6$");
+                q += sizeof("$6$") - 1;
+            } else {
+                strcpy(salt, "$5$");
+                q += sizeof("$5$") - 1;
+            }
+            if ((ctx->rounds >= 1000) && (ctx->rounds < INT_MAX)) {
+                if (ctx->rounds >= 10000000) {
+                    strcpy(q, "rounds=9999999$");
+                    q += sizeof("rounds=9999999$") - 1;
+                } else {
+                    int a;
+                    a = snprintf(q, 17, "rounds=%d$", ctx->rounds);
+                    if (a < 16) {
+                        q += a;
+                    }
+                }
+            }
+            i = 16;
+        } else if (ctx->md5) {
+            strcpy(salt, "$1$");
+            q += sizeof("$1$") - 1;
+            i = 8;
+        } else {
+            i = 2;
+        }
+
+        while (i-- > 0) {
+            *(q++) = saltstr[seed % 64];
+            seed = (((seed ^ 0x967e3c5a) << 3) ^ (~(seed >> 2) + i));
+        }
+
+	if ((ctx->md5)||(ctx->sha256)||(ctx->sha512)||(ctx->blowfish)) {
+            *(q++) = '$';
+        }
+        *q = '\0';
+
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_saltify() returning salt = %s.", salt);
+        }
+    }
+
+/**
+ * Update the password in MySQL.
+ *
+ * To reduce the number of calls to the DB, I'm now assuming that the old
+ * password has been verified elsewhere, so I only check for null/not null
+ * and is_root.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *user
+ *   A pointer to the string containing the username.
+ * @param const char *new_passwd
+ *   A pointer to the string containing the new password.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_update_passwd(pam_mysql_ctx_t *ctx, const char *user, const char *new_passwd)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_str_t query;
+    char *encrypted_passwd = NULL;
+    const char *params[2];
+
+    if ((err = pam_mysql_str_init(&query, 1))) {
+        return err;
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_update_passwd() called.");
+    }
+
+    /* the status depends on the password being NULL */
+    xfree(ctx->stat_user);
+    ctx->stat_user = NULL;
+
+    if (user == NULL) {
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "user is NULL.");
+        }
+
+        syslog(LOG_NOTICE, PAM_MYSQL_LOG_PREFIX "unable to change password");
+        return PAM_MYSQL_ERR_INVAL;
+    }
+
+    if (ctx->daemon_fd >= 0) {
+        pam_mysql_msg_t resp;
+
+        params[0] = user;
+        params[1] = new_passwd;
+
+        err = pam_mysql_daemon_call(ctx, PAM_MYSQL_OP_UPDATE, params, 2, &resp);
+        pam_mysql_msg_destroy(&resp);
+
+        if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            if (err == PAM_MYSQL_ERR_SUCCESS) {
+                pam_mysql_vcache_forget(ctx, user);
+                pam_mysql_shm_store(ctx, user, 1, NULL, NULL);
+            }
+            return err;
+        }
+    }
+
+    pam_mysql_use_writer(ctx, 1);
+
+    if ((err = pam_mysql_need_db(ctx))) {
+        goto out;
+    }
+
+    if (new_passwd != NULL) {
+        switch (ctx->crypt_type) {
+            case 0:
+                if (NULL == (encrypted_passwd = xstrdup(new_passwd))) {
+                    syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                    err = PAM_MYSQL_ERR_ALLOC;
+                    goto out;
+                }
+                break;
+
+            case 1: {
+			char salt[64];
+                        pam_mysql_saltify(ctx, salt, new_passwd);
+                        if (NULL == (encrypted_passwd = xstrdup(crypt(new_passwd, salt)))) {
+                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                            err = PAM_MYSQL_ERR_ALLOC;
+                            goto out;
+                        }
+                    } break;
+
+            case 2:
+                    if (NULL == (encrypted_passwd = xcalloc(41 + 1, sizeof(char)))) {
+                        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                        err = PAM_MYSQL_ERR_ALLOC;
+                        goto out;
+                    }
+#ifdef HAVE_MAKE_SCRAMBLED_PASSWORD_323
+                    if (ctx->use_323_passwd) {
+                        syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and enabled in pam_mysql_update_passwd");
+                        make_scrambled_password_323(encrypted_passwd, new_passwd);
+                    } else {
+                        syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and not enabled in pam_mysql_update_passwd");
+                        make_scrambled_password(encrypted_passwd, new_passwd);
+                    }
+#else
+                    if (ctx->use_323_passwd) {
+                        syslog(LOG_WARNING, PAM_MYSQL_LOG_PREFIX "Workaround applied. use_323_passwd not defined but use attempted in pam_mysql_update_passwd");
+                        compat_make_scrambled_password_323(encrypted_passwd, new_passwd);
+                    } else {
+                        syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd not defined and use not attempted in pam_mysql_update_passwd");
+                        make_scrambled_password(encrypted_passwd, new_passwd);
+                    }
+#endif
+                    break;
+
+            case 3:
+#ifdef HAVE_PAM_MYSQL_MD5_DATA
+                    if (NULL == (encrypted_passwd = xcalloc(32 + 1, sizeof(char)))) {
+                        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                        err = PAM_MYSQL_ERR_ALLOC;
+                        goto out;
+                    }
+                    pam_mysql_md5_data((unsigned char*)new_passwd,
+                            strlen(new_passwd), encrypted_passwd);
+#else
+                    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
+                    err = PAM_MYSQL_ERR_NOTIMPL;
+                    goto out;
+#endif
+                    break;
+
+            case 4:
+#ifdef HAVE_PAM_MYSQL_SHA1_DATA
+                    if (NULL == (encrypted_passwd = xcalloc(40 + 1, sizeof(char)))) {
+                        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                        err = PAM_MYSQL_ERR_ALLOC;
+                        goto out;
+                    }
+                    pam_mysql_sha1_data((unsigned char*)new_passwd,
+                            strlen(new_passwd), encrypted_passwd);
+#else
+                    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA1 hash is not supported in this build.");
+                    err = PAM_MYSQL_ERR_NOTIMPL;
+                    goto out;
+#endif
+                    break;
+
+            case 6:
+                    {
+#ifdef HAVE_PAM_MYSQL_MD5_DATA
+                        if (NULL == (encrypted_passwd = xcalloc(32 + 1+ 32 +1, sizeof(char)))) {
+                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                            err = PAM_MYSQL_ERR_ALLOC;
+                            goto out;
+                        }
+
+                        int len=strlen(new_passwd)+32;
+
+                        char *tmp;
+
+                        if (NULL == (tmp = xcalloc(len+1, sizeof(char)))) {
+                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                            err = PAM_MYSQL_ERR_ALLOC;
+                            goto out;
+                        }
+
+                        char salt[33];
+                        salt[32]=0;
+
+                        srandom(time(NULL));
+
+                        int i;
+                        for(i=0;i<32; i++)
+                            salt[i]=(char)((random()/(double)RAND_MAX * 93.0) +33.0);
+
+                        strcat(tmp,new_passwd);
+                        strcat(tmp,salt);
+
+                        pam_mysql_md5_data((unsigned char*)tmp, len, encrypted_passwd);
+
+                        xfree(tmp);
+
+                        strcat(encrypted_passwd,":");
+                        strcat(encrypted_passwd,salt);
+
+#else
+                        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
+                        err = PAM_MYSQL_ERR_NOTIMPL;
+                        goto out;
+#endif
+                        break;
+                    }
+            case 8:
+                    {
+#ifdef HAVE_PAM_MYSQL_SHA512_DATA
+                        if (NULL == (encrypted_passwd = xcalloc(128 + 1, sizeof(char)))) {
+                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                            err = PAM_MYSQL_ERR_ALLOC;
+                            goto out;
+                        }
+                        pam_mysql_sha512_data((unsigned char*)new_passwd, strlen(new_passwd), encrypted_passwd);
+#else
+                        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA512 hash is not supported in this build.");
+                        err = PAM_MYSQL_ERR_NOTIMPL;
+                        goto out;
+#endif
+                        break;
+                    }
+            case 9:
+                    {
+#ifdef HAVE_PAM_MYSQL_SHA256_DATA
+                        if (NULL == (encrypted_passwd = xcalloc(64 + 1, sizeof(char)))) {
+                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+                            err = PAM_MYSQL_ERR_ALLOC;
+                            goto out;
+                        }
+                        pam_mysql_sha256_data((unsigned char*)new_passwd, strlen(new_passwd), encrypted_passwd);
+#else
+                        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA256 hash is not supported in this build.");
+                        err = PAM_MYSQL_ERR_NOTIMPL;
+                        goto out;
+#endif
+                        break;
+                    }
+            default:
+                    encrypted_passwd = NULL;
+                    break;
+        }
+    }
+
+    if (ctx->prepared) {
+        params[0] = (encrypted_passwd == NULL ? "": encrypted_passwd);
+        params[1] = user;
+
+        err = pam_mysql_stmt_run(ctx, PAM_MYSQL_STMT_UPDATE,
+                (ctx->where == NULL ?
+                 "UPDATE %[table] SET %[passwdcolumn] = ? WHERE %[usercolumn] = ?":
+                 "UPDATE %[table] SET %[passwdcolumn] = ? WHERE %[usercolumn] = ? AND (%S)"),
+                params, 2, NULL);
+
+        if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            goto out;
+        }
+    }
+
+    err = pam_mysql_format_string(ctx, &query,
+            (ctx->where == NULL ?
+             "UPDATE %[table] SET %[passwdcolumn] = '%s' WHERE %[usercolumn] = '%s'":
+             "UPDATE %[table] SET %[passwdcolumn] = '%s' WHERE %[usercolumn] = '%s' AND (%S)"),
+            1, (encrypted_passwd == NULL ? "": encrypted_passwd), user, ctx->where);
+    if (err) {
+        goto out;
+    }
+
+    if ((err = pam_mysql_query(ctx, &query))) {
+        goto out;
+    }
+
+out:
+        if (err == PAM_MYSQL_ERR_DB && ctx->mysql_hdl != NULL) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_error(ctx->mysql_hdl));
+        }
+
+        if (err == PAM_MYSQL_ERR_SUCCESS) {
+            pam_mysql_vcache_forget(ctx, user);
+            pam_mysql_shm_store(ctx, user, 1, NULL, NULL);
+
+            if (ctx->read_your_writes && pam_mysql_split_roles(ctx) &&
+                    !pam_mysql_reads_primary(ctx, user)) {
+                xfree(ctx->primary_user);
+                ctx->primary_user = xstrdup(user);
+            }
+        }
+
+        if (encrypted_passwd != NULL) {
+            char *p;
+            for (p = encrypted_passwd; *p != '\0'; p++) {
+                *p = '\0';
+            }
+            xfree(encrypted_passwd);
+        }
+
+        pam_mysql_str_destroy(&query);
+
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_update_passwd() returning %i.", err);
+        }
+
+        return err;
+    }
+
+/**
+ * Detemine whether a username is known.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param int pretval
+ *   A pointer to the result.
+ * @param const char *user
+ *   A pointer to the username string to be checked.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_query_user_stat(pam_mysql_ctx_t *ctx,
+        int *pretval, const char *user)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_str_t query;
+    MYSQL_RES *result = NULL;
+    MYSQL_ROW row;
+    pam_mysql_user_rec_t cached;
+    int primary;
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_query_user_stat() called.");
+    }
+
+    if (pam_mysql_stat_cache_get(ctx, user, pretval) == 0) {
+        if (ctx->verbose) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "using the status fetched along with the password.");
+        }
+        return PAM_MYSQL_ERR_SUCCESS;
+    }
+
+    primary = pam_mysql_reads_primary(ctx, user);
+    pam_mysql_use_writer(ctx, primary);
+
+    switch ((err = primary ? PAM_MYSQL_ERR_NOTIMPL: pam_mysql_local_record(ctx, user, &cached))) {
+        case PAM_MYSQL_ERR_SUCCESS:
+            *pretval = pam_mysql_user_stat_of(cached.row[1], cached.row[0]);
+            memset(&cached, 0, sizeof(cached));
+            return err;
+
+        case PAM_MYSQL_ERR_NO_ENTRY:
+            return err;
+
+        default:
+            break;
+    }
+
+    if ((err = pam_mysql_need_db(ctx))) {
+        if (pam_mysql_stale_record(ctx, err, user, &cached) == 0) {
+            *pretval = pam_mysql_user_stat_of(cached.row[1], cached.row[0]);
+            memset(&cached, 0, sizeof(cached));
+            return PAM_MYSQL_ERR_SUCCESS;
+        }
+        return err;
+    }
+
+    if (ctx->daemon_fd >= 0) {
+        pam_mysql_msg_t resp;
+
+        err = pam_mysql_daemon_call(ctx, PAM_MYSQL_OP_STAT, &user, 1, &resp);
+        if (err == PAM_MYSQL_ERR_SUCCESS) {
+            err = pam_mysql_msg_int(&resp, 0, pretval);
+        }
+        pam_mysql_msg_destroy(&resp);
+
+        if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            return err;
+        }
+    }
+
+    if ((err = pam_mysql_str_init(&query, 0))) {
+        return err;
+    }
+
+    if (ctx->prepared) {
+        err = pam_mysql_stmt_run(ctx, PAM_MYSQL_STMT_STAT,
+                (ctx->where == NULL ?
+                 "SELECT %[statcolumn], %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = ?":
+                 "SELECT %[statcolumn], %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = ? AND (%S)"),
+                &user, 1, &row);
+
+        if (err == PAM_MYSQL_ERR_SUCCESS) {
+            goto stat;
+        } else if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            goto out;
+        }
+    }
+
+    err = pam_mysql_format_string(ctx, &query,
+            (ctx->where == NULL ?
+             "SELECT %[statcolumn], %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = '%s'":
+             "SELECT %[statcolumn], %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = '%s' AND (%S)"),
+            1, user, ctx->where);
+
+    if (err) {
+        goto out;
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
+    }
+
+    if ((err = pam_mysql_query(ctx, &query))) {
+        goto out;
+    }
+
+    if ((err = pam_mysql_store_result(ctx, &result))) {
+        goto out;
+    }
+
+    switch (mysql_num_rows(result)) {
+        case 0:
+            syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned no result.");
+            err = PAM_MYSQL_ERR_NO_ENTRY;
+            goto out;
+
+        case 1:
+            break;
+
+        case 2:
+            syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned an indetermined result.");
+            err = PAM_MYSQL_ERR_UNKNOWN;
+            goto out;
+    }
+
+    if (NULL == (row = mysql_fetch_row(result))) {
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+stat:
+    *pretval = pam_mysql_user_stat_of(row[0], row[1]);
+    pam_mysql_shm_store(ctx, user, 0, row[1], row[0]);
+
+out:
+    if (err == PAM_MYSQL_ERR_DB && ctx->mysql_hdl != NULL) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_error(ctx->mysql_hdl));
+    }
+
+    if (result != NULL) {
+        mysql_free_result(result);
+        if (ctx->select) {
+            while (mysql_next_result(ctx->mysql_hdl) == 0) {
+                result = mysql_store_result(ctx->mysql_hdl);
+                if (result)
+                    mysql_free_result(result);
+            }
+        }
+    }
+
+    pam_mysql_str_destroy(&query);
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_query_user_stat() returning %i.", err);
+    }
+
+    return err;
+}
+
+/* sqllog entries */
+
+typedef struct _pam_mysql_log_event_t {
+    char msg[PAM_MYSQL_LOG_MSG_MAX];
+    char user[PAM_MYSQL_LOG_FIELD_MAX];
+    char rhost[PAM_MYSQL_LOG_FIELD_MAX];
+    unsigned int pid;
+    time_t stamp; /* 0 for the time of the server */
+} pam_mysql_log_event_t;
+
+/**
+ * Append the beginning of the INSERT that writes log entries to logtable
+ * to a query, up to VALUES.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_str_t *query
+ *   The query.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_log_format_head(pam_mysql_ctx_t *ctx,
+        pam_mysql_str_t *query)
+{
+    if (ctx->logrhostcolumn) {
+        return pam_mysql_format_string(ctx, query,
+                "INSERT INTO %[logtable] (%[logmsgcolumn], %[logusercolumn], %[loghostcolumn], %[logrhostcolumn], %[logpidcolumn], %[logtimecolumn]) VALUES ", 1);
+    }
+
+    return pam_mysql_format_string(ctx, query,
+            "INSERT INTO %[logtable] (%[logmsgcolumn], %[logusercolumn], %[loghostcolumn], %[logpidcolumn], %[logtimecolumn]) VALUES ", 1);
+}
+
+/**
+ * Append the row of a log entry to the INSERT of
+ * pam_mysql_log_format_head().
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_str_t *query
+ *   The query.
+ * @param const char *msg
+ *   The message.
+ * @param const char *user
+ *   The user name.
+ * @param const char *host
+ *   The host the connection goes to.
+ * @param const char *rhost
+ *   The remote host.
+ * @param unsigned int pid
+ *   The process id.
+ * @param time_t stamp
+ *   The time of the entry, or 0 for the time of the server.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_log_format_row(pam_mysql_ctx_t *ctx,
+        pam_mysql_str_t *query, const char *msg, const char *user,
+        const char *host, const char *rhost, unsigned int pid, time_t stamp)
+{
+    if (ctx->logrhostcolumn) {
+        return pam_mysql_format_string(ctx, query, stamp ?
+                "('%s', '%s', '%s', '%s', '%u', FROM_UNIXTIME(%u))":
+                "('%s', '%s', '%s', '%s', '%u', NOW())", 1,
+                msg, user, host, rhost, pid, (unsigned int)stamp);
+    }
+
+    return pam_mysql_format_string(ctx, query, stamp ?
+            "('%s', '%s', '%s', '%u', FROM_UNIXTIME(%u))":
+            "('%s', '%s', '%s', '%u', NOW())", 1,
+            msg, user, host, pid, (unsigned int)stamp);
+}
+
+/**
+ * Append the INSERT that writes log entries to logtable to a query.
+ *
+ * The connection must be open.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_str_t *query
+ *   The query.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entries.
+ * @param size_t n
+ *   The number of entries.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_log_format(pam_mysql_ctx_t *ctx,
+        pam_mysql_str_t *query, const pam_mysql_log_event_t *ev, size_t n)
+{
+    pam_mysql_err_t err;
+    const char *host;
+    size_t i;
+
+    if (pam_mysql_get_host_info(ctx, &host)) {
+        host = "(unknown)";
+    }
+
+    err = pam_mysql_log_format_head(ctx, query);
+
+    for (i = 0; i < n && !err; i++) {
+        if (i > 0 && (err = pam_mysql_str_append_char(query, ','))) {
+            break;
+        }
+
+        err = pam_mysql_log_format_row(ctx, query, ev[i].msg, ev[i].user,
+                host, ev[i].rhost, ev[i].pid, ev[i].stamp);
+    }
+
+    return err;
+}
+
+/**
+ * Write log entries to logtable with a single INSERT.
+ *
+ * The connection must be open.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entries.
+ * @param size_t n
+ *   The number of entries.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_log_insert(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev, size_t n)
+{
+    pam_mysql_err_t err;
+    pam_mysql_str_t query;
+
+    if ((err = pam_mysql_str_init(&query, 1))) {
+        return err;
+    }
+
+    if ((err = pam_mysql_log_format(ctx, &query, ev, n))) {
+        goto out;
+    }
+
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
+    }
+
+    err = pam_mysql_query(ctx, &query);
+
+out:
+    pam_mysql_str_destroy(&query);
+
+    return err;
+}
+
+/* sqllog spool file */
+
+/*
+ * The spool is a file of fixed-size records, each appended with a single
+ * write() so that processes can share it without locking. To replay it,
+ * it is first linked to the name with PAM_MYSQL_SPOOL_SUFFIX and unlinked,
+ * so that new entries go to a new file; the records are read once the
+ * file has not changed for PAM_MYSQL_SPOOL_SETTLE seconds, since a
+ * process may still have had the old one open. Records are marked with
+ * PAM_MYSQL_SPOOL_DONE in the file once written to the database, so that
+ * a replay cut short by the exit of the process is resumed from there.
+ */
+typedef struct _pam_mysql_spool_rec_t {
+    unsigned int magic;
+    unsigned int reserved;
+    unsigned long long sum; /* of ev */
+    pam_mysql_log_event_t ev;
+} pam_mysql_spool_rec_t;
+
+/**
+ * Append log entries to the spool file.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entries.
+ * @param size_t n
+ *   The number of entries.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_spool_append(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev, size_t n)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_spool_rec_t rec;
+    size_t i;
+    int fd;
+
+    if ((fd = open(ctx->logspool, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW, 0600)) < 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to open %s (%s)", ctx->logspool, strerror(errno));
+        return PAM_MYSQL_ERR_IO;
+    }
+
+    for (i = 0; i < n; i++) {
+        memset(&rec, 0, sizeof(rec));
+        rec.magic = PAM_MYSQL_SPOOL_MAGIC;
+        rec.ev = ev[i];
+        rec.sum = pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT,
+                (const char *)&rec.ev, sizeof(rec.ev));
+
+        if (write(fd, &rec, sizeof(rec)) != (ssize_t)sizeof(rec)) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to write to %s (%s)", ctx->logspool, strerror(errno));
+            err = PAM_MYSQL_ERR_IO;
+            break;
+        }
+    }
+
+    /* the entries are only kept here; a failure is not worth writing them twice */
+    if (err == PAM_MYSQL_ERR_SUCCESS && fsync(fd)) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to sync %s (%s)", ctx->logspool, strerror(errno));
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    close(fd);
+
+    return err;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* how far the replay of the file went, to skip the records marked done */
+static struct {
+    dev_t dev;
+    ino_t ino;
+    off_t off;
+} pam_mysql_spool;
+
+/**
+ * Take the entry out of a record of the spool file.
+ *
+ * @param const pam_mysql_spool_rec_t *rec
+ *   The record.
+ * @param pam_mysql_log_event_t *ev
+ *   Receives the entry.
+ *
+ * @return int
+ *   0 on success, 1 if the record was replayed already, -1 if it is
+ *   damaged.
+ */
+static int pam_mysql_spool_parse(const pam_mysql_spool_rec_t *rec,
+        pam_mysql_log_event_t *ev)
+{
+    if (rec->magic == PAM_MYSQL_SPOOL_DONE) {
+        return 1;
+    }
+
+    if (rec->magic != PAM_MYSQL_SPOOL_MAGIC ||
+            rec->sum != pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT,
+                (const char *)&rec->ev, sizeof(rec->ev))) {
+        return -1;
+    }
+
+    *ev = rec->ev;
+    ev->msg[sizeof(ev->msg) - 1] = '\0';
+    ev->user[sizeof(ev->user) - 1] = '\0';
+    ev->rhost[sizeof(ev->rhost) - 1] = '\0';
+
+    return 0;
+}
+
+/**
+ * Write the entries of the spool file to logtable.
+ *
+ * Entries are written logbatchsize at a time, and marked done in the file
+ * after each batch. Nothing is done while another process replays the
+ * file, or when the database cannot be reached; what was not written is
+ * tried again on the next call.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_spool_replay(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_err_t err;
+    pam_mysql_spool_rec_t *recs = NULL;
+    pam_mysql_log_event_t *batch = NULL;
+    unsigned long replayed = 0, damaged = 0;
+    size_t nbatch, len, nrecs, n, i;
+    struct flock lk;
+    struct stat st;
+    ssize_t r;
+    char *path;
+    int fd = -1;
+
+    nbatch = ctx->logbatchsize > 0 ? (size_t)ctx->logbatchsize: 1;
+    len = strlen(ctx->logspool);
+    if (NULL == (path = xcalloc(len + sizeof(PAM_MYSQL_SPOOL_SUFFIX), 1))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return;
+    }
+    memcpy(path, ctx->logspool, len);
+    memcpy(path + len, PAM_MYSQL_SPOOL_SUFFIX, sizeof(PAM_MYSQL_SPOOL_SUFFIX));
+
+    if ((fd = open(path, O_RDWR | O_NOFOLLOW)) < 0) {
+        /* take the spool aside, unless someone else just did */
+        if (errno == ENOENT && link(ctx->logspool, path) == 0) {
+            unlink(ctx->logspool);
+        }
+        goto out;
+    }
+
+    memset(&lk, 0, sizeof(lk));
+    lk.l_type = F_WRLCK;
+    lk.l_whence = SEEK_SET;
+
+    if (fcntl(fd, F_SETLK, &lk) || fstat(fd, &st) || st.st_nlink == 0 ||
+            time(NULL) - st.st_ctime < PAM_MYSQL_SPOOL_SETTLE) {
+        goto out;
+    }
+
+    if (st.st_dev != pam_mysql_spool.dev || st.st_ino != pam_mysql_spool.ino) {
+        pam_mysql_spool.dev = st.st_dev;
+        pam_mysql_spool.ino = st.st_ino;
+        pam_mysql_spool.off = 0;
+    }
+
+    if (NULL == (recs = xcalloc(nbatch, sizeof(pam_mysql_spool_rec_t))) ||
+            NULL == (batch = xcalloc(nbatch, sizeof(pam_mysql_log_event_t)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        goto out;
+    }
+
+    pam_mysql_use_writer(ctx, 1);
+
+    err = pam_mysql_open_db(ctx);
+    if (err != PAM_MYSQL_ERR_SUCCESS && err != PAM_MYSQL_ERR_BUSY) {
+        goto out;
+    }
+
+    for (;;) {
+        if ((r = pread(fd, recs, nbatch * sizeof(pam_mysql_spool_rec_t),
+                        pam_mysql_spool.off)) < 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to read %s (%s)", path, strerror(errno));
+            goto out;
+        }
+
+        if (r < (ssize_t)sizeof(pam_mysql_spool_rec_t)) {
+            /* a torn record at the end */
+            if (r > 0) {
+                damaged++;
+            }
+            break;
+        }
+
+        nrecs = (size_t)r / sizeof(pam_mysql_spool_rec_t);
+
+        for (i = 0, n = 0; i < nrecs; i++) {
+            switch (pam_mysql_spool_parse(&recs[i], &batch[n])) {
+                case 0:
+                    n++;
+                    break;
+
+                case -1:
+                    damaged++;
+                    break;
+            }
+        }
+
+        if (n > 0 && (err = pam_mysql_log_insert(ctx, batch, n))) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to replay %s (%s)", path,
+                    err == PAM_MYSQL_ERR_DB && ctx->mysql_hdl != NULL ? mysql_error(ctx->mysql_hdl): "no connection");
+            pam_mysql_close_db(ctx);
+            goto out;
+        }
+
+        if (n > 0) {
+            for (i = 0; i < nrecs; i++) {
+                if (recs[i].magic == PAM_MYSQL_SPOOL_MAGIC) {
+                    recs[i].magic = PAM_MYSQL_SPOOL_DONE;
+                }
+            }
+
+            /* without the marks, the batch is written again after a restart */
+            if (pwrite(fd, recs, nrecs * sizeof(pam_mysql_spool_rec_t),
+                        pam_mysql_spool.off) != (ssize_t)(nrecs * sizeof(pam_mysql_spool_rec_t)) ||
+                    fsync(fd)) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to mark the records of %s (%s)", path, strerror(errno));
+            }
+        }
+
+        pam_mysql_spool.off += (off_t)(nrecs * sizeof(pam_mysql_spool_rec_t));
+        replayed += n;
+    }
+
+    unlink(path);
+    pam_mysql_spool.off = 0;
+
+out:
+    if (replayed > 0) {
+        syslog(LOG_AUTHPRIV | LOG_INFO, PAM_MYSQL_LOG_PREFIX "%lu log entries replayed from %s", replayed, path);
+    }
+
+    if (damaged > 0) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%lu damaged records skipped in %s", damaged, path);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (recs != NULL) {
+        memset(recs, 0, nbatch * sizeof(pam_mysql_spool_rec_t));
+        xfree(recs);
+    }
+
+    if (batch != NULL) {
+        memset(batch, 0, nbatch * sizeof(pam_mysql_log_event_t));
+        xfree(batch);
+    }
+
+    xfree(path);
+}
+#endif /* HAVE_PTHREAD_H */
+
+/* connection for log entries */
+
+/**
+ * Replace a string option with another, if that one is set.
+ *
+ * @param char **to
+ *   The option to replace.
+ * @param char **from
+ *   The option to take the value of; cleared.
+ */
+static void pam_mysql_take_string(char **to, char **from)
+{
+    if (*from != NULL) {
+        xfree(*to);
+        *to = *from;
+        *from = NULL;
+    }
+}
+
+/**
+ * Make a private context to write log entries with.
+ *
+ * The options are copied from the context of the caller. The writer role
+ * becomes the only one, and the log.* connection options replace those
+ * of the users.* section where they are set.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_ctx_t *
+ *   The new context, or NULL on failure.
+ */
+static pam_mysql_ctx_t *pam_mysql_log_conf(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_ctx_t *conf;
+    pam_mysql_option_t *opt;
+
+    if (NULL == (conf = xcalloc(1, sizeof(pam_mysql_ctx_t)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return NULL;
+    }
+
+    pam_mysql_init_ctx(conf);
+
+    for (opt = options; opt->name != NULL && !err; opt++) {
+        const char *val;
+        int to_release;
+
+        /* the file has been read into the context already */
+        if (opt->offset == PAM_MYSQL_OFFSETOF(pam_mysql_ctx_t, config_file)) {
+            continue;
+        }
+
+        if ((err = opt->accessor->get_op((void *)((char *)ctx + opt->offset), &val, &to_release))) {
+            break;
+        }
+
+        if (val != NULL) {
+            err = pam_mysql_assign_option(conf, opt, val);
+        }
+
+        if (to_release) {
+            xfree((char *)val);
+        }
+    }
+
+    if (err) {
+        pam_mysql_destroy_ctx(conf);
+        xfree(conf);
+        return NULL;
+    }
+
+    pam_mysql_take_string(&conf->host, &conf->write_host);
+    if (conf->write_user != NULL) {
+        xfree(conf->passwd);
+        conf->passwd = conf->write_passwd;
+        conf->write_passwd = NULL;
+        pam_mysql_take_string(&conf->user, &conf->write_user);
+    }
+
+    pam_mysql_take_string(&conf->host, &conf->loghost);
+    pam_mysql_take_string(&conf->db, &conf->logdb);
+    if (conf->loguser != NULL) {
+        xfree(conf->passwd);
+        conf->passwd = conf->logpasswd;
+        conf->logpasswd = NULL;
+        pam_mysql_take_string(&conf->user, &conf->loguser);
+    }
+    pam_mysql_take_string(&conf->ssl_mode, &conf->logssl_mode);
+    pam_mysql_take_string(&conf->ssl_cert, &conf->logssl_cert);
+    pam_mysql_take_string(&conf->ssl_key, &conf->logssl_key);
+    pam_mysql_take_string(&conf->ssl_ca, &conf->logssl_ca);
+    pam_mysql_take_string(&conf->ssl_capath, &conf->logssl_capath);
+    pam_mysql_take_string(&conf->ssl_cipher, &conf->logssl_cipher);
+
+    /* nothing to send the entries in front of */
+    conf->logpiggyback = 0;
+    conf->prefetch = 0;
+    xfree(conf->daemon_socket);
+    conf->daemon_socket = NULL;
+
+    return conf;
+}
+
+/**
+ * Tell whether log entries go over a connection of their own.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   Non-zero if any of the log.* connection options is set.
+ */
+static int pam_mysql_log_separate(pam_mysql_ctx_t *ctx)
+{
+    return ctx->loghost != NULL || ctx->logdb != NULL ||
+        ctx->loguser != NULL || ctx->logssl_mode != NULL ||
+        ctx->logssl_cert != NULL || ctx->logssl_key != NULL ||
+        ctx->logssl_ca != NULL || ctx->logssl_capath != NULL ||
+        ctx->logssl_cipher != NULL;
+}
+
+/**
+ * Get the context log entries are written with by the caller.
+ *
+ * That is the context itself, unless log entries go over a connection of
+ * their own; the context for it is made on first use, and again once
+ * the options have changed. It shares the deadline of the operation.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_ctx_t *
+ *   The context, or NULL on failure.
+ */
+static pam_mysql_ctx_t *pam_mysql_log_conn(pam_mysql_ctx_t *ctx)
+{
+    if (!pam_mysql_log_separate(ctx)) {
+        return ctx;
+    }
+
+    if (ctx->log_conn != NULL && ctx->log_conn_gen != ctx->options_gen) {
+        pam_mysql_log_conn_clear(ctx);
+    }
+
+    if (ctx->log_conn == NULL) {
+        if (NULL == (ctx->log_conn = pam_mysql_log_conf(ctx))) {
+            return NULL;
+        }
+        ctx->log_conn_gen = ctx->options_gen;
+    }
+
+    ctx->log_conn->deadline_at = ctx->deadline_at;
+
+    return ctx->log_conn;
+}
+
+/**
+ * Close the connection for log entries, if there is one.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_log_conn_clear(pam_mysql_ctx_t *ctx)
+{
+    if (ctx->log_conn != NULL) {
+        pam_mysql_destroy_ctx(ctx->log_conn);
+        xfree(ctx->log_conn);
+        ctx->log_conn = NULL;
+    }
+}
+
+/* asynchronous sqllog writer */
+
+#ifdef HAVE_PTHREAD_H
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t drained;
+    pam_mysql_log_event_t *events;
+    size_t size;
+    size_t head;
+    size_t count;
+    struct timeval first;
+    unsigned long dropped;
+    unsigned long long fp;
+    pam_mysql_ctx_t *conf;
+    pthread_t thread;
+    int running;
+    int busy;
+    int stop;
+    int atfork;
+    pid_t pid;
+} pam_mysql_log_writer = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * Get the logoverflow policy.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   One of the PAM_MYSQL_LOG_* policies.
+ */
+static int pam_mysql_log_overflow(pam_mysql_ctx_t *ctx)
+{
+    if (ctx->logoverflow == NULL ||
+            strcasecmp(ctx->logoverflow, "drop_oldest") == 0) {
+        return PAM_MYSQL_LOG_DROP_OLDEST;
+    } else if (strcasecmp(ctx->logoverflow, "block") == 0) {
+        return PAM_MYSQL_LOG_BLOCK;
+    } else if (strcasecmp(ctx->logoverflow, "spill") == 0) {
+        return PAM_MYSQL_LOG_SPILL;
+    }
+
+    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unknown logoverflow \"%s\"; dropping the oldest entries", ctx->logoverflow);
+
+    return PAM_MYSQL_LOG_DROP_OLDEST;
+}
+
+/**
+ * Compute a fingerprint of the options the log writer depends on.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return unsigned long long
+ *   The fingerprint.
+ */
+static unsigned long long pam_mysql_log_fingerprint(pam_mysql_ctx_t *ctx)
+{
+    unsigned long long h = pam_mysql_conn_fingerprint(ctx);
+
+    h = pam_mysql_hash_str(h, ctx->write_host);
+    h = pam_mysql_hash_str(h, ctx->write_user);
+    h = pam_mysql_hash_str(h, ctx->write_passwd);
+    h = pam_mysql_hash_str(h, ctx->loghost);
+    h = pam_mysql_hash_str(h, ctx->logdb);
+    h = pam_mysql_hash_str(h, ctx->loguser);
+    h = pam_mysql_hash_str(h, ctx->logpasswd);
+    h = pam_mysql_hash_str(h, ctx->logssl_mode);
+    h = pam_mysql_hash_str(h, ctx->logssl_cert);
+    h = pam_mysql_hash_str(h, ctx->logssl_key);
+    h = pam_mysql_hash_str(h, ctx->logssl_ca);
+    h = pam_mysql_hash_str(h, ctx->logssl_capath);
+    h = pam_mysql_hash_str(h, ctx->logssl_cipher);
+    h = pam_mysql_hash_str(h, ctx->logtable);
+    h = pam_mysql_hash_str(h, ctx->logmsgcolumn);
+    h = pam_mysql_hash_str(h, ctx->logpidcolumn);
+    h = pam_mysql_hash_str(h, ctx->logusercolumn);
+    h = pam_mysql_hash_str(h, ctx->loghostcolumn);
+    h = pam_mysql_hash_str(h, ctx->logrhostcolumn);
+    h = pam_mysql_hash_str(h, ctx->logtimecolumn);
+    h = pam_mysql_hash_str(h, ctx->logspool);
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->logqueuesize, sizeof(ctx->logqueuesize));
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->logbatchsize, sizeof(ctx->logbatchsize));
+    h = pam_mysql_hash_mem(h, (const char *)&ctx->logflushinterval, sizeof(ctx->logflushinterval));
+
+    return h;
+}
+
+/**
+ * Make the private context the log writer connects with.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_ctx_t *
+ *   The new context, or NULL on failure.
+ */
+static pam_mysql_ctx_t *pam_mysql_log_writer_conf(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_ctx_t *conf;
+
+    if (NULL == (conf = pam_mysql_log_conf(ctx))) {
+        return NULL;
+    }
+
+    /* one connection of its own, kept for as long as the writer runs */
+    conf->pool = 0;
+    conf->disconnect_every_op = 0;
+
+    return conf;
+}
+
+/**
+ * Write a batch of queued entries from the writer thread.
+ *
+ * @param pam_mysql_ctx_t *conf
+ *   The context of the writer.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entries.
+ * @param size_t n
+ *   The number of entries.
+ */
+static void pam_mysql_log_writer_flush(pam_mysql_ctx_t *conf,
+        const pam_mysql_log_event_t *ev, size_t n)
+{
+    pam_mysql_err_t err;
+
+    pam_mysql_deadline_start(conf);
+    pam_mysql_use_writer(conf, 1);
+
+    err = pam_mysql_open_db(conf);
+    if (err == PAM_MYSQL_ERR_SUCCESS || err == PAM_MYSQL_ERR_BUSY) {
+        err = pam_mysql_log_insert(conf, ev, n);
+    }
+
+    if (err) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to write %lu log entries (%s)", (unsigned long)n,
+                err == PAM_MYSQL_ERR_DB && conf->mysql_hdl != NULL ? mysql_error(conf->mysql_hdl): "no connection");
+        pam_mysql_close_db(conf);
+    } else if (conf->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%lu log entries written.", (unsigned long)n);
+    }
+}
+
+/**
+ * Body of the log writer thread.
+ *
+ * Queued entries are written once logbatchsize of them are waiting, or
+ * logflushinterval milliseconds after the oldest was queued. What is
+ * left is written before the thread exits. With logspool, the spool file
+ * is replayed whenever nothing is queued for logflushinterval.
+ *
+ * @param void *arg
+ *   Unused.
+ *
+ * @return void *
+ *   NULL.
+ */
+static void *pam_mysql_log_writer_main(void *arg)
+{
+    pam_mysql_log_event_t *batch;
+    pam_mysql_ctx_t *conf;
+    struct timespec due;
+    struct timeval now;
+    unsigned long dropped;
+    size_t n, i;
+
+    mysql_thread_init();
+
+    pthread_mutex_lock(&pam_mysql_log_writer.lock);
+
+    for (;;) {
+        conf = pam_mysql_log_writer.conf;
+
+        while (!pam_mysql_log_writer.stop &&
+                pam_mysql_log_writer.count < (size_t)conf->logbatchsize) {
+            if (pam_mysql_log_writer.count == 0) {
+                if (conf->logspool == NULL) {
+                    pthread_cond_wait(&pam_mysql_log_writer.queued,
+                            &pam_mysql_log_writer.lock);
+                    conf = pam_mysql_log_writer.conf;
+                    continue;
+                }
+
+                /* look at the spool every logflushinterval */
+                gettimeofday(&now, NULL);
+            } else {
+                now = pam_mysql_log_writer.first;
+            }
+
+            due.tv_sec = now.tv_sec + conf->logflushinterval / 1000;
+            due.tv_nsec = (long)now.tv_usec * 1000 +
+                (long)(conf->logflushinterval % 1000) * 1000000;
+            if (due.tv_nsec >= 1000000000) {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000;
+            }
+
+            if (pthread_cond_timedwait(&pam_mysql_log_writer.queued,
+                        &pam_mysql_log_writer.lock, &due) == ETIMEDOUT) {
+                break;
+            }
+            conf = pam_mysql_log_writer.conf;
+        }
+
+        /* pam_mysql_log_writer_setup() may have replaced it while we waited */
+        conf = pam_mysql_log_writer.conf;
+
+        if (pam_mysql_log_writer.count == 0) {
+            if (pam_mysql_log_writer.stop) {
+                /* nothing is left */
+                break;
+            }
+
+            pam_mysql_log_writer.busy = 1;
+            pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+            pam_mysql_deadline_start(conf);
+            pam_mysql_spool_replay(conf);
+            pam_mysql_release_db(conf);
+
+            pthread_mutex_lock(&pam_mysql_log_writer.lock);
+            pam_mysql_log_writer.busy = 0;
+            continue;
+        }
+
+        n = pam_mysql_log_writer.count;
+        if (n > (size_t)conf->logbatchsize) {
+            n = conf->logbatchsize;
+        }
+
+        if (NULL != (batch = xcalloc(n, sizeof(pam_mysql_log_event_t)))) {
+            for (i = 0; i < n; i++) {
+                batch[i] = pam_mysql_log_writer.events[
+                    (pam_mysql_log_writer.head + i) % pam_mysql_log_writer.size];
+            }
+        } else {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            pam_mysql_log_writer.dropped += n;
+        }
+
+        pam_mysql_log_writer.head = (pam_mysql_log_writer.head + n) %
+            pam_mysql_log_writer.size;
+        pam_mysql_log_writer.count -= n;
+        gettimeofday(&pam_mysql_log_writer.first, NULL);
+        dropped = pam_mysql_log_writer.dropped;
+        pam_mysql_log_writer.dropped = 0;
+        pam_mysql_log_writer.busy = 1;
+
+        pthread_cond_broadcast(&pam_mysql_log_writer.drained);
+        pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+        if (dropped > 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%lu log entries dropped", dropped);
+        }
+
+        if (batch != NULL) {
+            pam_mysql_log_writer_flush(conf, batch, n);
+            pam_mysql_release_db(conf);
+            memset(batch, 0, n * sizeof(pam_mysql_log_event_t));
+            xfree(batch);
+        }
+
+        pthread_mutex_lock(&pam_mysql_log_writer.lock);
+        pam_mysql_log_writer.busy = 0;
+    }
+
+    pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+/**
+ * Take the lock of the log writer before fork(), so that the child does
+ * not inherit it held by a thread it does not have.
+ */
+static void pam_mysql_log_writer_prepare(void)
+{
+    pthread_mutex_lock(&pam_mysql_log_writer.lock);
+}
+
+/**
+ * Release the lock of the log writer in the parent after fork().
+ */
+static void pam_mysql_log_writer_parent(void)
+{
+    pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+}
+
+/**
+ * Reset the log writer in the child after fork().
+ *
+ * The thread is not there, and its connection and the queued entries are
+ * the parent's to write; they are left alone.
+ */
+static void pam_mysql_log_writer_child(void)
+{
+    pam_mysql_log_writer.conf = NULL;
+    pam_mysql_log_writer.running = 0;
+    pam_mysql_log_writer.busy = 0;
+    pam_mysql_log_writer.stop = 0;
+    pam_mysql_log_writer.head = 0;
+    pam_mysql_log_writer.count = 0;
+    pam_mysql_log_writer.dropped = 0;
+    pam_mysql_log_writer.pid = getpid();
+
+    pthread_mutex_init(&pam_mysql_log_writer.lock, NULL);
+    pthread_cond_init(&pam_mysql_log_writer.queued, NULL);
+    pthread_cond_init(&pam_mysql_log_writer.drained, NULL);
+}
 
-                                pam_mysql_md5_data((unsigned char*)tmp, len, buf);
+/**
+ * Make sure the log writer runs with the options of the caller.
+ *
+ * The writer is started on first use, and set up again from the options
+ * of the caller when they differ from the ones it was started with. Must
+ * be called with the lock of the writer held.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_ctx_t **pold
+ *   Receives the context the writer used before, for the caller to destroy
+ *   once the lock is released, or NULL.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_NOTIMPL if the writer cannot take entries for the caller.
+ */
+static pam_mysql_err_t pam_mysql_log_writer_setup(pam_mysql_ctx_t *ctx,
+        pam_mysql_ctx_t **pold)
+{
+    unsigned long long fp = pam_mysql_log_fingerprint(ctx);
+    int rc;
 
-                                vresult = strcmp(hash, buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
+    *pold = NULL;
 
-                                xfree(tmp);
-#else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
-#endif
-                            } break;
+    if (!pam_mysql_log_writer.atfork) {
+        if ((rc = pthread_atfork(pam_mysql_log_writer_prepare,
+                        pam_mysql_log_writer_parent,
+                        pam_mysql_log_writer_child)) != 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to start the log writer (%s)", strerror(rc));
+            return PAM_MYSQL_ERR_NOTIMPL;
+        }
 
-                    case 7:
-                            {
-                                /* Salted SHA */
-#ifdef HAVE_PAM_MYSQL_SHA1_DATA
-                                unsigned char* hash;
-                                size_t sha1_size;
-                                Base64Decode(row[0], &hash, &sha1_size);
-                                size_t salt_length = sha1_size - 20;
-                                unsigned char salt[salt_length];
-                                memcpy(salt, &(hash[20]), salt_length);
+        pam_mysql_log_writer.atfork = 1;
+        pam_mysql_log_writer.pid = getpid();
+    }
 
-                                char buf[41];
-                                pam_mysql_ssha_data((unsigned char*)passwd, strlen(passwd), salt, salt_length,
-                                    buf);
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
-#else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SSHA hash is not supported in this build.");
-#endif
-                            } break;
+    if (pam_mysql_log_writer.conf == NULL || pam_mysql_log_writer.fp != fp) {
+        pam_mysql_log_event_t *events = pam_mysql_log_writer.events;
+        pam_mysql_ctx_t *conf;
 
-                    case 8:
-                            {
-#ifdef HAVE_PAM_MYSQL_SHA512_DATA
-                                char buf[128];
-                                pam_mysql_sha512_data((unsigned char*)passwd, strlen(passwd), buf);
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
-#else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA512 hash is not supported in this build.");
-#endif
-                            }
-                            break;
+        if (pam_mysql_log_writer.count > 0 || pam_mysql_log_writer.busy) {
+            /* still writing entries for other options */
+            return PAM_MYSQL_ERR_NOTIMPL;
+        }
 
-                    case 9:
-                            {
-#ifdef HAVE_PAM_MYSQL_SHA256_DATA
-                                char buf[64];
-                                pam_mysql_sha256_data((unsigned char*)passwd, strlen(passwd), buf);
-                                vresult = strcmp(row[0], buf);
-                                {
-                                    char *p = buf - 1;
-                                    while (*(++p)) *p = '\0';
-                                }
-#else
-                                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA256 hash is not supported in this build.");
-#endif
-                            }
-                            break;
+        if ((size_t)ctx->logqueuesize != pam_mysql_log_writer.size &&
+                NULL == (events = xcalloc(ctx->logqueuesize,
+                        sizeof(pam_mysql_log_event_t)))) {
+            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+            return PAM_MYSQL_ERR_NOTIMPL;
+        }
 
-                    default: {
-                             }
-                }
+        if (NULL == (conf = pam_mysql_log_writer_conf(ctx))) {
+            if (events != pam_mysql_log_writer.events) {
+                xfree(events);
             }
-        } else {
-            vresult = null_inhibited;
+            return PAM_MYSQL_ERR_NOTIMPL;
         }
 
-        if (vresult == 0) {
-            err = PAM_MYSQL_ERR_SUCCESS;
-        } else {
-            err = PAM_MYSQL_ERR_MISMATCH;
+        if (events != pam_mysql_log_writer.events) {
+            xfree(pam_mysql_log_writer.events);
+            pam_mysql_log_writer.events = events;
+            pam_mysql_log_writer.size = ctx->logqueuesize;
         }
 
-out:
-        if (err == PAM_MYSQL_ERR_DB) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error(%s)", mysql_error(ctx->mysql_hdl));
-        }
+        *pold = pam_mysql_log_writer.conf;
+        pam_mysql_log_writer.conf = conf;
+        pam_mysql_log_writer.fp = fp;
+        pam_mysql_log_writer.head = 0;
 
-        if (result != NULL) {
-            mysql_free_result(result);
+        /* so that the thread picks up the new options */
+        pthread_cond_signal(&pam_mysql_log_writer.queued);
+    }
+
+    if (!pam_mysql_log_writer.running) {
+        /* the client library must be set up before a second thread uses it */
+        if (pam_mysql_library_init()) {
+            return PAM_MYSQL_ERR_NOTIMPL;
         }
 
-        pam_mysql_str_destroy(&query);
+        pam_mysql_log_writer.stop = 0;
 
-        if (ctx->verbose) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_check_passwd() returning %i.", err);
+        if ((rc = pthread_create(&pam_mysql_log_writer.thread, NULL,
+                        pam_mysql_log_writer_main, NULL)) != 0) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to start the log writer (%s)", strerror(rc));
+            return PAM_MYSQL_ERR_NOTIMPL;
         }
 
-        return err;
+        pam_mysql_log_writer.running = 1;
     }
 
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
 /**
- * Create a random salt for use with CRYPT() when changing passwords.
+ * Make sure the log writer runs, to replay the spool file.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
- * @param char *salt
- *   A pointer to the string to be filled.
- * @param const char *salter
- *   A pointer to the string used to generate the salt. (NB: Pointless if
- *   HAVE_GETTIMEOFDAY is defined).
  */
-static void pam_mysql_saltify(pam_mysql_ctx_t *ctx, char *salt, const char *salter)
+static void pam_mysql_log_writer_kick(pam_mysql_ctx_t *ctx)
 {
-    unsigned int i = 0;
-    char *q;
-    unsigned int seed = 0;
-    static const char saltstr[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789./";
+    pam_mysql_ctx_t *old;
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "saltify called.");
+    if (ctx->logqueuesize <= 0 || ctx->logbatchsize <= 0) {
+        return;
     }
 
-    if (salter != NULL) {
-        const char *p;
-        for (p = salter; *p != '\0'; p++) {
-            seed += salter[i];
-        }
+    pthread_mutex_lock(&pam_mysql_log_writer.lock);
+    pam_mysql_log_writer_setup(ctx, &old);
+    pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+    if (old != NULL) {
+        pam_mysql_destroy_ctx(old);
+        xfree(old);
     }
+}
 
-#ifdef HAVE_GETTIMEOFDAY
-    {
-        struct timeval *tv;
-        if (gettimeofday(&tv, NULL)) {
-            tv.tv_usec = 0;
-        }
-        seed = (unsigned int)((tv.tv_usec + j) % 65535);
+/**
+ * Hand a log entry over to the writer thread.
+ *
+ * When the queue is full, logoverflow decides what happens.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entry.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_NOTIMPL if the caller should write the entry itself.
+ */
+static pam_mysql_err_t pam_mysql_log_enqueue(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev)
+{
+    pam_mysql_err_t err;
+    pam_mysql_ctx_t *old = NULL;
+    struct timeval at;
+    struct timespec due;
+    int policy = pam_mysql_log_overflow(ctx);
+
+    if (ctx->logqueuesize <= 0 || ctx->logbatchsize <= 0) {
+        return PAM_MYSQL_ERR_NOTIMPL;
     }
-#endif
 
-    if ((ctx->blowfish + ctx->sha512 + ctx->sha256 + ctx->md5) > 1) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, "Only one of blowfish, sha512, sha256 or md5 should be specified. Falling back to the strongest of selected values.");
+    pthread_mutex_lock(&pam_mysql_log_writer.lock);
+
+    if ((err = pam_mysql_log_writer_setup(ctx, &old))) {
+        goto out;
     }
 
-    q = salt;
+    /* without a deadline, the writer may be stuck on a server that does not answer */
+    at = ctx->deadline_at;
+    if (!timerisset(&at)) {
+        gettimeofday(&at, NULL);
+        at.tv_sec += PAM_MYSQL_LOG_BLOCK_WAIT;
+    }
+    due.tv_sec = at.tv_sec;
+    due.tv_nsec = (long)at.tv_usec * 1000;
 
-#ifdef HAVE_BLOWFISH
-    if (ctx->blowfish) {
-        strcpy(salt, "$2a$");
-        q += sizeof("$2a$") - 1;
-        if (ctx->rounds < 4 || ctx->rounds > 31) {
-            strcpy(q, "05$");
-            q += sizeof("05$") - 1;
-        } else {
-            int a;
-            a = snprintf(q, 5, "%02d$", ctx->rounds);
-            if (a == 3) {
-                q += a;
-            }
-        }
-        i = 22;
-    } else if ((ctx->sha256) || (ctx->sha512)) {
-#else
-        if (ctx->blowfish) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, "Blowfish is unavailable in this version in glibc.");
-        }
-        if ((ctx->sha256) || (ctx->sha512)) {
-#endif
-            if (ctx->sha512) {
-                strcpy(salt, "$6$");
-                q += sizeof("$6$") - 1;
-            } else {
-                strcpy(salt, "$5$");
-                q += sizeof("$5$") - 1;
-            }
-            if ((ctx->rounds >= 1000) && (ctx->rounds < INT_MAX)) {
-                if (ctx->rounds >= 10000000) {
-                    strcpy(q, "rounds=9999999$");
-                    q += sizeof("rounds=9999999$") - 1;
-                } else {
-                    int a;
-                    a = snprintf(q, 17, "rounds=%d$", ctx->rounds);
-                    if (a < 16) {
-                        q += a;
-                    }
-                }
+    while (pam_mysql_log_writer.count == pam_mysql_log_writer.size) {
+        if (policy == PAM_MYSQL_LOG_SPILL) {
+            err = PAM_MYSQL_ERR_NOTIMPL;
+            goto out;
+        } else if (policy == PAM_MYSQL_LOG_BLOCK) {
+            pthread_cond_signal(&pam_mysql_log_writer.queued);
+
+            if (pthread_cond_timedwait(&pam_mysql_log_writer.drained,
+                        &pam_mysql_log_writer.lock, &due) == ETIMEDOUT &&
+                    pam_mysql_log_writer.count == pam_mysql_log_writer.size) {
+                pam_mysql_log_writer.dropped++;
+                err = PAM_MYSQL_ERR_TIMEOUT;
+                goto out;
             }
-            i = 16;
-        } else if (ctx->md5) {
-            strcpy(salt, "$1$");
-            q += sizeof("$1$") - 1;
-            i = 8;
         } else {
-            i = 2;
+            pam_mysql_log_writer.head = (pam_mysql_log_writer.head + 1) %
+                pam_mysql_log_writer.size;
+            pam_mysql_log_writer.count--;
+            pam_mysql_log_writer.dropped++;
         }
+    }
 
-        while (i-- > 0) {
-            *(q++) = saltstr[seed % 64];
-            seed = (((seed ^ 0x967e3c5a) << 3) ^ (~(seed >> 2) + i));
-        }
+    pam_mysql_log_writer.events[(pam_mysql_log_writer.head +
+            pam_mysql_log_writer.count) % pam_mysql_log_writer.size] = *ev;
+
+    if (pam_mysql_log_writer.count++ == 0) {
+        gettimeofday(&pam_mysql_log_writer.first, NULL);
+    }
+
+    pthread_cond_signal(&pam_mysql_log_writer.queued);
+
+out:
+    pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+    if (old != NULL) {
+        pam_mysql_destroy_ctx(old);
+        xfree(old);
+    }
+
+    return err;
+}
+
+/**
+ * Stop the log writer, once the queued entries have been written.
+ *
+ * Only meant for the module teardown.
+ */
+static void pam_mysql_log_writer_stop(void)
+{
+    pam_mysql_ctx_t *conf = NULL;
+    int running;
+
+    pthread_mutex_lock(&pam_mysql_log_writer.lock);
+
+    running = pam_mysql_log_writer.running &&
+        pam_mysql_log_writer.pid == getpid();
+
+    if (running) {
+        pam_mysql_log_writer.stop = 1;
+        pthread_cond_signal(&pam_mysql_log_writer.queued);
+    }
+
+    pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+    if (running) {
+        pthread_join(pam_mysql_log_writer.thread, NULL);
+    }
+
+    pthread_mutex_lock(&pam_mysql_log_writer.lock);
+
+    if (pam_mysql_log_writer.pid == getpid()) {
+        conf = pam_mysql_log_writer.conf;
+    }
+
+    pam_mysql_log_writer.conf = NULL;
+    pam_mysql_log_writer.running = 0;
+    pam_mysql_log_writer.stop = 0;
+    pam_mysql_log_writer.head = 0;
+    pam_mysql_log_writer.count = 0;
+    pam_mysql_log_writer.size = 0;
+    xfree(pam_mysql_log_writer.events);
+    pam_mysql_log_writer.events = NULL;
+
+    pthread_mutex_unlock(&pam_mysql_log_writer.lock);
+
+    if (conf != NULL) {
+        pam_mysql_destroy_ctx(conf);
+        xfree(conf);
+    }
+}
+#else
+static pam_mysql_err_t pam_mysql_log_enqueue(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev)
+{
+    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "asynchronous logging is not supported in this build.");
+    ctx->logasync = 0;
+    return PAM_MYSQL_ERR_NOTIMPL;
+}
+
+static void pam_mysql_log_writer_kick(pam_mysql_ctx_t *ctx)
+{
+}
+
+static void pam_mysql_log_writer_stop(void)
+{
+}
+#endif /* HAVE_PTHREAD_H */
+
+/**
+ * Get the context log entries are written with by the caller, with its
+ * connection open.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_ctx_t **pdb
+ *   Receives the context, the one pam_mysql_log_conn() gives.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_log_open(pam_mysql_ctx_t *ctx,
+        pam_mysql_ctx_t **pdb)
+{
+    pam_mysql_err_t err;
 
-	if ((ctx->md5)||(ctx->sha256)||(ctx->sha512)||(ctx->blowfish)) {
-            *(q++) = '$';
-        }
-        *q = '\0';
+    if (NULL == (*pdb = pam_mysql_log_conn(ctx))) {
+        return PAM_MYSQL_ERR_ALLOC;
+    }
 
-        if (ctx->verbose) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_saltify() returning salt = %s.", salt);
+    pam_mysql_use_writer(*pdb, 1);
+
+    /* the operation itself may have been answered from a cache */
+    if ((*pdb)->mysql_hdl == NULL) {
+        err = pam_mysql_open_db(*pdb);
+        if (err != PAM_MYSQL_ERR_SUCCESS && err != PAM_MYSQL_ERR_BUSY) {
+            return err;
         }
     }
 
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
 /**
- * Update the password in MySQL.
+ * Write log entries the way the options say.
  *
- * To reduce the number of calls to the DB, I'm now assuming that the old
- * password has been verified elsewhere, so I only check for null/not null
- * and is_root.
+ * Entries go to the spool file with logspool, to the log writer with
+ * logasync, and are written by the caller otherwise, or when neither can
+ * take them, over the connection pam_mysql_log_conn() gives.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
- * @param const char *user
- *   A pointer to the string containing the username.
- * @param const char *new_passwd
- *   A pointer to the string containing the new password.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entries.
+ * @param size_t n
+ *   The number of entries.
  *
  * @return pam_mysql_err_t
  *   Indication of success or failure.
  */
-static pam_mysql_err_t pam_mysql_update_passwd(pam_mysql_ctx_t *ctx, const char *user, const char *new_passwd)
+static pam_mysql_err_t pam_mysql_log_write(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev, size_t n)
 {
     pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
-    pam_mysql_str_t query;
-    char *encrypted_passwd = NULL;
+    pam_mysql_ctx_t *db;
 
-    if ((err = pam_mysql_str_init(&query, 1))) {
-        return err;
-    }
-
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_update_passwd() called.");
+#ifndef HAVE_PTHREAD_H
+    if (ctx->logspool != NULL) {
+        /* nothing would replay it but the PAM calls themselves */
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "logspool is not supported in this build.");
+        xfree(ctx->logspool);
+        ctx->logspool = NULL;
     }
+#endif
 
-    if (user == NULL) {
-        if (ctx->verbose) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "user is NULL.");
+    if (ctx->logspool != NULL) {
+        if ((err = pam_mysql_spool_append(ctx, ev, n)) == PAM_MYSQL_ERR_SUCCESS) {
+            pam_mysql_log_writer_kick(ctx);
+            return err;
+        }
+    } else if (ctx->logasync) {
+        for (; n > 0; ev++, n--) {
+            if ((err = pam_mysql_log_enqueue(ctx, ev)) == PAM_MYSQL_ERR_NOTIMPL) {
+                break;
+            }
         }
 
-        syslog(LOG_NOTICE, PAM_MYSQL_LOG_PREFIX "unable to change password");
-        return PAM_MYSQL_ERR_INVAL;
+        if (n == 0) {
+            return err;
+        }
     }
 
-    if (new_passwd != NULL) {
-        switch (ctx->crypt_type) {
-            case 0:
-                if (NULL == (encrypted_passwd = xstrdup(new_passwd))) {
-                    syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                    err = PAM_MYSQL_ERR_ALLOC;
-                    goto out;
-                }
-                break;
-
-            case 1: {
-			char salt[64];
-                        pam_mysql_saltify(ctx, salt, new_passwd);
-                        if (NULL == (encrypted_passwd = xstrdup(crypt(new_passwd, salt)))) {
-                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                            err = PAM_MYSQL_ERR_ALLOC;
-                            goto out;
-                        }
-                    } break;
+    if ((err = pam_mysql_log_open(ctx, &db))) {
+        return err;
+    }
 
-            case 2:
-                    if (NULL == (encrypted_passwd = xcalloc(41 + 1, sizeof(char)))) {
-                        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                        err = PAM_MYSQL_ERR_ALLOC;
-                        goto out;
-                    }
-#ifdef HAVE_MAKE_SCRAMBLED_PASSWORD_323
-                    if (ctx->use_323_passwd) {
-                        syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and enabled in pam_mysql_update_passwd");
-                        make_scrambled_password_323(encrypted_passwd, new_passwd);
-                    } else {
-                        syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd defined and not enabled in pam_mysql_update_passwd");
-                        make_scrambled_password(encrypted_passwd, new_passwd);
-                    }
-#else
-                    if (ctx->use_323_passwd) {
-                        syslog(LOG_WARNING, PAM_MYSQL_LOG_PREFIX "Workaround applied. use_323_passwd not defined but use attempted in pam_mysql_update_passwd");
-                        compat_make_scrambled_password_323(encrypted_passwd, new_passwd);
-                    } else {
-                        syslog(LOG_DEBUG, PAM_MYSQL_LOG_PREFIX "use_323_passwd not defined and use not attempted in pam_mysql_update_passwd");
-                        make_scrambled_password(encrypted_passwd, new_passwd);
-                    }
-#endif
-                    break;
+    return pam_mysql_log_insert(db, ev, n);
+}
 
-            case 3:
-#ifdef HAVE_PAM_MYSQL_MD5_DATA
-                    if (NULL == (encrypted_passwd = xcalloc(32 + 1, sizeof(char)))) {
-                        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                        err = PAM_MYSQL_ERR_ALLOC;
-                        goto out;
-                    }
-                    pam_mysql_md5_data((unsigned char*)new_passwd,
-                            strlen(new_passwd), encrypted_passwd);
-#else
-                    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
-                    err = PAM_MYSQL_ERR_NOTIMPL;
-                    goto out;
-#endif
-                    break;
+/**
+ * Write a log entry at once, as it was given.
+ *
+ * Unlike the entries that are queued, spooled or held back, its fields
+ * are not cut to the size of pam_mysql_log_event_t.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *msg
+ *   The message.
+ * @param const char *user
+ *   The user name.
+ * @param const char *rhost
+ *   The remote host.
+ * @param unsigned int pid
+ *   The process id.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_log_direct(pam_mysql_ctx_t *ctx,
+        const char *msg, const char *user, const char *rhost, unsigned int pid)
+{
+    pam_mysql_err_t err;
+    pam_mysql_str_t query;
+    pam_mysql_ctx_t *db;
+    const char *host;
 
-            case 4:
-#ifdef HAVE_PAM_MYSQL_SHA1_DATA
-                    if (NULL == (encrypted_passwd = xcalloc(40 + 1, sizeof(char)))) {
-                        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                        err = PAM_MYSQL_ERR_ALLOC;
-                        goto out;
-                    }
-                    pam_mysql_sha1_data((unsigned char*)new_passwd,
-                            strlen(new_passwd), encrypted_passwd);
-#else
-                    syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA1 hash is not supported in this build.");
-                    err = PAM_MYSQL_ERR_NOTIMPL;
-                    goto out;
-#endif
-                    break;
+    if ((err = pam_mysql_log_open(ctx, &db))) {
+        return err;
+    }
 
-            case 6:
-                    {
-#ifdef HAVE_PAM_MYSQL_MD5_DATA
-                        if (NULL == (encrypted_passwd = xcalloc(32 + 1+ 32 +1, sizeof(char)))) {
-                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                            err = PAM_MYSQL_ERR_ALLOC;
-                            goto out;
-                        }
+    if ((err = pam_mysql_str_init(&query, 1))) {
+        return err;
+    }
 
-                        int len=strlen(new_passwd)+32;
+    if (pam_mysql_get_host_info(db, &host)) {
+        host = "(unknown)";
+    }
 
-                        char *tmp;
+    if ((err = pam_mysql_log_format_head(db, &query)) ||
+            (err = pam_mysql_log_format_row(db, &query, msg, user, host,
+                    rhost, pid, 0))) {
+        goto out;
+    }
 
-                        if (NULL == (tmp = xcalloc(len+1, sizeof(char)))) {
-                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                            err = PAM_MYSQL_ERR_ALLOC;
-                            goto out;
-                        }
+    if (db->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
+    }
 
-                        char salt[33];
-                        salt[32]=0;
+    err = pam_mysql_query(db, &query);
 
-                        srandom(time(NULL));
+out:
+    pam_mysql_str_destroy(&query);
 
-                        int i;
-                        for(i=0;i<32; i++)
-                            salt[i]=(char)((random()/(double)RAND_MAX * 93.0) +33.0);
+    return err;
+}
 
-                        strcat(tmp,new_passwd);
-                        strcat(tmp,salt);
+/* log entries held back (see logcoalesce and logpiggyback) */
 
-                        pam_mysql_md5_data((unsigned char*)tmp, len, encrypted_passwd);
+/**
+ * Tell whether a log message is one of those listed in logimmediate.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *msg
+ *   A pointer to the message.
+ *
+ * @return int
+ *   Non-zero if the message starts with one of the comma-separated
+ *   prefixes of logimmediate.
+ */
+static int pam_mysql_log_immediate(pam_mysql_ctx_t *ctx, const char *msg)
+{
+    const char *p = ctx->logimmediate, *q;
+    size_t len;
 
-                        xfree(tmp);
+    while (p != NULL && *p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
 
-                        strcat(encrypted_passwd,":");
-                        strcat(encrypted_passwd,salt);
+        if (NULL != (q = strchr(p, ','))) {
+            len = (size_t)(q - p);
+            q++;
+        } else {
+            len = strlen(p);
+        }
 
-#else
-                        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish MD5 hash is not supported in this build.");
-                        err = PAM_MYSQL_ERR_NOTIMPL;
-                        goto out;
-#endif
-                        break;
-                    }
-            case 8:
-                    {
-#ifdef HAVE_PAM_MYSQL_SHA512_DATA
-                        if (NULL == (encrypted_passwd = xcalloc(128 + 1, sizeof(char)))) {
-                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                            err = PAM_MYSQL_ERR_ALLOC;
-                            goto out;
-                        }
-                        pam_mysql_sha512_data((unsigned char*)new_passwd, strlen(new_passwd), encrypted_passwd);
-#else
-                        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA512 hash is not supported in this build.");
-                        err = PAM_MYSQL_ERR_NOTIMPL;
-                        goto out;
-#endif
-                        break;
-                    }
-            case 9:
-                    {
-#ifdef HAVE_PAM_MYSQL_SHA256_DATA
-                        if (NULL == (encrypted_passwd = xcalloc(64 + 1, sizeof(char)))) {
-                            syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
-                            err = PAM_MYSQL_ERR_ALLOC;
-                            goto out;
-                        }
-                        pam_mysql_sha256_data((unsigned char*)new_passwd, strlen(new_passwd), encrypted_passwd);
-#else
-                        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "non-crypt()ish SHA256 hash is not supported in this build.");
-                        err = PAM_MYSQL_ERR_NOTIMPL;
-                        goto out;
-#endif
-                        break;
-                    }
-            default:
-                    encrypted_passwd = NULL;
-                    break;
+        if (len > 0 && strncasecmp(msg, p, len) == 0) {
+            return 1;
         }
-    }
 
-    err = pam_mysql_format_string(ctx, &query,
-            (ctx->where == NULL ?
-             "UPDATE %[table] SET %[passwdcolumn] = '%s' WHERE %[usercolumn] = '%s'":
-             "UPDATE %[table] SET %[passwdcolumn] = '%s' WHERE %[usercolumn] = '%s' AND (%S)"),
-            1, (encrypted_passwd == NULL ? "": encrypted_passwd), user, ctx->where);
-    if (err) {
-        goto out;
+        p = q;
     }
 
-#ifdef HAVE_MYSQL_REAL_QUERY
-    if (mysql_real_query(ctx->mysql_hdl, query.p, query.len)) {
-#else
-        if (mysql_query(ctx->mysql_hdl, query.p)) {
-#endif
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+    return 0;
+}
+
+/**
+ * Hold a log entry back until the pending ones are written.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entry.
+ *
+ * @return pam_mysql_err_t
+ *   PAM_MYSQL_ERR_NOTIMPL if the entry should be written now, along with
+ *   the pending ones.
+ */
+static pam_mysql_err_t pam_mysql_log_defer(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev)
+{
+    if (ctx->log_pending == NULL &&
+            NULL == (ctx->log_pending = xcalloc(PAM_MYSQL_LOG_PENDING_MAX + 1,
+                    sizeof(pam_mysql_log_event_t)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return PAM_MYSQL_ERR_NOTIMPL;
+    }
 
-out:
-        if (err == PAM_MYSQL_ERR_DB) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_error(ctx->mysql_hdl));
-        }
+    if (ctx->log_pending_pid != getpid()) {
+        /* inherited across fork(); they are the parent's to write */
+        ctx->log_npending = 0;
+        ctx->log_pending_pid = getpid();
+    }
 
-        if (encrypted_passwd != NULL) {
-            char *p;
-            for (p = encrypted_passwd; *p != '\0'; p++) {
-                *p = '\0';
-            }
-            xfree(encrypted_passwd);
-        }
+    if (ctx->log_npending >= PAM_MYSQL_LOG_PENDING_MAX) {
+        return PAM_MYSQL_ERR_NOTIMPL;
+    }
 
-        pam_mysql_str_destroy(&query);
+    ctx->log_pending[ctx->log_npending++] = *ev;
 
-        if (ctx->verbose) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_update_passwd() returning %i.", err);
-        }
+    return PAM_MYSQL_ERR_SUCCESS;
+}
 
-        return err;
+/**
+ * Drop the pending log entries.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_log_pending_clear(pam_mysql_ctx_t *ctx)
+{
+    if (ctx->log_pending != NULL) {
+        memset(ctx->log_pending, 0,
+                (PAM_MYSQL_LOG_PENDING_MAX + 1) * sizeof(pam_mysql_log_event_t));
+        xfree(ctx->log_pending);
+        ctx->log_pending = NULL;
     }
 
+    ctx->log_npending = 0;
+}
+
 /**
- * Detemine whether a username is known.
+ * Write the pending log entries, and another one, in one go.
  *
  * @param pam_mysql_ctx_t *ctx
  *   A pointer to the context data structure.
- * @param int pretval
- *   A pointer to the result.
- * @param const char *user
- *   A pointer to the username string to be checked.
+ * @param const pam_mysql_log_event_t *ev
+ *   The entry to write after the pending ones, or NULL.
  *
  * @return pam_mysql_err_t
  *   Indication of success or failure.
  */
-static pam_mysql_err_t pam_mysql_query_user_stat(pam_mysql_ctx_t *ctx,
-        int *pretval, const char *user)
+static pam_mysql_err_t pam_mysql_log_flush(pam_mysql_ctx_t *ctx,
+        const pam_mysql_log_event_t *ev)
 {
-    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
-    pam_mysql_str_t query;
-    MYSQL_RES *result = NULL;
-    MYSQL_ROW row;
+    pam_mysql_err_t err;
+    size_t n = 0;
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_query_user_stat() called.");
+    if (ctx->log_pending != NULL && ctx->log_pending_pid == getpid()) {
+        n = ctx->log_npending;
     }
 
-    if ((err = pam_mysql_str_init(&query, 0))) {
-        return err;
+    if (n == 0) {
+        return ev == NULL ? PAM_MYSQL_ERR_SUCCESS: pam_mysql_log_write(ctx, ev, 1);
     }
 
-    err = pam_mysql_format_string(ctx, &query,
-            (ctx->where == NULL ?
-             "SELECT %[statcolumn], %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = '%s'":
-             "SELECT %[statcolumn], %[passwdcolumn] FROM %[table] WHERE %[usercolumn] = '%s' AND (%S)"),
-            1, user, ctx->where);
-
-    if (err) {
-        goto out;
+    if (ev != NULL) {
+        ctx->log_pending[n++] = *ev;
     }
 
     if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "writing %lu log entries.", (unsigned long)n);
     }
 
-#ifdef HAVE_MYSQL_REAL_QUERY
-    if (mysql_real_query(ctx->mysql_hdl, query.p, query.len)) {
-#else
-        if (mysql_query(ctx->mysql_hdl, query.p)) {
-#endif
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+    /* so that pam_mysql_query() does not send them in front as well */
+    ctx->log_npending = 0;
 
-        if (NULL == (result = mysql_store_result(ctx->mysql_hdl))) {
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+    err = pam_mysql_log_write(ctx, ctx->log_pending, n);
 
-        switch (mysql_num_rows(result)) {
-            case 0:
-                syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned no result.");
-                err = PAM_MYSQL_ERR_NO_ENTRY;
-                goto out;
+    memset(ctx->log_pending, 0, n * sizeof(pam_mysql_log_event_t));
 
-            case 1:
-                break;
+    return err;
+}
 
-            case 2:
-                syslog(LOG_AUTHPRIV | LOG_ERR, "%s", PAM_MYSQL_LOG_PREFIX "SELECT returned an indetermined result.");
-                err = PAM_MYSQL_ERR_UNKNOWN;
-                goto out;
-        }
+/**
+ * Tell whether the pending log entries can go in front of the next query.
+ *
+ * That takes a connection opened with CLIENT_MULTI_STATEMENTS, on which
+ * the caller itself would write the entries.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return int
+ *   Non-zero if logpiggyback applies.
+ */
+static int pam_mysql_log_piggyback(pam_mysql_ctx_t *ctx)
+{
+#ifdef CLIENT_MULTI_STATEMENTS
+    return ctx->logpiggyback && ctx->logspool == NULL && !ctx->logasync &&
+        !pam_mysql_split_roles(ctx) && !pam_mysql_log_separate(ctx);
+#else
+    return 0;
+#endif
+}
 
-        if (NULL == (row = mysql_fetch_row(result))) {
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+/**
+ * Send a query with the INSERT of the pending log entries in front of it,
+ * in one round trip.
+ *
+ * Should the INSERT fail, the rest of the query is not run by the server,
+ * so it is sent again by itself; the entries are lost then, as they would
+ * be when written on their own.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const pam_mysql_str_t *query
+ *   The query.
+ *
+ * @return pam_mysql_err_t
+ *   As pam_mysql_query(), for the query.
+ */
+static pam_mysql_err_t pam_mysql_log_piggyback_query(pam_mysql_ctx_t *ctx,
+        const pam_mysql_str_t *query)
+{
+    pam_mysql_err_t err;
+    pam_mysql_str_t multi;
+    size_t n = ctx->log_npending;
 
-        if (row[0] == NULL) {
-            *pretval = PAM_MYSQL_USER_STAT_EXPIRED;
-        } else {
-            *pretval = strtol(row[0], NULL, 10) & ~PAM_MYSQL_USER_STAT_NULL_PASSWD;
-        }
+    /* so that the calls below send the queries as they are */
+    ctx->log_npending = 0;
 
-        if (row[1] == NULL) {
-            *pretval |= PAM_MYSQL_USER_STAT_NULL_PASSWD;
-        }
+    if ((err = pam_mysql_str_init(&multi, 1))) {
+        goto out;
+    }
 
-out:
-        if (err == PAM_MYSQL_ERR_DB) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_error(ctx->mysql_hdl));
-        }
+    if (pam_mysql_log_format(ctx, &multi, ctx->log_pending, n) ||
+            pam_mysql_str_append_char(&multi, ';') ||
+            pam_mysql_str_append(&multi, query->p, query->len)) {
+        err = pam_mysql_query(ctx, query);
+        goto out;
+    }
 
-        if (result != NULL) {
-            mysql_free_result(result);
-            if (ctx->select) {
-                while (mysql_next_result(ctx->mysql_hdl) == 0) {
-                    result = mysql_store_result(ctx->mysql_hdl);
-                    if (result)
-                        mysql_free_result(result);
-                }
-            }
-        }
+    if (ctx->verbose) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "writing %lu log entries in front of the query.", (unsigned long)n);
+    }
 
-        pam_mysql_str_destroy(&query);
+    if ((err = pam_mysql_query(ctx, &multi)) == PAM_MYSQL_ERR_DB) {
+        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to write %lu log entries (%s)", (unsigned long)n, mysql_error(ctx->mysql_hdl));
+        err = pam_mysql_query(ctx, query);
+    } else if (err == PAM_MYSQL_ERR_SUCCESS) {
+        err = pam_mysql_next_result(ctx);
+    }
 
-        if (ctx->verbose) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_query_user_stat() returning %i.", err);
-        }
+out:
+    pam_mysql_str_destroy(&multi);
+    memset(ctx->log_pending, 0, n * sizeof(pam_mysql_log_event_t));
 
-        return err;
+    return err;
+}
+
+/**
+ * Write the pending log entries when the PAM handle goes away.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysql_log_pending_flush(pam_mysql_ctx_t *ctx)
+{
+    if (ctx->log_npending == 0 || ctx->log_pending_pid != getpid()) {
+        return;
     }
 
+    pam_mysql_deadline_start(ctx);
+    pam_mysql_log_flush(ctx, NULL);
+    pam_mysql_release_db(ctx);
+}
+
 /**
  * Log a message.
  *
@@ -4530,24 +11674,32 @@ out:
 static pam_mysql_err_t pam_mysql_sql_log(pam_mysql_ctx_t *ctx, const char *msg, const char *user, const char *rhost)
 {
     pam_mysql_err_t err;
-    pam_mysql_str_t query;
-    const char *host;
+    pam_mysql_log_event_t ev;
+    pam_mysql_ctx_t *db;
 
     if (ctx->verbose) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_sql_log() called.");
     }
 
-    if ((err = pam_mysql_str_init(&query, 1))) {
-        return err;
-    }
-
     if (!ctx->sqllog) {
         err = PAM_MYSQL_ERR_SUCCESS;
         goto out;
     }
 
-    if (pam_mysql_get_host_info(ctx, &host)) {
-        host = "(unknown)";
+    if (ctx->daemon_fd >= 0) {
+        const char *params[3];
+        pam_mysql_msg_t resp;
+
+        params[0] = msg;
+        params[1] = user;
+        params[2] = rhost;
+
+        err = pam_mysql_daemon_call(ctx, PAM_MYSQL_OP_LOG, params, 3, &resp);
+        pam_mysql_msg_destroy(&resp);
+
+        if (err != PAM_MYSQL_ERR_NOTIMPL) {
+            goto out;
+        }
     }
 
     if (ctx->logtable == NULL) {
@@ -4580,41 +11732,44 @@ static pam_mysql_err_t pam_mysql_sql_log(pam_mysql_ctx_t *ctx, const char *msg,
         return PAM_MYSQL_ERR_INVAL;
     }
 
-    if (ctx->logrhostcolumn) {
-        err = pam_mysql_format_string(ctx, &query,
-                "INSERT INTO %[logtable] (%[logmsgcolumn], %[logusercolumn], %[loghostcolumn], %[logrhostcolumn], %[logpidcolumn], %[logtimecolumn]) VALUES ('%s', '%s', '%s', '%s', '%u', NOW())", 1,
-                msg, user, host, rhost == NULL ? "(unknown)": rhost, getpid());
-    } else {
-        err = pam_mysql_format_string(ctx, &query,
-                "INSERT INTO %[logtable] (%[logmsgcolumn], %[logusercolumn], %[loghostcolumn], %[logpidcolumn], %[logtimecolumn]) VALUES ('%s', '%s', '%s', '%u', NOW())", 1,
-                msg, user, host, getpid());
+    memset(&ev, 0, sizeof(ev));
+    strnncpy(ev.msg, sizeof(ev.msg), msg, strlen(msg));
+    strnncpy(ev.user, sizeof(ev.user), user, strlen(user));
+    if (rhost == NULL) {
+        rhost = "(unknown)";
     }
+    strnncpy(ev.rhost, sizeof(ev.rhost), rhost, strlen(rhost));
+    ev.pid = ctx->peer_pid ? ctx->peer_pid: getpid();
+    ev.stamp = 0;
 
-    if (err) {
-        goto out;
+    if (ctx->logspool != NULL || ctx->logasync || ctx->logcoalesce ||
+            pam_mysql_log_piggyback(ctx)) {
+        /* stamped now, as it may be written a while later */
+        ev.stamp = time(NULL);
     }
 
-    if (ctx->verbose) {
-        syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "%s", query.p);
+    if (ctx->logcoalesce || pam_mysql_log_piggyback(ctx)) {
+        if (pam_mysql_log_immediate(ctx, msg) ||
+                (err = pam_mysql_log_defer(ctx, &ev)) == PAM_MYSQL_ERR_NOTIMPL) {
+            err = pam_mysql_log_flush(ctx, &ev);
+        }
+        goto out;
     }
 
-#ifdef HAVE_MYSQL_REAL_QUERY
-    if (mysql_real_query(ctx->mysql_hdl, query.p, query.len)) {
-#else
-        if (mysql_query(ctx->mysql_hdl, query.p)) {
-#endif
-            err = PAM_MYSQL_ERR_DB;
-            goto out;
-        }
+    if (ctx->logspool == NULL && !ctx->logasync) {
+        err = pam_mysql_log_direct(ctx, msg, user, rhost, ev.pid);
+        goto out;
+    }
 
-        err = PAM_MYSQL_ERR_SUCCESS;
+    err = pam_mysql_log_write(ctx, &ev, 1);
 
 out:
-        if (err == PAM_MYSQL_ERR_DB) {
-            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_error(ctx->mysql_hdl));
-        }
+        /* the entry may have gone over the connection for log entries */
+        db = ctx->log_conn != NULL ? ctx->log_conn: ctx;
 
-        pam_mysql_str_destroy(&query);
+        if (err == PAM_MYSQL_ERR_DB && db->mysql_hdl != NULL) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "MySQL error (%s)", mysql_error(db->mysql_hdl));
+        }
 
         if (ctx->verbose) {
             syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_mysql_sql_log() returning %d.", err);
@@ -4815,6 +11970,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t * pamh, int flags,
 {
     int retval;
     int err;
+    pam_mysql_err_t cached;
     const char *user;
     const char *rhost;
     char *passwd = NULL;
@@ -4861,6 +12017,8 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t * pamh, int flags,
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_authenticate() called.");
     }
 
+    pam_mysql_deadline_start(ctx);
+
     /* Get User */
     if ((retval = pam_get_user(pamh, (PAM_GET_USER_CONST char **)&user,
                     NULL))) {
@@ -4899,26 +12057,34 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t * pamh, int flags,
                 goto out;
         }
 
-        switch (pam_mysql_open_db(ctx)) {
-            case PAM_MYSQL_ERR_BUSY:
-            case PAM_MYSQL_ERR_SUCCESS:
-                break;
+        if (pam_mysql_vcache_get(ctx, user, passwd,
+                    !(flags & PAM_DISALLOW_NULL_AUTHTOK), &cached) == 0) {
+            err = cached;
+        } else {
+            switch (pam_mysql_open_db_for_user(ctx, user)) {
+                case PAM_MYSQL_ERR_BUSY:
+                case PAM_MYSQL_ERR_SUCCESS:
+                    break;
 
-            case PAM_MYSQL_ERR_ALLOC:
-                retval = PAM_BUF_ERR;
-                goto out;
+                case PAM_MYSQL_ERR_ALLOC:
+                    retval = PAM_BUF_ERR;
+                    goto out;
 
-            case PAM_MYSQL_ERR_DB:
-                retval = PAM_AUTHINFO_UNAVAIL;
-                goto out;
+                case PAM_MYSQL_ERR_DB:
+                case PAM_MYSQL_ERR_TIMEOUT:
+                    retval = PAM_AUTHINFO_UNAVAIL;
+                    goto out;
 
-            default:
-                retval = PAM_SERVICE_ERR;
-                goto out;
-        }
+                default:
+                    retval = PAM_SERVICE_ERR;
+                    goto out;
+            }
 
-        err = pam_mysql_check_passwd(ctx, user, passwd,
-                !(flags & PAM_DISALLOW_NULL_AUTHTOK));
+            err = pam_mysql_check_passwd(ctx, user, passwd,
+                    !(flags & PAM_DISALLOW_NULL_AUTHTOK));
+            pam_mysql_vcache_put(ctx, user, passwd,
+                    !(flags & PAM_DISALLOW_NULL_AUTHTOK), err);
+        }
 
         if (err == PAM_MYSQL_ERR_SUCCESS) {
             pam_mysql_sql_log(ctx, "AUTHENTICATION SUCCESS (FIRST_PASS)", user, rhost);
@@ -4948,6 +12114,10 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t * pamh, int flags,
                 }
                 break;
 
+            case PAM_MYSQL_ERR_TIMEOUT:
+                retval = PAM_AUTHINFO_UNAVAIL;
+                goto out;
+
             case PAM_MYSQL_ERR_ALLOC:
                 retval = PAM_BUF_ERR;
                 goto out;
@@ -4959,6 +12129,8 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t * pamh, int flags,
     }
 
 askpass:
+    pam_mysql_prefetch_start(ctx, user);
+
     switch (pam_mysql_converse(ctx, &resps, pamh, 1,
                 PAM_PROMPT_ECHO_OFF, PLEASE_ENTER_PASSWORD)) {
         case PAM_MYSQL_ERR_SUCCESS:
@@ -4978,6 +12150,12 @@ askpass:
     resps[0] = NULL;
     xfree(resps);
 
+    /* the connection is ours again */
+    pam_mysql_prefetch_join(ctx);
+
+    /* the time taken to type the password does not count */
+    pam_mysql_deadline_start(ctx);
+
     if (passwd == NULL) {
         if (ctx->verbose) {
             syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "failed to retrieve authentication token.");
@@ -4990,26 +12168,34 @@ askpass:
         (void) pam_set_item(pamh, PAM_AUTHTOK, passwd);
     }
 
-    switch (pam_mysql_open_db(ctx)) {
-        case PAM_MYSQL_ERR_BUSY:
-        case PAM_MYSQL_ERR_SUCCESS:
-            break;
+    if (pam_mysql_vcache_get(ctx, user, passwd,
+                !(flags & PAM_DISALLOW_NULL_AUTHTOK), &cached) == 0) {
+        err = cached;
+    } else {
+        switch (pam_mysql_open_db_for_user(ctx, user)) {
+            case PAM_MYSQL_ERR_BUSY:
+            case PAM_MYSQL_ERR_SUCCESS:
+                break;
 
-        case PAM_MYSQL_ERR_ALLOC:
-            retval = PAM_BUF_ERR;
-            goto out;
+            case PAM_MYSQL_ERR_ALLOC:
+                retval = PAM_BUF_ERR;
+                goto out;
 
-        case PAM_MYSQL_ERR_DB:
-            retval = PAM_AUTHINFO_UNAVAIL;
-            goto out;
+            case PAM_MYSQL_ERR_DB:
+            case PAM_MYSQL_ERR_TIMEOUT:
+                retval = PAM_AUTHINFO_UNAVAIL;
+                goto out;
 
-        default:
-            retval = PAM_SERVICE_ERR;
-            goto out;
-    }
+            default:
+                retval = PAM_SERVICE_ERR;
+                goto out;
+        }
 
-    err = pam_mysql_check_passwd(ctx, user, passwd,
-            !(flags & PAM_DISALLOW_NULL_AUTHTOK));
+        err = pam_mysql_check_passwd(ctx, user, passwd,
+                !(flags & PAM_DISALLOW_NULL_AUTHTOK));
+        pam_mysql_vcache_put(ctx, user, passwd,
+                !(flags & PAM_DISALLOW_NULL_AUTHTOK), err);
+    }
 
     if (err == PAM_MYSQL_ERR_SUCCESS) {
         pam_mysql_sql_log(ctx, "AUTHENTICATION SUCCESS", user, rhost);
@@ -5030,6 +12216,10 @@ askpass:
             retval = PAM_AUTH_ERR;
             goto out;
 
+        case PAM_MYSQL_ERR_TIMEOUT:
+            retval = PAM_AUTHINFO_UNAVAIL;
+            goto out;
+
         case PAM_MYSQL_ERR_ALLOC:
             retval = PAM_BUF_ERR;
             goto out;
@@ -5040,9 +12230,8 @@ askpass:
     }
 
 out:
-    if (ctx->disconnect_every_op) {
-        pam_mysql_close_db(ctx);
-    }
+    pam_mysql_prefetch_join(ctx);
+    pam_mysql_release_db(ctx);
 
     if (passwd != NULL && passwd_is_local) {
         xfree_overwrite(passwd);
@@ -5119,6 +12308,8 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc,
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_acct_mgmt() called.");
     }
 
+    pam_mysql_deadline_start(ctx);
+
     /* Get User */
     if ((retval = pam_get_user(pamh, (PAM_GET_USER_CONST char **)&user,
                     NULL))) {
@@ -5140,7 +12331,9 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc,
             rhost = NULL;
     }
 
-    switch (pam_mysql_open_db(ctx)) {
+    /* no connection is needed for the status fetched along with the password */
+    switch (pam_mysql_stat_cache_get(ctx, user, &stat) == 0 ?
+            PAM_MYSQL_ERR_SUCCESS: pam_mysql_open_db_for_user(ctx, user)) {
         case PAM_MYSQL_ERR_BUSY:
         case PAM_MYSQL_ERR_SUCCESS:
             break;
@@ -5150,6 +12343,7 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc,
             goto out;
 
         case PAM_MYSQL_ERR_DB:
+        case PAM_MYSQL_ERR_TIMEOUT:
             retval = PAM_AUTHINFO_UNAVAIL;
             goto out;
 
@@ -5175,6 +12369,10 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc,
             retval = PAM_USER_UNKNOWN;
             goto out;
 
+        case PAM_MYSQL_ERR_TIMEOUT:
+            retval = PAM_AUTHINFO_UNAVAIL;
+            goto out;
+
         case PAM_MYSQL_ERR_ALLOC:
             retval = PAM_BUF_ERR;
             goto out;
@@ -5199,9 +12397,7 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc,
     }
 
 out:
-    if (ctx->disconnect_every_op) {
-        pam_mysql_close_db(ctx);
-    }
+    pam_mysql_release_db(ctx);
 
     if (ctx->verbose) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_acct_mgmt() returning %i.",retval);
@@ -5304,6 +12500,8 @@ PAM_EXTERN int pam_sm_chauthtok(pam_handle_t *pamh,int flags,int argc,
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_chauthtok() called.");
     }
 
+    pam_mysql_deadline_start(ctx);
+
     /* Get User */
     if ((retval = pam_get_user(pamh, (PAM_GET_USER_CONST char **)&user,
                     NULL))) {
@@ -5348,6 +12546,7 @@ PAM_EXTERN int pam_sm_chauthtok(pam_handle_t *pamh,int flags,int argc,
                 goto out;
 
             case PAM_MYSQL_ERR_DB:
+            case PAM_MYSQL_ERR_TIMEOUT:
                 retval = PAM_PERM_DENIED;
                 goto out;
 
@@ -5604,9 +12803,7 @@ PAM_EXTERN int pam_sm_chauthtok(pam_handle_t *pamh,int flags,int argc,
     }
 
 out:
-    if (ctx->disconnect_every_op) {
-        pam_mysql_close_db(ctx);
-    }
+    pam_mysql_release_db(ctx);
 
     if (new_passwd != NULL && new_passwd_is_local) {
         xfree_overwrite(new_passwd);
@@ -5689,6 +12886,8 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc,
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_open_session() called.");
     }
 
+    pam_mysql_deadline_start(ctx);
+
     /* Get User */
     if ((retval = pam_get_user(pamh, (PAM_GET_USER_CONST char **)&user,
                     NULL))) {
@@ -5720,6 +12919,7 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc,
             goto out;
 
         case PAM_MYSQL_ERR_DB:
+        case PAM_MYSQL_ERR_TIMEOUT:
             retval = PAM_AUTHINFO_UNAVAIL;
             goto out;
 
@@ -5731,9 +12931,7 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc,
     pam_mysql_sql_log(ctx, "OPEN SESSION", user, rhost);
 
 out:
-    if (ctx->disconnect_every_op) {
-        pam_mysql_close_db(ctx);
-    }
+    pam_mysql_release_db(ctx);
 
     if (ctx->verbose) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_open_session() returning %i.", retval);
@@ -5806,6 +13004,8 @@ PAM_EXTERN int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_close_session() called.");
     }
 
+    pam_mysql_deadline_start(ctx);
+
     /* Get User */
     if ((retval = pam_get_user(pamh, (PAM_GET_USER_CONST char **)&user,
                     NULL))) {
@@ -5837,6 +13037,7 @@ PAM_EXTERN int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
             goto out;
 
         case PAM_MYSQL_ERR_DB:
+        case PAM_MYSQL_ERR_TIMEOUT:
             retval = PAM_AUTHINFO_UNAVAIL;
             goto out;
 
@@ -5846,11 +13047,10 @@ PAM_EXTERN int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
     }
 
     pam_mysql_sql_log(ctx, "CLOSE SESSION", user, rhost);
+    pam_mysql_log_flush(ctx, NULL);
 
 out:
-    if (ctx->disconnect_every_op) {
-        pam_mysql_close_db(ctx);
-    }
+    pam_mysql_release_db(ctx);
 
     if (ctx->verbose) {
         syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "pam_sm_close_session() returning %i.", retval);
@@ -0,0 +1,101 @@
+/*
+ * pam_mysql_bench - time password verification in the PAM module for MySQL
+ *
+ * Copyright (C) 2015-2017 Nigel Cunningham and contributors.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Built by "make check" but not run by it, as the results depend on the
+ * machine. Prints the time one verification of a Drupal 7 hash takes, for
+ * the SHA-512 ("$S$") and MD5 ("$P$") variants at the default count of
+ * Drupal 7 ('D', 2^15 rounds):
+ *
+ *   ./pam_mysql_bench [verifications]
+ *
+ * The program is built from the module sources so that it times the very
+ * code the module runs.
+ */
+
+#include "pam_mysql.c"
+
+#if defined(HAVE_PAM_MYSQL_SHA1_DATA) && defined(HAVE_PAM_MYSQL_MD5_DATA)
+/**
+ * Time the verification of a password against a stored hash.
+ *
+ * @param const char *name
+ *   The name of the variant, for the report.
+ * @param char *stored
+ *   The stored hash; its setting string is used.
+ * @param int n
+ *   The number of verifications.
+ *
+ * @return int
+ *   0 on success, -1 if a verification failed.
+ */
+static int pam_mysql_bench_drupal7(const char *name, char *stored, int n)
+{
+    static const char passwd[] = "correct horse battery staple";
+    char md[DRUPAL_HASH_LENGTH + 1];
+    struct timeval start, end;
+    double us;
+    int i;
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < n; i++) {
+        if (pam_mysql_drupal7_data((const unsigned char *)passwd,
+                    sizeof(passwd) - 1, md, stored) == NULL) {
+            fprintf(stderr, "pam_mysql_bench: %s: verification failed\n", name);
+            return -1;
+        }
+    }
+
+    gettimeofday(&end, NULL);
+
+    us = (double)(end.tv_sec - start.tv_sec) * 1e6 + (double)(end.tv_usec - start.tv_usec);
+    printf("%-14s %10.1f us per verification (%d runs)\n", name, us / n, n);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char sha512[DRUPAL_HASH_LENGTH + 1] = "$S$DpamMySQL";
+    char md5[DRUPAL_HASH_LENGTH + 1] = "$P$DpamMySQL";
+    int n = argc > 1 ? atoi(argv[1]): 100;
+
+    if (n <= 0) {
+        fprintf(stderr, "usage: pam_mysql_bench [verifications]\n");
+        return 1;
+    }
+
+    openlog("pam_mysql_bench", LOG_PID | LOG_PERROR, LOG_AUTHPRIV);
+
+    if (pam_mysql_bench_drupal7("drupal7 $S$D", sha512, n) ||
+            pam_mysql_bench_drupal7("drupal7 $P$D", md5, n)) {
+        return 1;
+    }
+
+    return 0;
+}
+#else
+int main(int argc, char **argv)
+{
+    fprintf(stderr, "pam_mysql_bench: built without Drupal 7 hashes\n");
+
+    return 1;
+}
+#endif
@@ -0,0 +1,351 @@
+/*
+ * pam_mysql_snapshot - export the users table for the PAM module for MySQL
+ *
+ * Copyright (C) 2015-2017 Nigel Cunningham and contributors.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Writes the user names, passwords and statuses selected by the module
+ * arguments to the file named by the "snapshot" option, from which the
+ * module then answers authentication and account checks without a server
+ * round trip. Meant to be run periodically, e.g. from cron; the new file is
+ * renamed over the old one so readers never see a partial snapshot.
+ *
+ * The program is built from the module sources so that both agree on the
+ * options and on the file format.
+ */
+
+#include "pam_mysql.c"
+
+typedef struct _pam_mysql_snapshot_entry_t {
+    unsigned int hash;
+    unsigned int off;
+} pam_mysql_snapshot_entry_t;
+
+static void pam_mysql_snapshot_usage(void)
+{
+    fprintf(stderr, "usage: pam_mysql_snapshot [-o file] module-arguments...\n"
+            "  -o file  write to file instead of the snapshot option\n");
+}
+
+/**
+ * Read the users table.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_str_t *recs
+ *   Receives the records, laid out as in the file, from offset 0.
+ * @param pam_mysql_snapshot_entry_t **pentries
+ *   Receives the hash and offset of each record.
+ * @param unsigned int *pn
+ *   Receives the number of records.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_snapshot_read(pam_mysql_ctx_t *ctx,
+        pam_mysql_str_t *recs, pam_mysql_snapshot_entry_t **pentries,
+        unsigned int *pn)
+{
+    pam_mysql_err_t err = PAM_MYSQL_ERR_SUCCESS;
+    pam_mysql_snapshot_entry_t *entries = NULL;
+    unsigned int n = 0, cap = 0;
+    pam_mysql_str_t query;
+    MYSQL_RES *result = NULL;
+    MYSQL_ROW row;
+    unsigned long *lens;
+
+    if ((err = pam_mysql_str_init(&query, 1))) {
+        return err;
+    }
+
+    err = pam_mysql_format_string(ctx, &query,
+            (ctx->where == NULL ?
+             "SELECT %[usercolumn], %[passwdcolumn], %[statcolumn] FROM %[table]":
+             "SELECT %[usercolumn], %[passwdcolumn], %[statcolumn] FROM %[table] WHERE (%S)"),
+            1, ctx->where);
+    if (err) {
+        goto out;
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY
+    if (mysql_real_query(ctx->mysql_hdl, query.p, query.len) ||
+#else
+    if (mysql_query(ctx->mysql_hdl, query.p) ||
+#endif
+            NULL == (result = mysql_use_result(ctx->mysql_hdl))) {
+        fprintf(stderr, "pam_mysql_snapshot: %s\n", mysql_error(ctx->mysql_hdl));
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+    while (NULL != (row = mysql_fetch_row(result))) {
+        pam_mysql_snapshot_rec_t r;
+        static const char pad[4] = { 0 };
+
+        lens = mysql_fetch_lengths(result);
+
+        if (row[0] == NULL || lens[0] == 0 || memchr(row[0], '\0', lens[0]) != NULL ||
+                lens[0] + lens[1] + lens[2] + 3 > PAM_MYSQL_REC_MAX) {
+            fprintf(stderr, "pam_mysql_snapshot: skipping a row that cannot be stored\n");
+            continue;
+        }
+
+        if (n == cap) {
+            pam_mysql_snapshot_entry_t *p;
+
+            cap = cap == 0 ? 1024: cap * 2;
+            if (NULL == (p = xrealloc(entries, cap, sizeof(*entries)))) {
+                err = PAM_MYSQL_ERR_ALLOC;
+                goto out;
+            }
+            entries = p;
+        }
+
+        r.user_len = (unsigned int)lens[0];
+        r.passwd_len = row[1] == NULL ? -1: (int)lens[1];
+        r.stat_len = row[2] == NULL ? -1: (int)lens[2];
+
+        entries[n].hash = (unsigned int)pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, row[0]);
+        entries[n].off = (unsigned int)recs->len;
+
+        if ((err = pam_mysql_str_append(recs, (const char *)&r, sizeof(r))) ||
+                (err = pam_mysql_str_append(recs, row[0], lens[0] + 1)) ||
+                (row[1] != NULL && (err = pam_mysql_str_append(recs, row[1], lens[1] + 1))) ||
+                (row[2] != NULL && (err = pam_mysql_str_append(recs, row[2], lens[2] + 1))) ||
+                (err = pam_mysql_str_append(recs, pad, (4 - recs->len % 4) % 4))) {
+            goto out;
+        }
+
+        if (recs->len > 0x7fffffff) {
+            fprintf(stderr, "pam_mysql_snapshot: too many users for one snapshot\n");
+            err = PAM_MYSQL_ERR_INVAL;
+            goto out;
+        }
+
+        n++;
+    }
+
+    if (mysql_errno(ctx->mysql_hdl)) {
+        fprintf(stderr, "pam_mysql_snapshot: %s\n", mysql_error(ctx->mysql_hdl));
+        err = PAM_MYSQL_ERR_DB;
+        goto out;
+    }
+
+out:
+    if (result != NULL) {
+        mysql_free_result(result);
+    }
+
+    pam_mysql_str_destroy(&query);
+
+    if (err) {
+        xfree(entries);
+        entries = NULL;
+        n = 0;
+    }
+
+    *pentries = entries;
+    *pn = n;
+
+    return err;
+}
+
+/**
+ * Write a snapshot next to path and rename it over path.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param const char *path
+ *   The snapshot file.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysql_snapshot_write(pam_mysql_ctx_t *ctx,
+        const char *path)
+{
+    pam_mysql_err_t err;
+    pam_mysql_snapshot_header_t hdr;
+    pam_mysql_snapshot_bucket_t *buckets = NULL;
+    pam_mysql_snapshot_entry_t *entries = NULL;
+    pam_mysql_str_t recs;
+    size_t base;
+    char *tmp = NULL;
+    unsigned int n, i, j, nbuckets, nwritten = 0;
+    int fd = -1;
+    FILE *fp = NULL;
+
+    if ((err = pam_mysql_str_init(&recs, 1))) {
+        return err;
+    }
+
+    if ((err = pam_mysql_snapshot_read(ctx, &recs, &entries, &n))) {
+        goto out;
+    }
+
+    /* keep the table at most half full */
+    for (nbuckets = 16; nbuckets < n * 2; nbuckets *= 2);
+
+    if (NULL == (buckets = xcalloc(nbuckets, sizeof(*buckets)))) {
+        err = PAM_MYSQL_ERR_ALLOC;
+        goto out;
+    }
+
+    base = sizeof(hdr) + (size_t)nbuckets * sizeof(*buckets);
+
+    for (i = 0; i < n; i++) {
+        const pam_mysql_snapshot_rec_t *r = (const pam_mysql_snapshot_rec_t *)(recs.p + entries[i].off);
+        const char *user = (const char *)(r + 1);
+
+        for (j = entries[i].hash & (nbuckets - 1); buckets[j].off != 0; j = (j + 1) & (nbuckets - 1)) {
+            const pam_mysql_snapshot_rec_t *o = (const pam_mysql_snapshot_rec_t *)(recs.p + buckets[j].off - base);
+
+            if (buckets[j].hash == entries[i].hash && strcmp((const char *)(o + 1), user) == 0) {
+                break;
+            }
+        }
+
+        if (buckets[j].off != 0) {
+            fprintf(stderr, "pam_mysql_snapshot: user %s appears more than once; keeping the first row\n", user);
+            continue;
+        }
+
+        buckets[j].hash = entries[i].hash;
+        buckets[j].off = (unsigned int)(base + entries[i].off);
+        nwritten++;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PAM_MYSQL_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.byte_order = PAM_MYSQL_SNAPSHOT_BYTE_ORDER;
+    hdr.nbuckets = nbuckets;
+    hdr.nrecords = nwritten;
+    hdr.scope = pam_mysql_snapshot_scope(ctx);
+    hdr.created = (long long)time(NULL);
+
+    if (NULL == (tmp = xcalloc(strlen(path) + sizeof(".XXXXXX"), 1))) {
+        err = PAM_MYSQL_ERR_ALLOC;
+        goto out;
+    }
+
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    if ((fd = mkstemp(tmp)) < 0 || fchmod(fd, S_IRUSR | S_IWUSR) < 0 ||
+            NULL == (fp = fdopen(fd, "wb"))) {
+        fprintf(stderr, "pam_mysql_snapshot: %s: %s\n", tmp, strerror(errno));
+        err = PAM_MYSQL_ERR_IO;
+        goto out;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            fwrite(buckets, sizeof(*buckets), nbuckets, fp) != nbuckets ||
+            (recs.len > 0 && fwrite(recs.p, recs.len, 1, fp) != 1) ||
+            fflush(fp) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "pam_mysql_snapshot: %s: %s\n", tmp, strerror(errno));
+        err = PAM_MYSQL_ERR_IO;
+        goto out;
+    }
+
+    fclose(fp);
+    fp = NULL;
+    fd = -1;
+
+    if (rename(tmp, path) < 0) {
+        fprintf(stderr, "pam_mysql_snapshot: %s: %s\n", path, strerror(errno));
+        err = PAM_MYSQL_ERR_IO;
+        goto out;
+    }
+
+    xfree(tmp);
+    tmp = NULL;
+
+    if (ctx->verbose) {
+        fprintf(stderr, "pam_mysql_snapshot: wrote %u users to %s\n", nwritten, path);
+    }
+
+out:
+    if (fp != NULL) {
+        fclose(fp);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (tmp != NULL) {
+        unlink(tmp);
+        xfree(tmp);
+    }
+
+    xfree(buckets);
+    xfree(entries);
+    pam_mysql_str_destroy(&recs);
+
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    pam_mysql_err_t err;
+    pam_mysql_ctx_t *ctx;
+    const char *path = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:")) != -1) {
+        switch (c) {
+            case 'o':
+                path = optarg;
+                break;
+
+            default:
+                pam_mysql_snapshot_usage();
+                return 1;
+        }
+    }
+
+    openlog("pam_mysql_snapshot", LOG_PID | LOG_PERROR, LOG_AUTHPRIV);
+
+    if (NULL == (ctx = xcalloc(1, sizeof(*ctx))) ||
+            pam_mysql_init_ctx(ctx) ||
+            pam_mysql_parse_args(ctx, argc - optind, (const char **)argv + optind)) {
+        return 1;
+    }
+
+    if (ctx->config_file != NULL &&
+            pam_mysql_read_config_file(ctx, ctx->config_file) == PAM_MYSQL_ERR_ALLOC) {
+        return 1;
+    }
+
+    if (path == NULL && (path = ctx->snapshot) == NULL) {
+        pam_mysql_snapshot_usage();
+        return 1;
+    }
+
+    /* always read from the server itself */
+    xfree(ctx->daemon_socket);
+    ctx->daemon_socket = NULL;
+    xfree(ctx->shm_cache);
+    ctx->shm_cache = NULL;
+
+    if ((err = pam_mysql_open_db(ctx)) && err != PAM_MYSQL_ERR_BUSY) {
+        return 1;
+    }
+
+    err = pam_mysql_snapshot_write(ctx, path);
+
+    pam_mysql_release_ctx(ctx);
+
+    return err == PAM_MYSQL_ERR_SUCCESS ? 0: 1;
+}
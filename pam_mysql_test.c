@@ -0,0 +1,463 @@
+/*
+ * pam_mysql_test - checks of the PAM module for MySQL that need no server
+ *
+ * Copyright (C) 2015-2017 Nigel Cunningham and contributors.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Run by "make check". Covers the option fingerprints, the formats of the
+ * shared cache, the snapshot and the spool file, and the ordering of the
+ * host list. Files are made in a private directory under $TMPDIR.
+ *
+ * The program is built from the module sources so that it checks the very
+ * code the module runs.
+ */
+
+#include "pam_mysql.c"
+
+static int pam_mysql_test_failures = 0;
+
+#define PAM_MYSQL_TEST(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+                    __FILE__, __LINE__, __func__, #cond); \
+            pam_mysql_test_failures++; \
+        } \
+    } while (0)
+
+static char pam_mysql_test_dir[256];
+
+/**
+ * Make a context with the default options.
+ *
+ * @return pam_mysql_ctx_t *
+ *   The context; the program exits on failure.
+ */
+static pam_mysql_ctx_t *pam_mysql_test_ctx(void)
+{
+    pam_mysql_ctx_t *ctx;
+
+    if (NULL == (ctx = xcalloc(1, sizeof(*ctx))) || pam_mysql_init_ctx(ctx)) {
+        fprintf(stderr, "pam_mysql_test: unable to make a context\n");
+        exit(1);
+    }
+
+    return ctx;
+}
+
+/**
+ * Get the path of a file in the directory of the test.
+ *
+ * @param char *buf
+ *   Receives the path; sizeof(pam_mysql_test_dir) + 32 bytes.
+ * @param const char *name
+ *   The name of the file.
+ *
+ * @return char *
+ *   buf.
+ */
+static char *pam_mysql_test_path(char *buf, const char *name)
+{
+    sprintf(buf, "%s/%s", pam_mysql_test_dir, name);
+
+    return buf;
+}
+
+static void pam_mysql_test_hash(void)
+{
+    pam_mysql_ctx_t *a, *b;
+    unsigned long long h;
+
+    /* FNV-1a test vectors */
+    PAM_MYSQL_TEST(pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT, "", 0) == 0xcbf29ce484222325ULL);
+    PAM_MYSQL_TEST(pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT, "a", 1) == 0xaf63dc4c8601ec8cULL);
+    PAM_MYSQL_TEST(pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT, "foobar", 6) == 0x85944171f73967e8ULL);
+
+    /* strings are delimited, and NULL is not "" */
+    h = pam_mysql_hash_str(pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, "ab"), "c");
+    PAM_MYSQL_TEST(h != pam_mysql_hash_str(pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, "a"), "bc"));
+    PAM_MYSQL_TEST(pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, NULL) !=
+            pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, ""));
+
+    /* keys of hosts are never 0, as 0 marks a free breaker */
+    PAM_MYSQL_TEST(pam_mysql_host_key(NULL) != 0);
+    PAM_MYSQL_TEST(pam_mysql_host_key(NULL) == pam_mysql_host_key(""));
+    PAM_MYSQL_TEST(pam_mysql_host_key("a") != pam_mysql_host_key("b"));
+
+    a = pam_mysql_test_ctx();
+    b = pam_mysql_test_ctx();
+
+    PAM_MYSQL_TEST(pam_mysql_conn_fingerprint(a) == pam_mysql_conn_fingerprint(b));
+    PAM_MYSQL_TEST(pam_mysql_shm_key(a, "alice") == pam_mysql_shm_key(b, "alice"));
+    PAM_MYSQL_TEST(pam_mysql_shm_key(a, "alice") != pam_mysql_shm_key(a, "bob"));
+
+    b->read_timeout = 7;
+    PAM_MYSQL_TEST(pam_mysql_conn_fingerprint(a) != pam_mysql_conn_fingerprint(b));
+
+    /* logpiggyback only matters where it applies */
+    b->read_timeout = a->read_timeout;
+    b->logpiggyback = 1;
+    b->logasync = 1;
+    PAM_MYSQL_TEST(pam_mysql_conn_fingerprint(a) == pam_mysql_conn_fingerprint(b));
+
+    /* the scope of a snapshot ignores the connection options */
+    PAM_MYSQL_TEST(pam_mysql_snapshot_scope(a) == pam_mysql_snapshot_scope(b));
+    xfree(b->where);
+    b->where = xstrdup("active = 1");
+    PAM_MYSQL_TEST(pam_mysql_snapshot_scope(a) != pam_mysql_snapshot_scope(b));
+
+    pam_mysql_release_ctx(a);
+    pam_mysql_release_ctx(b);
+}
+
+static void pam_mysql_test_shm(void)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(__GNUC__)
+    pam_mysql_ctx_t *ctx;
+    pam_mysql_user_rec_t rec;
+    pam_mysql_shm_header_t *hdr;
+    char path[sizeof(pam_mysql_test_dir) + 32];
+
+    ctx = pam_mysql_test_ctx();
+    ctx->shm_cache = xstrdup(pam_mysql_test_path(path, "shm"));
+    ctx->shm_cache_entries = 64;
+
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "alice", 60, &rec) == -1);
+
+    pam_mysql_shm_store(ctx, "alice", 0, "hash", NULL);
+    pam_mysql_shm_store(ctx, "bob", 0, NULL, "1");
+
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "alice", 60, &rec) == 0);
+    PAM_MYSQL_TEST(rec.row[0] != NULL && strcmp(rec.row[0], "hash") == 0);
+    PAM_MYSQL_TEST(rec.row[1] == NULL);
+
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "bob", 60, &rec) == 0);
+    PAM_MYSQL_TEST(rec.row[0] == NULL);
+    PAM_MYSQL_TEST(rec.row[1] != NULL && strcmp(rec.row[1], "1") == 0);
+
+    /* a prefix of a stored name is another user */
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "ali", 60, &rec) == -1);
+
+    pam_mysql_shm_store(ctx, "alice", 1, NULL, NULL);
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "alice", 60, &rec) == -1);
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "bob", 60, &rec) == 0);
+
+    hdr = (pam_mysql_shm_header_t *)pam_mysql_shm.base;
+    PAM_MYSQL_TEST(hdr != NULL && hdr->magic == PAM_MYSQL_SHM_MAGIC &&
+            hdr->version == PAM_MYSQL_SHM_VERSION && hdr->nslots == 64);
+
+    /* the records outlive the mapping */
+    pam_mysql_shm_detach();
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "bob", 60, &rec) == 0);
+
+    /* a file of another version is not used */
+    if (pam_mysql_shm.base != NULL) {
+        hdr = (pam_mysql_shm_header_t *)pam_mysql_shm.base;
+        hdr->version = PAM_MYSQL_SHM_VERSION - 1;
+    }
+    pam_mysql_shm_detach();
+    PAM_MYSQL_TEST(pam_mysql_shm_get(ctx, "bob", 60, &rec) == -1);
+
+    pam_mysql_shm_detach();
+    unlink(path);
+    pam_mysql_release_ctx(ctx);
+#endif
+}
+
+/**
+ * Write a snapshot file of one user.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   The context the snapshot is made for.
+ * @param const char *path
+ *   The file.
+ * @param mode_t mode
+ *   The permissions of the file.
+ */
+static void pam_mysql_test_snapshot_write(pam_mysql_ctx_t *ctx,
+        const char *path, mode_t mode)
+{
+    struct {
+        pam_mysql_snapshot_header_t hdr;
+        pam_mysql_snapshot_bucket_t buckets[16];
+        pam_mysql_snapshot_rec_t rec;
+        char data[16];
+    } f;
+    unsigned int hash = (unsigned int)pam_mysql_hash_str(PAM_MYSQL_HASH_INIT, "alice");
+    FILE *fp;
+
+    memset(&f, 0, sizeof(f));
+    memcpy(f.hdr.magic, PAM_MYSQL_SNAPSHOT_MAGIC, sizeof(f.hdr.magic));
+    f.hdr.byte_order = PAM_MYSQL_SNAPSHOT_BYTE_ORDER;
+    f.hdr.nbuckets = 16;
+    f.hdr.nrecords = 1;
+    f.hdr.scope = pam_mysql_snapshot_scope(ctx);
+    f.hdr.created = (long long)time(NULL);
+    f.buckets[hash & 15].hash = hash;
+    f.buckets[hash & 15].off = (unsigned int)((char *)&f.rec - (char *)&f);
+    f.rec.user_len = 5;
+    f.rec.passwd_len = 4;
+    f.rec.stat_len = -1;
+    memcpy(f.data, "alice\0hash", 11);
+
+    unlink(path);
+    if (NULL == (fp = fopen(path, "wb")) || fwrite(&f, sizeof(f), 1, fp) != 1 ||
+            fclose(fp) != 0 || chmod(path, mode) != 0) {
+        fprintf(stderr, "pam_mysql_test: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void pam_mysql_test_snapshot(void)
+{
+#ifdef HAVE_SYS_MMAN_H
+    pam_mysql_ctx_t *ctx;
+    pam_mysql_user_rec_t rec;
+    char path[sizeof(pam_mysql_test_dir) + 32];
+    char link_path[sizeof(pam_mysql_test_dir) + 32];
+
+    ctx = pam_mysql_test_ctx();
+    ctx->snapshot = xstrdup(pam_mysql_test_path(path, "snapshot"));
+
+    pam_mysql_test_snapshot_write(ctx, path, 0600);
+
+    PAM_MYSQL_TEST(pam_mysql_snapshot_get(ctx, "alice", &rec) == PAM_MYSQL_ERR_SUCCESS);
+    PAM_MYSQL_TEST(rec.row[0] != NULL && strcmp(rec.row[0], "hash") == 0);
+    PAM_MYSQL_TEST(rec.row[1] == NULL);
+    PAM_MYSQL_TEST(pam_mysql_snapshot_get(ctx, "bob", &rec) == PAM_MYSQL_ERR_NO_ENTRY);
+
+    /* made with other options */
+    xfree(ctx->where);
+    ctx->where = xstrdup("active = 1");
+    PAM_MYSQL_TEST(pam_mysql_snapshot_get(ctx, "alice", &rec) == PAM_MYSQL_ERR_NOTIMPL);
+    xfree(ctx->where);
+    ctx->where = NULL;
+
+    /* writable by others */
+    pam_mysql_snapshot_detach();
+    pam_mysql_test_snapshot_write(ctx, path, 0622);
+    PAM_MYSQL_TEST(pam_mysql_snapshot_get(ctx, "alice", &rec) == PAM_MYSQL_ERR_NOTIMPL);
+
+    /* a link to a good one */
+    pam_mysql_test_snapshot_write(ctx, path, 0600);
+    xfree(ctx->snapshot);
+    ctx->snapshot = xstrdup(pam_mysql_test_path(link_path, "snapshot.link"));
+    PAM_MYSQL_TEST(symlink(path, link_path) == 0);
+    PAM_MYSQL_TEST(pam_mysql_snapshot_get(ctx, "alice", &rec) == PAM_MYSQL_ERR_NOTIMPL);
+
+    pam_mysql_snapshot_detach();
+    unlink(link_path);
+    unlink(path);
+    pam_mysql_release_ctx(ctx);
+#endif
+}
+
+static void pam_mysql_test_spool(void)
+{
+    pam_mysql_ctx_t *ctx;
+    pam_mysql_log_event_t ev[2];
+#ifdef HAVE_PTHREAD_H
+    pam_mysql_log_event_t out;
+#endif
+    pam_mysql_spool_rec_t recs[3];
+    char path[sizeof(pam_mysql_test_dir) + 32];
+    int fd;
+
+    ctx = pam_mysql_test_ctx();
+    ctx->logspool = xstrdup(pam_mysql_test_path(path, "spool"));
+
+    memset(ev, 0, sizeof(ev));
+    strcpy(ev[0].msg, "AUTHENTICATION SUCCESS");
+    strcpy(ev[0].user, "alice");
+    strcpy(ev[0].rhost, "client.example.com");
+    ev[0].pid = 42;
+    ev[0].stamp = 1000000000;
+    ev[1] = ev[0];
+    strcpy(ev[1].msg, "OPEN SESSION");
+
+    PAM_MYSQL_TEST(pam_mysql_spool_append(ctx, ev, 2) == PAM_MYSQL_ERR_SUCCESS);
+
+    memset(recs, 0, sizeof(recs));
+    PAM_MYSQL_TEST((fd = open(path, O_RDONLY)) >= 0);
+    PAM_MYSQL_TEST(read(fd, recs, sizeof(recs)) == (ssize_t)(2 * sizeof(recs[0])));
+    close(fd);
+
+    PAM_MYSQL_TEST(recs[0].magic == PAM_MYSQL_SPOOL_MAGIC &&
+            recs[1].magic == PAM_MYSQL_SPOOL_MAGIC);
+
+    /* only the log writer replays the spool */
+#ifdef HAVE_PTHREAD_H
+    PAM_MYSQL_TEST(pam_mysql_spool_parse(&recs[0], &out) == 0);
+    PAM_MYSQL_TEST(strcmp(out.msg, "AUTHENTICATION SUCCESS") == 0 &&
+            strcmp(out.user, "alice") == 0 && strcmp(out.rhost, "client.example.com") == 0 &&
+            out.pid == 42 && out.stamp == 1000000000);
+    PAM_MYSQL_TEST(pam_mysql_spool_parse(&recs[1], &out) == 0);
+    PAM_MYSQL_TEST(strcmp(out.msg, "OPEN SESSION") == 0);
+
+    /* a torn or overwritten record */
+    recs[1].ev.user[0] = 'A';
+    PAM_MYSQL_TEST(pam_mysql_spool_parse(&recs[1], &out) == -1);
+    PAM_MYSQL_TEST(pam_mysql_spool_parse(&recs[2], &out) == -1);
+
+    /* fields are terminated even if the record says otherwise */
+    memset(recs[1].ev.user, 'x', sizeof(recs[1].ev.user));
+    recs[1].sum = pam_mysql_hash_mem(PAM_MYSQL_HASH_INIT,
+            (const char *)&recs[1].ev, sizeof(recs[1].ev));
+    PAM_MYSQL_TEST(pam_mysql_spool_parse(&recs[1], &out) == 0);
+    PAM_MYSQL_TEST(strlen(out.user) == sizeof(out.user) - 1);
+
+    /* replayed already */
+    recs[0].magic = PAM_MYSQL_SPOOL_DONE;
+    PAM_MYSQL_TEST(pam_mysql_spool_parse(&recs[0], &out) == 1);
+#endif
+
+    unlink(path);
+    pam_mysql_release_ctx(ctx);
+}
+
+static void pam_mysql_test_hosts(void)
+{
+    pam_mysql_ctx_t *ctx;
+    pam_mysql_host_t hosts[PAM_MYSQL_HOSTS_MAX];
+    pam_mysql_breaker_t *b;
+    struct timeval start;
+    char buf[PAM_MYSQL_HOSTS_MAX * 8];
+    int n, i;
+
+    ctx = pam_mysql_test_ctx();
+
+    strcpy(buf, "db1:3307, db2 ,, /run/mysqld.sock");
+    n = pam_mysql_split_hosts(ctx, buf, hosts);
+    PAM_MYSQL_TEST(n == 3);
+    PAM_MYSQL_TEST(n == 3 && strcmp(hosts[0].spec, "db1:3307") == 0 &&
+            hosts[0].port == 3307 && hosts[0].socket == NULL);
+    PAM_MYSQL_TEST(n == 3 && strcmp(hosts[1].spec, "db2") == 0 && hosts[1].port == 0);
+    PAM_MYSQL_TEST(n == 3 && hosts[2].socket != NULL &&
+            strcmp(hosts[2].socket, "/run/mysqld.sock") == 0);
+
+    /* the default when nothing is given */
+    PAM_MYSQL_TEST(pam_mysql_split_hosts(ctx, NULL, hosts) == 1 && hosts[0].spec == NULL);
+
+    /* every member of a full list keeps a breaker of its own */
+    for (buf[0] = '\0', i = 0; i < PAM_MYSQL_HOSTS_MAX; i++) {
+        sprintf(buf + strlen(buf), "%sh%d", i > 0 ? ",": "", i);
+    }
+    PAM_MYSQL_TEST(pam_mysql_split_hosts(ctx, buf, hosts) == PAM_MYSQL_HOSTS_MAX);
+    for (i = 0; i < PAM_MYSQL_HOSTS_MAX; i++) {
+        hosts[i].breaker->latency = 1000 + i;
+    }
+    for (buf[0] = '\0', i = 0; i < PAM_MYSQL_HOSTS_MAX; i++) {
+        sprintf(buf + strlen(buf), "%sh%d", i > 0 ? ",": "", i);
+    }
+    pam_mysql_split_hosts(ctx, buf, hosts);
+    for (i = 0; i < PAM_MYSQL_HOSTS_MAX; i++) {
+        PAM_MYSQL_TEST(hosts[i].breaker->latency == (unsigned int)(1000 + i));
+    }
+
+    /* faster hosts first, failed ones last */
+    pam_mysql_breaker(ctx, pam_mysql_host_key("a"))->latency = 300;
+    pam_mysql_breaker(ctx, pam_mysql_host_key("b"))->latency = 100;
+    pam_mysql_breaker(ctx, pam_mysql_host_key("c"))->latency = 200;
+    strcpy(buf, "a,b,c");
+    n = pam_mysql_split_hosts(ctx, buf, hosts);
+    PAM_MYSQL_TEST(n == 3 && strcmp(hosts[0].spec, "b") == 0 &&
+            strcmp(hosts[1].spec, "c") == 0 && strcmp(hosts[2].spec, "a") == 0);
+
+    pam_mysql_breaker(ctx, pam_mysql_host_key("b"))->failures = 1;
+    strcpy(buf, "a,b,c");
+    n = pam_mysql_split_hosts(ctx, buf, hosts);
+    PAM_MYSQL_TEST(n == 3 && strcmp(hosts[0].spec, "c") == 0 &&
+            strcmp(hosts[1].spec, "a") == 0 && strcmp(hosts[2].spec, "b") == 0);
+
+    /* the first sample is taken as is, then weighs 1/8 */
+    b = pam_mysql_breaker(ctx, pam_mysql_host_key("d"));
+    gettimeofday(&start, NULL);
+    start.tv_sec -= 1;
+    pam_mysql_host_sample(b, &start);
+    PAM_MYSQL_TEST(b->samples == 1 && b->latency >= 1000000 && b->latency < 1500000);
+    b->latency = 800000;
+    gettimeofday(&start, NULL);
+    pam_mysql_host_sample(b, &start);
+    PAM_MYSQL_TEST(b->samples == 2 && b->latency >= 700000 && b->latency < 750000);
+
+    pam_mysql_release_ctx(ctx);
+}
+
+static void pam_mysql_test_breaker(void)
+{
+    pam_mysql_ctx_t *ctx;
+    pam_mysql_breaker_t *b;
+
+    ctx = pam_mysql_test_ctx();
+    ctx->outage_threshold = 2;
+    ctx->outage_retry = 60;
+
+    b = pam_mysql_breaker(ctx, pam_mysql_host_key("e"));
+    PAM_MYSQL_TEST(b == pam_mysql_breaker(ctx, pam_mysql_host_key("e")));
+    PAM_MYSQL_TEST(pam_mysql_breaker_allow(ctx, b));
+
+    pam_mysql_breaker_failure(ctx, b, "e");
+    PAM_MYSQL_TEST(b->down_since != 0 && pam_mysql_breaker_allow(ctx, b));
+
+    pam_mysql_breaker_failure(ctx, b, "e");
+    PAM_MYSQL_TEST(!pam_mysql_breaker_allow(ctx, b));
+
+    /* once the retry time has come, a single attempt is let through */
+    b->retry_at = (long long)time(NULL) - 1;
+    PAM_MYSQL_TEST(pam_mysql_breaker_allow(ctx, b));
+    PAM_MYSQL_TEST(!pam_mysql_breaker_allow(ctx, b));
+
+    /* a retry time too far ahead means the clock went back */
+    b->retry_at = (long long)time(NULL) + 10 * ctx->outage_retry;
+    PAM_MYSQL_TEST(pam_mysql_breaker_allow(ctx, b));
+
+    pam_mysql_breaker_success(ctx, b, "e");
+    PAM_MYSQL_TEST(b->down_since == 0 && b->failures == 0 && b->retry_at == 0);
+    PAM_MYSQL_TEST(pam_mysql_breaker_allow(ctx, b));
+
+    pam_mysql_release_ctx(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    const char *tmp = getenv("TMPDIR");
+
+    openlog("pam_mysql_test", LOG_PID, LOG_AUTHPRIV);
+
+    snprintf(pam_mysql_test_dir, sizeof(pam_mysql_test_dir), "%s/pam_mysql_test.XXXXXX",
+            tmp != NULL && *tmp != '\0' ? tmp: "/tmp");
+    if (mkdtemp(pam_mysql_test_dir) == NULL) {
+        fprintf(stderr, "pam_mysql_test: %s: %s\n", pam_mysql_test_dir, strerror(errno));
+        return 1;
+    }
+
+    pam_mysql_test_hash();
+    pam_mysql_test_shm();
+    pam_mysql_test_snapshot();
+    pam_mysql_test_spool();
+    pam_mysql_test_hosts();
+    pam_mysql_test_breaker();
+
+    rmdir(pam_mysql_test_dir);
+
+    if (pam_mysql_test_failures > 0) {
+        fprintf(stderr, "pam_mysql_test: %d checks failed\n", pam_mysql_test_failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,464 @@
+/*
+ * pam_mysqld - connection keeper for the PAM module for MySQL
+ *
+ * Copyright (C) 2015-2017 Nigel Cunningham and contributors.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Services such as sshd and login run every authentication in a freshly
+ * forked process, so the module cannot keep a database connection or a
+ * cache from one login to the next. With the "daemon_socket" option the
+ * module forwards its queries to this daemon instead, which keeps pooled
+ * connections and the verification cache for the whole system.
+ *
+ * The daemon is built from the module sources so that both run exactly the
+ * same code against the database.
+ */
+
+#include "pam_mysql.c"
+
+#include <signal.h>
+
+/* clients served at once; more are turned away and connect directly */
+#define PAM_MYSQLD_CLIENTS_MAX 64
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t pam_mysqld_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pam_mysqld_clients = 0;
+#endif
+
+/**
+ * Open the database connection of a daemon-side context.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysqld_open_db(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_err_t err = pam_mysql_open_db(ctx);
+
+    return err == PAM_MYSQL_ERR_BUSY ? PAM_MYSQL_ERR_SUCCESS: err;
+}
+
+/**
+ * Release a daemon-side context, once the log entries it holds back for
+ * its client (see logcoalesce) are written.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ */
+static void pam_mysqld_release(pam_mysql_ctx_t *ctx)
+{
+    pam_mysql_log_pending_flush(ctx);
+    pam_mysql_release_ctx(ctx);
+}
+
+/**
+ * Set up a context from the arguments the module was given.
+ *
+ * @param pam_mysql_ctx_t **pctx
+ *   Receives the new context; a previous one is released.
+ * @param pam_mysql_msg_t *req
+ *   The HELLO request: the pid of the client followed by the arguments.
+ *
+ * @return pam_mysql_err_t
+ *   Indication of success or failure.
+ */
+static pam_mysql_err_t pam_mysqld_hello(pam_mysql_ctx_t **pctx,
+        pam_mysql_msg_t *req)
+{
+    pam_mysql_err_t err;
+    pam_mysql_ctx_t *ctx;
+    int pid;
+    int i;
+
+    if (*pctx != NULL) {
+        pam_mysqld_release(*pctx);
+        *pctx = NULL;
+    }
+
+    if ((err = pam_mysql_msg_int(req, 0, &pid))) {
+        return err;
+    }
+
+    for (i = 1; i < req->nfields; i++) {
+        if (req->fields[i] == NULL) {
+            return PAM_MYSQL_ERR_SYNTAX;
+        }
+    }
+
+    if (NULL == (ctx = xcalloc(1, sizeof(*ctx)))) {
+        syslog(LOG_AUTHPRIV | LOG_CRIT, PAM_MYSQL_LOG_PREFIX "allocation failure at " __FILE__ ":%d", __LINE__);
+        return PAM_MYSQL_ERR_ALLOC;
+    }
+
+    if ((err = pam_mysql_init_ctx(ctx)) ||
+            (err = pam_mysql_parse_args(ctx, req->nfields - 1, req->fields + 1))) {
+        pam_mysql_release_ctx(ctx);
+        return err;
+    }
+
+    if (ctx->config_file != NULL &&
+            pam_mysql_read_config_file(ctx, ctx->config_file) == PAM_MYSQL_ERR_ALLOC) {
+        pam_mysql_release_ctx(ctx);
+        return PAM_MYSQL_ERR_ALLOC;
+    }
+
+    /* never forward to ourselves; share connections between clients */
+    xfree(ctx->daemon_socket);
+    ctx->daemon_socket = NULL;
+    ctx->pool = 1;
+    ctx->peer_pid = (pid_t)pid;
+
+    *pctx = ctx;
+
+    return PAM_MYSQL_ERR_SUCCESS;
+}
+
+/**
+ * Carry out one request.
+ *
+ * @param pam_mysql_ctx_t *ctx
+ *   A pointer to the context data structure.
+ * @param pam_mysql_msg_t *req
+ *   The request.
+ * @param pam_mysql_str_t *resp
+ *   The reply, begun by the caller; result fields are appended to it.
+ *
+ * @return pam_mysql_err_t
+ *   The result of the operation.
+ */
+static pam_mysql_err_t pam_mysqld_dispatch(pam_mysql_ctx_t *ctx,
+        pam_mysql_msg_t *req, pam_mysql_str_t *resp)
+{
+    pam_mysql_err_t err;
+    pam_mysql_err_t cached;
+    int stat;
+
+    switch (req->code) {
+        case PAM_MYSQL_OP_CHECK:
+            if (req->nfields != 3 || req->fields[0] == NULL || req->fields[2] == NULL) {
+                return PAM_MYSQL_ERR_SYNTAX;
+            }
+
+            if (pam_mysql_vcache_get(ctx, req->fields[0], req->fields[1],
+                        req->fields[2][0] == '1', &cached) == 0) {
+                return cached;
+            }
+
+            err = pam_mysql_check_passwd(ctx, req->fields[0], req->fields[1],
+                    req->fields[2][0] == '1');
+            pam_mysql_vcache_put(ctx, req->fields[0], req->fields[1],
+                    req->fields[2][0] == '1', err);
+
+            /* hand the status back for pam_sm_acct_mgmt() */
+            if (err == PAM_MYSQL_ERR_SUCCESS && ctx->stat_user != NULL &&
+                    strcmp(ctx->stat_user, req->fields[0]) == 0) {
+                pam_mysql_msg_add_int(resp, ctx->stat_value);
+            }
+
+            return err;
+
+        case PAM_MYSQL_OP_STAT:
+            if (req->nfields != 1 || req->fields[0] == NULL) {
+                return PAM_MYSQL_ERR_SYNTAX;
+            }
+
+            if ((err = pam_mysql_query_user_stat(ctx, &stat, req->fields[0]))) {
+                return err;
+            }
+
+            return pam_mysql_msg_add_int(resp, stat);
+
+        case PAM_MYSQL_OP_UPDATE:
+            if (req->nfields != 2 || req->fields[0] == NULL) {
+                return PAM_MYSQL_ERR_SYNTAX;
+            }
+
+            if ((err = pam_mysqld_open_db(ctx))) {
+                return err;
+            }
+
+            return pam_mysql_update_passwd(ctx, req->fields[0], req->fields[1]);
+
+        case PAM_MYSQL_OP_LOG:
+            if (req->nfields != 3 || req->fields[0] == NULL || req->fields[1] == NULL) {
+                return PAM_MYSQL_ERR_SYNTAX;
+            }
+
+            return pam_mysql_sql_log(ctx, req->fields[0], req->fields[1], req->fields[2]);
+    }
+
+    return PAM_MYSQL_ERR_NOTIMPL;
+}
+
+/**
+ * Serve a client until it closes the connection.
+ *
+ * @param int fd
+ *   The connected socket.
+ */
+static void pam_mysqld_serve(int fd)
+{
+    pam_mysql_ctx_t *ctx = NULL;
+    pam_mysql_msg_t req;
+    pam_mysql_str_t resp;
+    pam_mysql_err_t err;
+    int sent;
+
+#ifdef SO_PEERCRED
+    {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+
+        memset(&cred, 0, sizeof(cred));
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+                cred.uid != geteuid()) {
+            syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "rejected a client running as uid %d", (int)cred.uid);
+            close(fd);
+            return;
+        }
+    }
+#endif
+
+    for (;;) {
+        if ((err = pam_mysql_msg_recv(fd, &req))) {
+            if (err != PAM_MYSQL_ERR_EOF) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "dropping a client after a bad request (%d)", err);
+            }
+            pam_mysql_msg_destroy(&req);
+            break;
+        }
+
+        if ((err = pam_mysql_msg_begin(&resp, 0)) == PAM_MYSQL_ERR_SUCCESS) {
+            if (req.code == PAM_MYSQL_OP_HELLO) {
+                err = pam_mysqld_hello(&ctx, &req);
+            } else if (ctx == NULL) {
+                err = PAM_MYSQL_ERR_INVAL;
+            } else {
+                err = pam_mysqld_dispatch(ctx, &req, &resp);
+                pam_mysql_release_db(ctx);
+            }
+            resp.p[1] = (char)err;
+        }
+
+        sent = (resp.len > 0 && pam_mysql_msg_send(fd, &resp) == PAM_MYSQL_ERR_SUCCESS);
+
+        pam_mysql_str_destroy(&resp);
+        pam_mysql_msg_destroy(&req);
+
+        if (!sent) {
+            break;
+        }
+    }
+
+    if (ctx != NULL) {
+        pam_mysqld_release(ctx);
+    }
+
+    close(fd);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *pam_mysqld_thread(void *arg)
+{
+    mysql_thread_init();
+
+    pam_mysqld_serve((int)(long)arg);
+
+    mysql_thread_end();
+
+    pthread_mutex_lock(&pam_mysqld_clients_lock);
+    pam_mysqld_clients--;
+    pthread_mutex_unlock(&pam_mysqld_clients_lock);
+
+    return NULL;
+}
+#endif
+
+/**
+ * Create the listening socket.
+ *
+ * @param const char *path
+ *   The path of the socket.
+ *
+ * @return int
+ *   The socket, or -1 on failure.
+ */
+static int pam_mysqld_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "pam_mysqld: socket path too long: %s\n", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("pam_mysqld: socket");
+        return -1;
+    }
+
+    unlink(path);
+
+    /* only the owner (normally root) may talk to us */
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("pam_mysqld: bind");
+        umask(mask);
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("pam_mysqld: listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void pam_mysqld_usage(void)
+{
+    fprintf(stderr, "usage: pam_mysqld [-f] [-c clients] [-s socket]\n"
+            "  -f          stay in the foreground\n"
+            "  -c clients  serve at most this many clients at once (default %d)\n"
+            "  -s socket   listen on socket (default " PAM_MYSQL_DAEMON_SOCKET ")\n",
+            PAM_MYSQLD_CLIENTS_MAX);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = PAM_MYSQL_DAEMON_SOCKET;
+    int foreground = 0;
+    int clients_max = PAM_MYSQLD_CLIENTS_MAX;
+    struct timeval tv;
+    int lfd, fd;
+    int c;
+
+    while ((c = getopt(argc, argv, "fc:s:")) != -1) {
+        switch (c) {
+            case 'f':
+                foreground = 1;
+                break;
+
+            case 'c':
+                if ((clients_max = atoi(optarg)) <= 0) {
+                    pam_mysqld_usage();
+                    return 1;
+                }
+                break;
+
+            case 's':
+                path = optarg;
+                break;
+
+            default:
+                pam_mysqld_usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc) {
+        pam_mysqld_usage();
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((lfd = pam_mysqld_listen(path)) < 0) {
+        return 1;
+    }
+
+    if (!foreground && daemon(0, 0) < 0) {
+        perror("pam_mysqld: daemon");
+        return 1;
+    }
+
+    openlog("pam_mysqld", LOG_PID, LOG_AUTHPRIV);
+    syslog(LOG_AUTHPRIV | LOG_INFO, PAM_MYSQL_LOG_PREFIX "pam_mysqld listening on %s", path);
+
+    /* clients that stop talking are dropped; they keep the connection
+     * between operations, so without threads that has to happen quickly */
+#ifdef HAVE_PTHREAD_H
+    tv.tv_sec = PAM_MYSQL_DAEMON_TIMEOUT * 2;
+#else
+    tv.tv_sec = 1;
+    (void)clients_max;
+#endif
+    tv.tv_usec = 0;
+
+    for (;;) {
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "accept failed (%s)", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+#ifdef HAVE_PTHREAD_H
+        {
+            pthread_t thread;
+            pthread_attr_t attr;
+            int busy;
+
+            pthread_mutex_lock(&pam_mysqld_clients_lock);
+            if (!(busy = (pam_mysqld_clients >= clients_max))) {
+                pam_mysqld_clients++;
+            }
+            pthread_mutex_unlock(&pam_mysqld_clients_lock);
+
+            if (busy) {
+                syslog(LOG_AUTHPRIV | LOG_WARNING, PAM_MYSQL_LOG_PREFIX "serving %d clients already; turning one away", clients_max);
+                close(fd);
+                continue;
+            }
+
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&thread, &attr, pam_mysqld_thread, (void *)(long)fd)) {
+                syslog(LOG_AUTHPRIV | LOG_ERR, PAM_MYSQL_LOG_PREFIX "unable to start a thread");
+                close(fd);
+
+                pthread_mutex_lock(&pam_mysqld_clients_lock);
+                pam_mysqld_clients--;
+                pthread_mutex_unlock(&pam_mysqld_clients_lock);
+            }
+            pthread_attr_destroy(&attr);
+        }
+#else
+        pam_mysqld_serve(fd);
+#endif
+    }
+
+    return 0;
+}